@@ -0,0 +1,165 @@
+#include "zxcc.h"
+
+// 関数単位のコンパイル結果をディスクに保存しておくキャッシュ。
+// 関数のトークン列、関数が参照している宣言、コンパイルオプションから計算した
+// ハッシュ値をキーとし、関数の出力したアセンブリを<キャッシュディレクトリ>/<キー>.sに
+// 保存する。キーが一致した関数はパースとコード生成を省略し、保存済みの出力を使う。
+
+// ハッシュ値は法2^31-1の多項式ハッシュを基数を変えて2つ計算し、62ビットとして使う
+static long hash1;
+static long hash2;
+
+// キャッシュの形式を変えたときは変更して古いキャッシュを無効にする
+static char *cache_version = "zxcc-cache-1";
+
+// コンパイラの実行ファイルのハッシュ値。コード生成を変更したコンパイラが
+// 古いコンパイラの保存した出力を使わないよう、キーに含める。
+static long build_id1;
+static long build_id2;
+
+void cache_hash_begin(void) {
+    hash1 = 0;
+    hash2 = 0;
+    cache_hash_str(cache_version);
+    cache_hash_long(build_id1);
+    cache_hash_long(build_id2);
+}
+
+// h*base+cを2^31-1で割った余りを返す。
+// hは2^31-1未満、baseは2^17未満、cは2^31未満とする。
+static long hash_step(long h, long base, long c) {
+    h = h * base + c;
+    h = (h & 2147483647) + (h >> 31);
+    if(h >= 2147483647) {
+        h -= 2147483647;
+    }
+    return h;
+}
+
+static void hash_word(long c) {
+    hash1 = hash_step(hash1, 257, c);
+    hash2 = hash_step(hash2, 65599, c);
+}
+
+// 3バイトずつまとめてハッシュ値に加える
+void cache_hash_bytes(char *p, int len) {
+    int i = 0;
+    for(; i + 3 <= len; i += 3) {
+        hash_word(((p[i] & 255) << 16) | ((p[i + 1] & 255) << 8) |
+                  (p[i + 2] & 255));
+    }
+    for(; i < len; i++) {
+        hash_word(p[i] & 255);
+    }
+}
+
+void cache_hash_str(char *s) {
+    int len = strlen(s);
+    cache_hash_long(len);
+    cache_hash_bytes(s, len);
+}
+
+// 64ビットの値を31ビット、31ビット、2ビットに分けてハッシュ値に加える
+void cache_hash_long(long val) {
+    hash_word(val & 2147483647);
+    hash_word((val >> 31) & 2147483647);
+    hash_word((val >> 62) & 3);
+}
+
+// これまでに与えたデータのハッシュ値を16進数の文字列として返す
+char *cache_hash_end(void) {
+    char *key = calloc(1, 17);
+    sprintf(key, "%08lx%08lx", hash1, hash2);
+    return key;
+}
+
+static char *cache_path(char *key, char *suffix) {
+    char *path = calloc(1, strlen(opt_cache_dir) + strlen(key) + 32);
+    sprintf(path, "%s/%s%s", opt_cache_dir, key, suffix);
+    return path;
+}
+
+// 実行中のコンパイラの実行ファイルの内容からbuild_id1、build_id2を計算する。
+// 読み出せなかった場合は偽を返す。
+static bool compute_build_id(void) {
+    FILE *fp = fopen("/proc/self/exe", "r");
+    if(!fp) {
+        return false;
+    }
+
+    char buf[65536];
+    hash1 = 0;
+    hash2 = 0;
+    long n;
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        cache_hash_bytes(buf, n);
+    }
+    fclose(fp);
+
+    build_id1 = hash1;
+    build_id2 = hash2;
+    return true;
+}
+
+// キャッシュディレクトリを作成する。
+// 既に存在する場合や作成できなかった場合は何もしない(キャッシュへの保存が失敗するだけ)。
+// コンパイラ自身を識別できない場合は、別のコンパイラの出力を使わないようキャッシュを無効にする。
+void cache_init(void) {
+    if(!compute_build_id()) {
+        opt_cache_dir = NULL;
+        return;
+    }
+    mkdir(opt_cache_dir, 0755);
+}
+
+// キーkeyに対応する保存済みの出力を返す。見つからなかった場合はNULLを返す。
+char *cache_load(char *key, int *len) {
+    char *path = cache_path(key, ".s");
+    FILE *fp = fopen(path, "r");
+    free(path);
+    if(!fp) {
+        return NULL;
+    }
+
+    int cap = 4096;
+    int size = 0;
+    char *buf = malloc(cap);
+    for(;;) {
+        size += fread(buf + size, 1, cap - size, fp);
+        if(size < cap) {
+            break;
+        }
+        cap *= 2;
+        buf = realloc(buf, cap);
+    }
+    fclose(fp);
+
+    *len = size;
+    return buf;
+}
+
+// キーkeyに対応する出力bufを保存する。
+// 並行して動く他のコンパイラが書きかけのファイルを読まないよう、
+// 一時ファイルに書き出してからリネームする。
+void cache_store(char *key, char *buf, int len) {
+    char *tmp = cache_path(key, ".tmp");
+    char suffix[32];
+    sprintf(suffix, ".%d", getpid());
+    strcat(tmp, suffix);
+
+    FILE *fp = fopen(tmp, "w");
+    if(!fp) {
+        free(tmp);
+        return;
+    }
+
+    bool ok = fwrite(buf, 1, len, fp) == len;
+    if(fclose(fp) != 0) ok = false;
+
+    char *path = cache_path(key, ".s");
+    if(!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+}
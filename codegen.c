@@ -1,7 +1,10 @@
 #include "zxcc.h"
 
-// labelの通し番号
-int label_seq_num;
+// テキストセグメントの生成に使うワーカープロセスの最大数
+int codegen_jobs = 1;
+
+// labelの通し番号(関数ごとに1から振り直す)
+static int label_seq_num;
 static int brkseq;
 static int contseq;
 static char *func_name;
@@ -11,6 +14,125 @@ static char *regs_for_args_4[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
 static char *regs_for_args_2[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
 static char *regs_for_args_1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 
+// idx番目の引数を渡すレジスタの、sizeバイト幅での名前を返す
+static char *arg_reg(int idx, int size) {
+    if(size == 1) {
+        return regs_for_args_1[idx];
+    } else if(size == 2) {
+        return regs_for_args_2[idx];
+    } else if(size == 4) {
+        return regs_for_args_4[idx];
+    }
+    assert(size == 8);
+    return regs_for_args_8[idx];
+}
+
+// スタックに積んでいる値の数。関数本体の先頭で0にする。
+// スタックマシンのpush/popを数えて、関数呼び出しのアライメントをコンパイル時に決める。
+static int depth;
+
+// 命令insnによるスタックの深さの変化を記録する
+static void track_depth(char *insn) {
+    if(!strncmp(insn, "push ", 5) || !strcmp(insn, "sub rsp, 8")) {
+        depth++;
+    } else if(!strncmp(insn, "pop ", 4) || !strcmp(insn, "add rsp, 8")) {
+        depth--;
+    }
+}
+
+// 命令を1行出力する。例: emit("pop rax") → "  pop rax"
+static void emit(char *insn) {
+    track_depth(insn);
+    out_str("  ");
+    out_str(insn);
+    out_char('\n');
+}
+
+// 整数のオペランドで終わる命令を出力する。例: emit_i("sub rax, ", 8)
+static void emit_i(char *insn, long val) {
+    track_depth(insn);
+    out_str("  ");
+    out_str(insn);
+    out_int(val);
+    out_char('\n');
+}
+
+// 文字列のオペランドで終わる命令を出力する。例: emit_s("call ", "foo")
+static void emit_s(char *insn, char *s) {
+    track_depth(insn);
+    out_str("  ");
+    out_str(insn);
+    out_str(s);
+    out_char('\n');
+}
+
+// 関数内で一意なラベル名 "prefix.関数名.seq" を出力する
+static void out_label(char *prefix, int seq) {
+    out_str(prefix);
+    out_char('.');
+    out_str(func_name);
+    out_char('.');
+    out_int(seq);
+}
+
+// ラベルを定義する
+static void emit_label(char *prefix, int seq) {
+    out_label(prefix, seq);
+    out_str(":\n");
+}
+
+// ラベルへのジャンプ命令を出力する。例: emit_jump("je", ".Lelse", 3)
+static void emit_jump(char *insn, char *prefix, int seq) {
+    out_str("  ");
+    out_str(insn);
+    out_char(' ');
+    out_label(prefix, seq);
+    out_char('\n');
+}
+
+// 名前付きのラベル "prefix.関数名.name" を出力する。nameがNULLの場合は省略する。
+static void out_label_name(char *prefix, char *name) {
+    out_str(prefix);
+    out_char('.');
+    out_str(func_name);
+    if(name) {
+        out_char('.');
+        out_str(name);
+    }
+}
+
+static void emit_label_name(char *prefix, char *name) {
+    out_label_name(prefix, name);
+    out_str(":\n");
+}
+
+static void emit_jump_name(char *insn, char *prefix, char *name) {
+    out_str("  ");
+    out_str(insn);
+    out_char(' ');
+    out_label_name(prefix, name);
+    out_char('\n');
+}
+
+// シンボルを定義する
+static void emit_symbol(char *name) {
+    out_str(name);
+    out_str(":\n");
+}
+
+// アセンブラ指令を出力する。例: emit_directive(".global ", "main")
+static void emit_directive(char *dir, char *s) {
+    out_str(dir);
+    out_str(s);
+    out_char('\n');
+}
+
+static void emit_directive_i(char *dir, long val) {
+    out_str(dir);
+    out_int(val);
+    out_char('\n');
+}
+
 static void gen(Node *node);
 
 // nodeを左辺値として評価し、そのアドレスをスタックにpushするコードを生成する。
@@ -23,12 +145,12 @@ static void gen_lval(Node *node) {
             }
 
             if(node->var->is_local) {
-                printf("  mov rax, rbp\n");
-                printf("  sub rax, %d\n", node->var->offset);
-                printf("  push rax\n");
+                emit("mov rax, rbp");
+                emit_i("sub rax, ", node->var->offset);
+                emit("push rax");
             } else {
                 // グローバル変数 or 文字列リテラル
-                printf("  push offset %s\n", node->var->name);
+                emit_s("push offset ", node->var->name);
             }
             return;
         case ND_DEREF:
@@ -36,9 +158,9 @@ static void gen_lval(Node *node) {
             return;
         case ND_MEMBER:
             gen_lval(node->lhs);
-            printf("  pop rax\n");
-            printf("  add rax, %d\n", node->member->offset);
-            printf("  push rax\n");
+            emit("pop rax");
+            emit_i("add rax, ", node->member->offset);
+            emit("push rax");
             return;
         default:
             error("引数が左辺値として評価不可能なノードです");
@@ -46,262 +168,1501 @@ static void gen_lval(Node *node) {
 }
 
 static void load(Type *type) {
-    printf("  pop rax\n");
+    emit("pop rax");
 
     if(type->size == 1) {
         // raxが指しているアドレスから1byteロードする(符号拡張あり)
-        printf("  movsx rax, byte ptr [rax]\n");
+        emit("movsx rax, byte ptr [rax]");
     } else if(type->size == 2) {
         // raxが指しているアドレスから2byteロードする(符号拡張あり)
-        printf("  movsx rax, word ptr [rax]\n");
+        emit("movsx rax, word ptr [rax]");
     } else if(type->size == 4) {
         // raxが指しているアドレスから4byteロードする(符号拡張あり)
-        printf("  movsxd rax, dword ptr [rax]\n");
+        emit("movsxd rax, dword ptr [rax]");
     } else {
         assert(type->size == 8);
-        printf("  mov rax, [rax]\n");
+        emit("mov rax, [rax]");
     }
 
-    printf("  push rax\n");
+    emit("push rax");
 }
 
 static void store(Type *type) {
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
+    emit("pop rdi");
+    emit("pop rax");
 
     if(type->ty == BOOL) {
-        printf("  cmp rdi, 0\n");
-        printf("  setne dil\n");
-        printf("  movzb rdi, dil\n");
+        emit("cmp rdi, 0");
+        emit("setne dil");
+        emit("movzb rdi, dil");
     }
 
     if(type->size == 1) {
         // dilから1byteストアする
-        printf("  mov [rax], dil\n");
+        emit("mov [rax], dil");
     } else if(type->size == 2) {
         // diから2byteストアする
-        printf("  mov [rax], di\n");
+        emit("mov [rax], di");
     } else if(type->size == 4) {
         // ediから4byteストアする
-        printf("  mov [rax], edi\n");
+        emit("mov [rax], edi");
     } else {
         assert(type->size == 8);
-        printf("  mov [rax], rdi\n");
+        emit("mov [rax], rdi");
     }
 
-    printf("  push rdi\n");
+    emit("push rdi");
 }
 
-static void truncate(Type *ty) {
-    printf("  pop rax\n");
+static void truncate_to(Type *ty) {
+    emit("pop rax");
 
     if(ty->ty == BOOL) {
-        printf("  cmp rax, 0\n");
-        printf("  setne al\n");
+        emit("cmp rax, 0");
+        emit("setne al");
     }
 
     if(ty->size == 1) {
-        printf("  movsx rax, al\n");
+        emit("movsx rax, al");
     } else if(ty->size == 2) {
-        printf("  movsx rax, ax\n");
+        emit("movsx rax, ax");
     } else if(ty->size == 4) {
-        printf("  movsxd rax, eax\n");
+        emit("movsxd rax, eax");
     }
-    printf("  push rax\n");
+    emit("push rax");
 }
 
 static void inc(Type *ty) {
-    printf("  pop rax\n");
-    printf("  add rax, %d\n", ty->ptr_to ? ty->ptr_to->size : 1);
-    printf("  push rax\n");
+    emit("pop rax");
+    emit_i("add rax, ", ty->ptr_to ? ty->ptr_to->size : 1);
+    emit("push rax");
 }
 
 static void dec(Type *ty) {
-    printf("  pop rax\n");
-    printf("  sub rax, %d\n", ty->ptr_to ? ty->ptr_to->size : 1);
-    printf("  push rax\n");
+    emit("pop rax");
+    emit_i("sub rax, ", ty->ptr_to ? ty->ptr_to->size : 1);
+    emit("push rax");
 }
 
-static void gen_binary(Node *node) {
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
+//
+// 乗除算の強さの低減
+//
+// 要素のサイズ倍や定数による除算を、シフトや逆数の乗算に置き換える。
+// idivは数十サイクルかかるので、定数で割る場合は使わない。
+//
+
+// 即値valが32ビットの符号付き整数に収まるか
+static bool is_imm32(long val) { return val == (int)val; }
+
+// valが2のべき乗ならその指数を、そうでなければ-1を返す
+int log2_exact(long val) {
+    if(val <= 0 || (val & (val - 1))) {
+        return -1;
+    }
+    int k = 0;
+    while(((long)1 << k) != val) {
+        k++;
+    }
+    return k;
+}
+
+// 上位32ビットhiと下位32ビットlo(どちらも0以上2^32未満)を並べた64ビットの値。
+// 最上位ビットは、符号付きの左シフトで溢れないよう別に立てる。
+static long join_halves(long hi, long lo) {
+    long val = ((hi & 0x7fffffff) << 32) | lo;
+    if(hi & ((long)1 << 31)) {
+        val |= -((long)1 << 62) * 2;
+    }
+    return val;
+}
+
+// 2^64を法とするa+b。符号付き整数の加算の溢れは未定義動作なので、
+// 32ビットずつ繰り上げながら足す。
+static long add_mod64(long a, long b) {
+    long mask = ((long)1 << 32) - 1;
+    long lo = (a & mask) + (b & mask);
+    long hi = ((a >> 32) + (b >> 32) + (lo >> 32)) & mask;
+    return join_halves(hi, lo & mask);
+}
+
+// 2^64を法とするa*b。符号付き整数の乗算の溢れは未定義動作なので、
+// 16ビットずつに分けた部分積(32ビットに収まる)を下の桁から繰り上げながら足す。
+static long mul_mod64(long a, long b) {
+    long x[4];
+    long y[4];
+    for(int i = 0; i < 4; i++) {
+        x[i] = (a >> (16 * i)) & 0xffff;
+        y[i] = (b >> (16 * i)) & 0xffff;
+    }
+
+    long r[4];
+    long carry = 0;
+    for(int k = 0; k < 4; k++) {
+        long sum = carry;
+        for(int i = 0; i <= k; i++) {
+            sum += x[i] * y[k - i];
+        }
+        r[k] = sum & 0xffff;
+        carry = sum >> 16;
+    }
+    return join_halves(r[3] << 16 | r[2], r[1] << 16 | r[0]);
+}
+
+// 奇数dの、2^64を法とする乗法の逆元を返す(結果は2^64を法とした値を
+// 符号付きで表したもの)。ニュートン法x = x * (2 - d * x)で1回ごとに正しい
+// ビット数が倍になる(d*d≡1 (mod 8)から始める)。演算は全て2^64を法として行う。
+// d * xは奇数なので、その符号を反転しても溢れない。
+long mod_inverse(long d) {
+    long x = d;
+    for(int i = 0; i < 5; i++) {
+        x = mul_mod64(x, add_mod64(2, -mul_mod64(d, x)));
+    }
+    return x;
+}
+
+// 32ビットに収まる値nを、2のべき乗でない3以上の定数dで割った商を
+// (n * m >> shift) - (n >> 63)で求めるための乗数mを返し、*shiftを設定する。
+//
+// 2^l >= dとしてshift = 31 + l、m = floor(2^shift / d) + 1とすると、
+// m * d - 2^shiftの誤差が商を変えない。m <= 2^32なのでn * mは64ビットに収まり、
+// 負のnでは切り捨てた商に1を足すことで0方向への丸めになる。
+long div_magic(long d, int *shift) {
+    int l = 0;
+    while(((long)1 << l) < d) {
+        l++;
+    }
+    *shift = 31 + l;
+    return ((long)1 << *shift) / d + 1;
+}
+
+// nodeの値が、32ビット以下の整数を符号拡張した値であることが保証されているか
+bool is_int32_value(Node *node) {
+    if(node->type->size > 4 || node->type->ty == ARRAY ||
+       node->type->ty == STRUCT) {
+        return false;
+    }
+    // 変数の読み出しと型変換は符号拡張する
+    return node->kind == ND_VAR || node->kind == ND_MEMBER ||
+           node->kind == ND_DEREF || node->kind == ND_CAST;
+}
+
+// ポインタに足し引きするレジスタregの値を要素のサイズsize倍する
+static void scale_reg(char *reg, long size) {
+    int k = log2_exact(size);
+    if(k == 0) {
+        return;
+    }
+    out_str(k > 0 ? "  shl " : "  imul ");
+    out_str(reg);
+    out_str(", ");
+    out_int(k > 0 ? k : size);
+    out_char('\n');
+}
+
+// raxの値を定数dで割る。除算命令を使わずに済む場合はtrueを返す。
+// int32はraxの値が32ビットに収まることを表す。rdxを作業用に使う。
+static bool gen_div_imm(long d, bool int32) {
+    long ad = d < 0 ? -d : d;
+    int k = log2_exact(ad);
+    if(d == 1) {
+        return true;
+    }
+    if(k > 0) {
+        // 負の値は2^k-1を足してから算術シフトし、0方向に丸める
+        emit("mov rdx, rax");
+        emit("sar rdx, 63");
+        emit_i("shr rdx, ", 64 - k);
+        emit("add rax, rdx");
+        emit_i("sar rax, ", k);
+    } else if(int32 && ad > 2 && is_imm32(d)) {
+        int shift;
+        long m = div_magic(ad, &shift);
+        if(is_imm32(m)) {
+            emit_i("mov rdx, ", m);
+        } else {
+            emit_i("movabs rdx, ", m);
+        }
+        emit("imul rdx, rax");
+        emit_i("sar rdx, ", shift);
+        emit("sar rax, 63");
+        emit("sub rdx, rax");
+        emit("mov rax, rdx");
+    } else {
+        return false;
+    }
+    if(d < 0) {
+        emit("neg rax");
+    }
+    return true;
+}
 
+// raxを要素のサイズsizeで割り切る(ポインタの差)。
+// 割り切れることが分かっているので、2のべき乗の部分はシフトし、
+// 残りの奇数は逆元を掛ける。rdxを作業用に使う。
+static void gen_exact_div(long size) {
+    int k = 0;
+    while(!((size >> k) & 1)) {
+        k++;
+    }
+    if(k > 0) {
+        emit_i("sar rax, ", k);
+    }
+    long odd = size >> k;
+    if(odd == 1) {
+        return;
+    }
+    long inv = mod_inverse(odd);
+    if(is_imm32(inv)) {
+        emit_i("imul rax, rax, ", inv);
+    } else {
+        emit_i("movabs rdx, ", inv);
+        emit("imul rax, rdx");
+    }
+}
+
+// raxとrdiの二項演算を行い、結果をraxに置く
+static void gen_binary_op(Node *node) {
     switch(node->kind) {
         case ND_ADD:
         case ND_ADD_EQ:
-            printf("  add rax, rdi\n");
+            emit("add rax, rdi");
             break;
         case ND_PTR_ADD:
-        case ND_PTR_ADD_EQ:
-            printf("  imul rdi, %d\n", node->type->ptr_to->size);
-            printf("  add rax, rdi\n");
+        case ND_PTR_ADD_EQ: {
+            int size = node->type->ptr_to->size;
+            if(size == 1 || size == 2 || size == 4 || size == 8) {
+                out_str("  lea rax, [rax+rdi*");
+                out_int(size);
+                out_str("]\n");
+                break;
+            }
+            scale_reg("rdi", size);
+            emit("add rax, rdi");
             break;
+        }
         case ND_SUB:
         case ND_SUB_EQ:
-            printf("  sub rax, rdi\n");
+            emit("sub rax, rdi");
             break;
         case ND_PTR_SUB:
         case ND_PTR_SUB_EQ:
-            printf("  imul rdi, %d\n", node->type->ptr_to->size);
-            printf("  sub rax, rdi\n");
+            scale_reg("rdi", node->type->ptr_to->size);
+            emit("sub rax, rdi");
             break;
         case ND_PTR_DIFF:
-            printf("  sub rax, rdi\n");
-            printf("  cqo\n");
-            printf("  mov rdi, %d\n", node->lhs->type->ptr_to->size);
-            printf("  idiv rdi\n");
+            emit("sub rax, rdi");
+            gen_exact_div(node->lhs->type->ptr_to->size);
             break;
         case ND_MUL:
         case ND_MUL_EQ:
-            printf("  imul rax, rdi\n");
+            emit("imul rax, rdi");
             break;
         case ND_DIV:
         case ND_DIV_EQ:
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
+            if(node->rhs->kind == ND_NUM &&
+               gen_div_imm(node->rhs->val, is_int32_value(node->lhs))) {
+                break;
+            }
+            emit("cqo");
+            emit("idiv rdi");
             break;
         case ND_BITAND:
         case ND_BITAND_EQ:
-            printf("  and rax, rdi\n");
+            emit("and rax, rdi");
             break;
         case ND_BITOR:
         case ND_BITOR_EQ:
-            printf("  or rax, rdi\n");
+            emit("or rax, rdi");
             break;
         case ND_BITXOR:
         case ND_BITXOR_EQ:
-            printf("  xor rax, rdi\n");
+            emit("xor rax, rdi");
             break;
         case ND_SHL:
         case ND_SHL_EQ:
-            printf("  mov cl, dil\n");
-            printf("  shl rax, cl\n");
+            emit("mov cl, dil");
+            emit("shl rax, cl");
             break;
         case ND_SHR:
         case ND_SHR_EQ:
-            printf("  mov cl, dil\n");
-            printf("  sar rax, cl\n");
+            emit("mov cl, dil");
+            emit("sar rax, cl");
             break;
         case ND_EQ:
-            printf("  cmp rax, rdi\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
+            emit("cmp rax, rdi");
+            emit("sete al");
+            emit("movzb rax, al");
             break;
         case ND_NE:
-            printf("  cmp rax, rdi\n");
-            printf("  setne al\n");
-            printf("  movzb rax, al\n");
+            emit("cmp rax, rdi");
+            emit("setne al");
+            emit("movzb rax, al");
             break;
         case ND_LT:
-            printf("  cmp rax, rdi\n");
-            printf("  setl al\n");
-            printf("  movzb rax, al\n");
+            emit("cmp rax, rdi");
+            emit("setl al");
+            emit("movzb rax, al");
             break;
         case ND_LE:
-            printf("  cmp rax, rdi\n");
-            printf("  setle al\n");
-            printf("  movzb rax, al\n");
+            emit("cmp rax, rdi");
+            emit("setle al");
+            emit("movzb rax, al");
             break;
     }
+}
 
-    printf("  push rax\n");
+static void gen_binary(Node *node) {
+    emit("pop rdi");
+    emit("pop rax");
+    gen_binary_op(node);
+    emit("push rax");
 }
 
-// 抽象構文木の根ノードを受け取りスタックマシンのコードを生成する
-static void gen(Node *node) {
-    int label_num;
+//
+// 木のパターンによる命令選択(-fisel)
+//
+// 二項演算の右辺が即値やスカラーの変数の場合は、スタックを経由せずに命令の
+// オペランドとして直接使う。複合代入と増減は、メモリ上の値を直接書き換える命令
+// (add dword ptr [rbp-4], 1など)で行う。
+//
+// 変数、メンバ、配列の要素の読み書きは、アドレスを計算してスタックに積む代わりに
+// [rbp-16]、[rip+x+8]、[rax+rdx*4+8]のようなアドレッシングモードにまとめる。
+
+// メモリオペランドのアドレス。var + base + index * scale + dispを表す。
+// baseとindexの値は、この順にスタックに積まれている。
+typedef struct {
+    Var *var;    // 変数(ローカル変数ならrbp相対、グローバル変数ならシンボル)
+    bool base;   // raxに取り出す値を加えるか
+    bool index;  // rdxに取り出す値にscaleを掛けて加えるか
+    int scale;
+    long disp;
+} Addr;
+
+// オペランドの大きさの指定
+static char *ptr_size(int size) {
+    if(size == 1) {
+        return "byte ptr ";
+    } else if(size == 2) {
+        return "word ptr ";
+    } else if(size == 4) {
+        return "dword ptr ";
+    }
+    return "qword ptr ";
+}
+
+// nodeがレジスタを使わずにオペランドにできる葉(即値かスカラーの変数)か
+static bool is_leaf(Node *node) {
+    if(node->kind == ND_NUM) {
+        return node->val == (int)node->val;
+    }
+    return node->kind == ND_VAR && !node->init && node->type->ty != ARRAY &&
+           node->type->ty != STRUCT;
+}
+
+// 変数varのアドレスにする
+static void var_addr(Addr *a, Var *var) {
+    memset(a, 0, sizeof(Addr));
+    a->var = var;
+}
+
+// スタックに積んだアドレスの値をレジスタに取り出す
+static void pop_addr(Addr *a) {
+    if(a->index) {
+        emit("pop rdx");
+    }
+    if(a->base) {
+        emit("pop rax");
+    }
+}
+
+// アドレスaを表すメモリオペランドを出力する。例: "[rbp+rdx*4-16]"
+static void out_addr(Addr *a) {
+    long disp = a->disp;
+    out_char('[');
+    if(a->var && a->var->is_local) {
+        out_str("rbp");
+        disp -= a->var->offset;
+    } else if(a->var) {
+        // インデックスレジスタがある場合はRIP相対にできない
+        if(!a->index) {
+            out_str("rip+");
+        }
+        out_str(a->var->name);
+    } else if(a->base) {
+        out_str("rax");
+    }
+    if(a->index) {
+        if(a->var || a->base) {
+            out_char('+');
+        }
+        out_str("rdx*");
+        out_int(a->scale);
+    }
+    if(disp > 0) {
+        out_char('+');
+    }
+    if(disp != 0) {
+        out_int(disp);
+    }
+    out_char(']');
+}
+
+// sizeバイトのメモリオペランドを出力する
+static void out_mem(Addr *a, int size) {
+    out_str(ptr_size(size));
+    out_addr(a);
+}
+
+// メモリ上のsizeバイトの値を符号拡張してレジスタregに読み込む
+static void load_mem(char *reg, Addr *a, int size) {
+    if(size == 8) {
+        out_str("  mov ");
+    } else if(size == 4) {
+        out_str("  movsxd ");
+    } else {
+        out_str("  movsx ");
+    }
+    out_str(reg);
+    out_str(", ");
+    out_mem(a, size);
+    out_char('\n');
+}
+
+// 葉nodeの値をレジスタregに読み込む
+static void load_leaf(char *reg, Node *node) {
+    if(node->kind == ND_NUM) {
+        out_str("  mov ");
+        out_str(reg);
+        out_str(", ");
+        out_int(node->val);
+        out_char('\n');
+        return;
+    }
+    Addr a;
+    var_addr(&a, node->var);
+    load_mem(reg, &a, node->type->size);
+}
+
+// 二項演算nodeの右辺の即値に掛ける数(ポインタの加減算では要素の大きさ)
+static int imm_scale(Node *node) {
+    if(node->kind == ND_PTR_ADD || node->kind == ND_PTR_SUB ||
+       node->kind == ND_PTR_ADD_EQ || node->kind == ND_PTR_SUB_EQ) {
+        return node->type->ptr_to->size;
+    }
+    return 1;
+}
+
+// アドレスaをraxに求めて積み直し、baseだけのアドレスにする
+static void materialize(Addr *a) {
+    pop_addr(a);
+    out_str("  lea rax, ");
+    out_addr(a);
+    out_char('\n');
+    emit("push rax");
+    memset(a, 0, sizeof(Addr));
+    a->base = true;
+}
+
+static void gen_ptr_addr(Node *node, Addr *a);
+
+// 左辺値nodeのアドレスを求める
+static void gen_addr(Node *node, Addr *a) {
     switch(node->kind) {
-        case ND_NULL:
-            // 何もしない
-            return;
-        case ND_NUM:
-            if(node->val == (int)node->val) {
-                printf("  push %ld\n", node->val);
-            } else {
-                printf("  movabs rax, %ld\n", node->val);
-                printf("  push rax\n");
-            }
-            return;
-        case ND_EXPR_STMT:
-            gen(node->lhs);
-            printf("  add rsp, 8\n");
-            return;
         case ND_VAR:
             if(node->init) {
-                gen(node->init);
-            }
-            gen_lval(node);
-            if(node->type->ty != ARRAY) {
-                load(node->type);
+                break;
             }
+            var_addr(a, node->var);
             return;
         case ND_MEMBER:
-            gen_lval(node);
-            if(node->type->ty != ARRAY) {
-                load(node->type);
-            }
+            gen_addr(node->lhs, a);
+            a->disp += node->member->offset;
             return;
-        case ND_ASSIGN:
-            gen_lval(node->lhs);  // 左辺: 変数のアドレスをpush
-            gen(node->rhs);       // 右辺: 数値をpush
-            store(node->type);
+        case ND_DEREF:
+            gen_ptr_addr(node->lhs, a);
             return;
-        case ND_TERNARY: {
-            int seq = label_seq_num++;
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .Lelse%d\n", seq);
-            gen(node->then);
-            printf("  jmp .Lend%d\n", seq);
-            printf(".Lelse%d:\n", seq);
-            gen(node->els);
-            printf(".Lend%d:\n", seq);
+    }
+
+    gen_lval(node);
+    memset(a, 0, sizeof(Addr));
+    a->base = true;
+}
+
+// ポインタの値を持つ式nodeが指すアドレスを求める
+static void gen_ptr_addr(Node *node, Addr *a) {
+    // 配列は先頭の要素を指すポインタとして扱う
+    if(node->type->ty == ARRAY &&
+       (node->kind == ND_VAR || node->kind == ND_MEMBER ||
+        node->kind == ND_DEREF)) {
+        gen_addr(node, a);
+        return;
+    }
+    if(node->kind == ND_ADDR) {
+        gen_addr(node->lhs, a);
+        return;
+    }
+
+    if(node->kind == ND_PTR_ADD || node->kind == ND_PTR_SUB) {
+        int size = node->type->ptr_to->size;
+        Node *rhs = node->rhs;
+
+        // 定数の添字は変位にまとめる
+        if(rhs->kind == ND_NUM && is_imm32(rhs->val * size)) {
+            long disp = rhs->val * size;
+            if(node->kind == ND_PTR_SUB) {
+                disp = -disp;
+            }
+            gen_ptr_addr(node->lhs, a);
+            if(!is_imm32(a->disp + disp)) {
+                materialize(a);
+            }
+            a->disp += disp;
             return;
         }
-        case ND_PRE_INC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->type);
-            inc(node->type);
-            store(node->type);
-            return;
-        case ND_PRE_DEC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->type);
-            dec(node->type);
-            store(node->type);
-            return;
-        case ND_POST_INC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->type);
-            inc(node->type);
-            store(node->type);
-            dec(node->type);
-            return;
-        case ND_POST_DEC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->type);
-            dec(node->type);
-            store(node->type);
-            inc(node->type);
+
+        // 要素の大きさが1、2、4、8バイトならインデックスレジスタで表す
+        if(node->kind == ND_PTR_ADD &&
+           (size == 1 || size == 2 || size == 4 || size == 8)) {
+            gen_ptr_addr(node->lhs, a);
+            if(a->index) {
+                materialize(a);
+            }
+            gen(rhs);
+            a->index = true;
+            a->scale = size;
             return;
+        }
+    }
+
+    gen(node);
+    memset(a, 0, sizeof(Addr));
+    a->base = true;
+}
+
+// 変数、メンバ、ポインタの指す先nodeの値を、アドレッシングモードを使って読み出す
+static void gen_load(Node *node) {
+    Addr a;
+    gen_addr(node, &a);
+    pop_addr(&a);
+    if(node->type->ty == ARRAY) {
+        out_str("  lea rax, ");
+        out_addr(&a);
+        out_char('\n');
+    } else {
+        load_mem("rax", &a, node->type->size);
+    }
+    emit("push rax");
+}
+
+// 即値valがsizeバイトの符号付き整数に収まるか
+static bool fits_size(long val, int size) {
+    if(size == 1) {
+        return val == (char)val;
+    } else if(size == 2) {
+        return val == (short)val;
+    }
+    return is_imm32(val);
+}
+
+// 代入nodeを、アドレッシングモードを使ってメモリに直接書き込む
+static void gen_store(Node *node) {
+    Type *ty = node->type;
+    Addr a;
+    gen_addr(node->lhs, &a);
+
+    // 即値はそのまま書き込む
+    Node *rhs = node->rhs;
+    if(rhs->kind == ND_NUM && ty->ty != BOOL && fits_size(rhs->val, ty->size)) {
+        pop_addr(&a);
+        out_str("  mov ");
+        out_mem(&a, ty->size);
+        out_str(", ");
+        out_int(rhs->val);
+        out_char('\n');
+        emit_i("push ", rhs->val);
+        return;
+    }
+
+    gen(rhs);
+    emit("pop rdi");
+    pop_addr(&a);
+    if(ty->ty == BOOL) {
+        emit("cmp rdi, 0");
+        emit("setne dil");
+        emit("movzb rdi, dil");
+    }
+    out_str("  mov ");
+    out_mem(&a, ty->size);
+    out_str(", ");
+    out_str(arg_reg(0, ty->size));
+    out_char('\n');
+    emit("push rdi");
+}
+
+// 二項演算nodeの右辺を、即値またはメモリオペランドとして直接取れる命令名を返す。
+// 取れない場合はNULLを返す。
+static char *operand_insn(Node *node) {
+    Node *rhs = node->rhs;
+    bool imm = rhs->kind == ND_NUM;
+
+    // メモリオペランドはraxと同じ8バイトの変数に限る
+    if(!imm && rhs->type->size != 8) {
+        return NULL;
+    }
+
+    switch(node->kind) {
+        case ND_ADD:
+            return "add";
+        case ND_SUB:
+            return "sub";
+        case ND_PTR_ADD:
+            return imm && is_imm32(rhs->val * imm_scale(node)) ? "add" : NULL;
+        case ND_PTR_SUB:
+            return imm && is_imm32(rhs->val * imm_scale(node)) ? "sub" : NULL;
+        case ND_MUL:
+            return "imul";
+        case ND_BITAND:
+            return "and";
+        case ND_BITOR:
+            return "or";
+        case ND_BITXOR:
+            return "xor";
+        case ND_SHL:
+            return imm && rhs->val >= 0 && rhs->val < 64 ? "shl" : NULL;
+        case ND_SHR:
+            return imm && rhs->val >= 0 && rhs->val < 64 ? "sar" : NULL;
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return "cmp";
+    }
+    return NULL;
+}
+
+// 右辺が葉の二項演算を、右辺をスタックに積まずに出力する
+// 二項演算nodeの右辺の即値かメモリオペランドを出力する
+static void out_leaf_operand(Node *node) {
+    if(node->rhs->kind == ND_NUM) {
+        out_int(node->rhs->val * imm_scale(node));
+        return;
+    }
+    Addr a;
+    var_addr(&a, node->rhs->var);
+    out_mem(&a, 8);
+}
+
+static void gen_binary_leaf(Node *node) {
+    gen(node->lhs);
+    emit("pop rax");
+
+    char *insn = operand_insn(node);
+    if(!insn) {
+        load_leaf("rdi", node->rhs);
+        gen_binary_op(node);
+        emit("push rax");
+        return;
+    }
+
+    out_str("  ");
+    out_str(insn);
+    out_str(" rax, ");
+    out_leaf_operand(node);
+    out_char('\n');
+
+    if(node->kind == ND_EQ) {
+        emit("sete al");
+    } else if(node->kind == ND_NE) {
+        emit("setne al");
+    } else if(node->kind == ND_LT) {
+        emit("setl al");
+    } else if(node->kind == ND_LE) {
+        emit("setle al");
+    }
+    if(!strcmp(insn, "cmp")) {
+        emit("movzb rax, al");
+    }
+    emit("push rax");
+}
+
+// 複合代入または増減のnodeを、メモリを直接書き換える命令で行う場合の命令名を返す。
+// 対応する命令がない場合はNULLを返す。
+static char *rmw_insn(Node *node) {
+    switch(node->kind) {
         case ND_ADD_EQ:
         case ND_PTR_ADD_EQ:
+        case ND_PRE_INC:
+        case ND_POST_INC:
+            return "add";
         case ND_SUB_EQ:
         case ND_PTR_SUB_EQ:
-        case ND_MUL_EQ:
-        case ND_DIV_EQ:
-        case ND_SHL_EQ:
+        case ND_PRE_DEC:
+        case ND_POST_DEC:
+            return "sub";
+        case ND_BITAND_EQ:
+            return "and";
+        case ND_BITOR_EQ:
+            return "or";
+        case ND_BITXOR_EQ:
+            return "xor";
+        case ND_SHL_EQ:
+        case ND_SHR_EQ: {
+            // シフト量は即値で、書き換える値のビット数未満の場合に限る
+            Node *rhs = node->rhs;
+            if(rhs->kind != ND_NUM || rhs->val < 0 ||
+               rhs->val >= node->type->size * 8) {
+                return NULL;
+            }
+            return node->kind == ND_SHL_EQ ? "shl" : "sar";
+        }
+    }
+    return NULL;
+}
+
+// 複合代入と増減を、メモリ上の値を直接書き換える命令(read-modify-write)で出力する。
+// 対応する命令がない場合は何も出力せずにfalseを返す。
+static bool gen_rmw(Node *node) {
+    char *insn = rmw_insn(node);
+    if(!insn || node->lhs->type->ty == BOOL) {
+        return false;
+    }
+    Type *ty = node->lhs->type;
+    int size = ty->size;
+
+    bool is_inc = node->kind == ND_PRE_INC || node->kind == ND_PRE_DEC ||
+                  node->kind == ND_POST_INC || node->kind == ND_POST_DEC;
+    bool is_post = node->kind == ND_POST_INC || node->kind == ND_POST_DEC;
+
+    // 右辺が即値で済むか
+    long val = 0;
+    bool imm = false;
+    if(is_inc) {
+        val = ty->ptr_to ? ty->ptr_to->size : 1;
+        imm = true;
+    } else if(node->rhs->kind == ND_NUM) {
+        val = node->rhs->val * imm_scale(node);
+        imm = is_imm32(val);
+    }
+
+    Addr a;
+    gen_addr(node->lhs, &a);
+    if(!imm) {
+        gen(node->rhs);
+        emit("pop rdi");
+        if(imm_scale(node) != 1) {
+            emit_i("imul rdi, ", imm_scale(node));
+        }
+    }
+    pop_addr(&a);
+
+    // 後置の増減は書き換える前の値を返す
+    if(is_post) {
+        load_mem("rdi", &a, size);
+    }
+
+    out_str("  ");
+    out_str(insn);
+    out_char(' ');
+    out_mem(&a, size);
+    out_str(", ");
+    if(imm) {
+        out_int(val);
+    } else {
+        out_str(arg_reg(0, size));
+    }
+    out_char('\n');
+
+    if(is_post) {
+        emit("push rdi");
+    } else {
+        load_mem("rax", &a, size);
+        emit("push rax");
+    }
+    return true;
+}
+
+//
+// switch文の分岐
+//
+// caseの値が密集している場合は、範囲を確かめてからジャンプテーブルで間接ジャンプする。
+// そうでない場合は、値の順に並べたcaseを二分探索する比較の木にする。
+
+// switch文nodeの分岐をジャンプテーブルで行うか
+bool use_jump_table(Node *node) {
+    int n = node->num_cases;
+    if(n < 4) {
+        return false;
+    }
+    long range = node->cases[n - 1]->val - node->cases[0]->val + 1;
+    return range <= n * 3;
+}
+
+// ジャンプテーブルを出力する。tableのi番目には値min+iのcaseのラベル、
+// 対応するcaseがなければ"def_prefix.関数名.def_seq"を置く。
+static void gen_jump_table(Node *node, int table, char *def_prefix,
+                           int def_seq) {
+    out_str(".section .rodata\n");
+    out_str(".align 8\n");
+    emit_label(".L.jtab", table);
+
+    Node **cases = node->cases;
+    long min = cases[0]->val;
+    long max = cases[node->num_cases - 1]->val;
+    int k = 0;
+    for(long v = min; v <= max; v++) {
+        out_str("  .quad ");
+        if(cases[k]->val == v) {
+            out_label(".Lcase", cases[k++]->case_label);
+        } else {
+            out_label(def_prefix, def_seq);
+        }
+        out_char('\n');
+    }
+    out_str(".text\n");
+}
+
+// cases[lo]からcases[hi-1]までを二分探索する比較の木を出力する
+static void gen_case_tree(Node **cases, int lo, int hi, char *def_prefix,
+                          int def_seq) {
+    // 少ない場合は順に比較する
+    if(hi - lo <= 4) {
+        for(int i = lo; i < hi; i++) {
+            emit_i("cmp rax, ", cases[i]->val);
+            emit_jump("je", ".Lcase", cases[i]->case_label);
+        }
+        emit_jump("jmp", def_prefix, def_seq);
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    int seq = label_seq_num++;
+    emit_i("cmp rax, ", cases[mid]->val);
+    emit_jump("je", ".Lcase", cases[mid]->case_label);
+    emit_jump("jg", ".L.sw", seq);
+    gen_case_tree(cases, lo, mid, def_prefix, def_seq);
+    emit_label(".L.sw", seq);
+    gen_case_tree(cases, mid + 1, hi, def_prefix, def_seq);
+}
+
+// raxの値に応じて、switch文nodeのcaseのラベルへジャンプする。
+// 一致するcaseがなければ"def_prefix.関数名.def_seq"へジャンプする。
+static void gen_switch_jump(Node *node, char *def_prefix, int def_seq) {
+    if(!use_jump_table(node)) {
+        gen_case_tree(node->cases, 0, node->num_cases, def_prefix, def_seq);
+        return;
+    }
+
+    Node **cases = node->cases;
+    long min = cases[0]->val;
+    long max = cases[node->num_cases - 1]->val;
+    if(min != 0) {
+        emit_i("sub rax, ", min);
+    }
+    // 符号なしで比較して、範囲外の値を負の値と合わせて除く
+    emit_i("cmp rax, ", max - min);
+    emit_jump("ja", def_prefix, def_seq);
+
+    int table = label_seq_num++;
+    out_str("  jmp qword ptr [");
+    out_label(".L.jtab", table);
+    out_str("+rax*8]\n");
+    gen_jump_table(node, table, def_prefix, def_seq);
+}
+
+//
+// レジスタスタックによる式の評価(-fregstack)
+//
+// 演算子と変数からなる式の木を、push/popを使わずに作業用レジスタの上で評価する。
+// 作業用レジスタはスタックのように使い、深さbaseの値はregstack_8[base]に置く。
+// 二項演算子では評価に必要なレジスタ数(Sethi–Ullman数)が多い方の子を先に評価して
+// 使用するレジスタ数を抑え、それでも足りない場合だけスタックに退避する。
+
+static char *regstack_8[] = {"rdi", "rsi", "r8", "r9", "r10", "r11"};
+static char *regstack_4[] = {"edi", "esi", "r8d", "r9d", "r10d", "r11d"};
+static char *regstack_2[] = {"di", "si", "r8w", "r9w", "r10w", "r11w"};
+static char *regstack_1[] = {"dil", "sil", "r8b", "r9b", "r10b", "r11b"};
+static int num_regstack = 6;
+
+static bool is_binary(Node *node) {
+    switch(node->kind) {
+        case ND_ADD:
+        case ND_PTR_ADD:
+        case ND_SUB:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_BITAND:
+        case ND_BITOR:
+        case ND_BITXOR:
+        case ND_SHL:
+        case ND_SHR:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return true;
+    }
+    return false;
+}
+
+// nodeをレジスタスタック上で評価するか。
+// それ以外のノードは、部分木ごとにスタックマシンで評価してレジスタに取り出す。
+static bool is_reg_node(Node *node) {
+    switch(node->kind) {
+        case ND_NUM:
+        case ND_NOT:
+        case ND_BITNOT:
+        case ND_CAST:
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_MEMBER:
+            return true;
+        case ND_VAR:
+            return !node->init;
+    }
+    return is_binary(node);
+}
+
+// node以下が全てレジスタスタック上で評価でき、副作用を持たないか
+static bool is_pure(Node *node) {
+    if(!node) {
+        return true;
+    }
+    return is_reg_node(node) && is_pure(node->lhs) && is_pure(node->rhs);
+}
+
+// nodeの評価に必要な作業用レジスタの数(Sethi–Ullman数)
+static int reg_need(Node *node) {
+    if(!is_reg_node(node) || !node->lhs) {
+        return 1;
+    }
+    if(!is_binary(node)) {
+        return reg_need(node->lhs);
+    }
+
+    int l = reg_need(node->lhs);
+    int r = reg_need(node->rhs);
+    if(l == r) {
+        return l + 1;
+    }
+    return l > r ? l : r;
+}
+
+static void gen_reg(Node *node, int base);
+
+// レジスタスタックで扱えないノードをスタックマシンで評価し、結果をregstack_8[base]に
+// 置く。関数呼び出しなどで壊されないよう、評価中のレジスタは退避しておく。
+static void gen_reg_fallback(Node *node, int base, bool lval) {
+    for(int i = 0; i < base; i++) {
+        emit_s("push ", regstack_8[i]);
+    }
+    if(lval) {
+        gen_lval(node);
+    } else {
+        gen(node);
+    }
+    emit("pop rax");
+    for(int i = base - 1; i >= 0; i--) {
+        emit_s("pop ", regstack_8[i]);
+    }
+    out_str("  mov ");
+    out_str(regstack_8[base]);
+    out_str(", rax\n");
+}
+
+// nodeのアドレスをregstack_8[base]に求める
+static void gen_reg_addr(Node *node, int base) {
+    char *r = regstack_8[base];
+    switch(node->kind) {
+        case ND_VAR:
+            if(node->init) {
+                break;
+            }
+            out_str("  ");
+            if(node->var->is_local) {
+                out_str("lea ");
+                out_str(r);
+                out_str(", [rbp-");
+                out_int(node->var->offset);
+                out_str("]\n");
+            } else {
+                out_str("mov ");
+                out_str(r);
+                out_str(", offset ");
+                out_str(node->var->name);
+                out_char('\n');
+            }
+            return;
+        case ND_DEREF:
+            gen_reg(node->lhs, base);
+            return;
+        case ND_MEMBER:
+            gen_reg_addr(node->lhs, base);
+            out_str("  add ");
+            out_str(r);
+            out_str(", ");
+            out_int(node->member->offset);
+            out_char('\n');
+            return;
+    }
+    gen_reg_fallback(node, base, true);
+}
+
+// "insn dst, src"の形の命令を出力する
+static void emit_rr(char *insn, char *dst, char *src) {
+    out_str("  ");
+    out_str(insn);
+    out_char(' ');
+    out_str(dst);
+    out_str(", ");
+    out_str(src);
+    out_char('\n');
+}
+
+// regstack_8[base]が指すアドレスから型tyの値を読み出す
+static void gen_reg_load(Type *ty, int base) {
+    char *r = regstack_8[base];
+    if(ty->size == 1) {
+        out_str("  movsx ");
+        out_str(r);
+        out_str(", byte ptr [");
+    } else if(ty->size == 2) {
+        out_str("  movsx ");
+        out_str(r);
+        out_str(", word ptr [");
+    } else if(ty->size == 4) {
+        out_str("  movsxd ");
+        out_str(r);
+        out_str(", dword ptr [");
+    } else {
+        out_str("  mov ");
+        out_str(r);
+        out_str(", [");
+    }
+    out_str(r);
+    out_str("]\n");
+}
+
+// 二項演算を行う。左辺はrax、右辺はレジスタrhsにあり、結果をレジスタdstに置く。
+static void gen_reg_op(Node *node, char *dst, char *rhs) {
+    switch(node->kind) {
+        case ND_ADD:
+            emit_rr("add", "rax", rhs);
+            break;
+        case ND_PTR_ADD:
+            scale_reg(rhs, node->type->ptr_to->size);
+            emit_rr("add", "rax", rhs);
+            break;
+        case ND_SUB:
+            emit_rr("sub", "rax", rhs);
+            break;
+        case ND_PTR_SUB:
+            scale_reg(rhs, node->type->ptr_to->size);
+            emit_rr("sub", "rax", rhs);
+            break;
+        case ND_PTR_DIFF:
+            emit_rr("sub", "rax", rhs);
+            gen_exact_div(node->lhs->type->ptr_to->size);
+            break;
+        case ND_MUL:
+            emit_rr("imul", "rax", rhs);
+            break;
+        case ND_DIV:
+            if(node->rhs->kind == ND_NUM &&
+               gen_div_imm(node->rhs->val, is_int32_value(node->lhs))) {
+                break;
+            }
+            emit("cqo");
+            emit_s("idiv ", rhs);
+            break;
+        case ND_BITAND:
+            emit_rr("and", "rax", rhs);
+            break;
+        case ND_BITOR:
+            emit_rr("or", "rax", rhs);
+            break;
+        case ND_BITXOR:
+            emit_rr("xor", "rax", rhs);
+            break;
+        case ND_SHL:
+            emit_rr("mov", "rcx", rhs);
+            emit("shl rax, cl");
+            break;
+        case ND_SHR:
+            emit_rr("mov", "rcx", rhs);
+            emit("sar rax, cl");
+            break;
+        case ND_EQ:
+            emit_rr("cmp", "rax", rhs);
+            emit("sete al");
+            emit("movzb rax, al");
+            break;
+        case ND_NE:
+            emit_rr("cmp", "rax", rhs);
+            emit("setne al");
+            emit("movzb rax, al");
+            break;
+        case ND_LT:
+            emit_rr("cmp", "rax", rhs);
+            emit("setl al");
+            emit("movzb rax, al");
+            break;
+        case ND_LE:
+            emit_rr("cmp", "rax", rhs);
+            emit("setle al");
+            emit("movzb rax, al");
+            break;
+    }
+    emit_rr("mov", dst, "rax");
+}
+
+static void gen_reg_binary(Node *node, int base) {
+    char *r = regstack_8[base];
+
+    // 必要なレジスタが多い方を先に評価する。
+    // 評価順で結果が変わらないよう、副作用を含む式では入れ替えない。
+    Node *first = node->lhs;
+    Node *second = node->rhs;
+    bool swapped = false;
+    if(reg_need(node->rhs) > reg_need(node->lhs) && is_pure(node->lhs) &&
+       is_pure(node->rhs)) {
+        first = node->rhs;
+        second = node->lhs;
+        swapped = true;
+    }
+
+    gen_reg(first, base);
+
+    if(base + 1 < num_regstack) {
+        char *next = regstack_8[base + 1];
+        gen_reg(second, base + 1);
+        emit_rr("mov", "rax", swapped ? next : r);
+        gen_reg_op(node, r, swapped ? r : next);
+        return;
+    }
+
+    // レジスタが足りない場合は、先に評価した値をスタックに退避する
+    emit_s("push ", r);
+    gen_reg(second, base);
+    emit("pop rax");
+    if(swapped) {
+        emit_rr("xchg", "rax", r);
+    }
+    gen_reg_op(node, r, r);
+}
+
+// 式nodeの値をregstack_8[base]に求める。regstack_8[base+1]以降は壊してよい。
+static void gen_reg(Node *node, int base) {
+    if(!is_reg_node(node)) {
+        gen_reg_fallback(node, base, false);
+        return;
+    }
+
+    char *r = regstack_8[base];
+    switch(node->kind) {
+        case ND_NUM:
+            out_str(node->val == (int)node->val ? "  mov " : "  movabs ");
+            out_str(r);
+            out_str(", ");
+            out_int(node->val);
+            out_char('\n');
+            return;
+        case ND_VAR:
+        case ND_MEMBER:
+        case ND_DEREF:
+            if(node->kind == ND_DEREF) {
+                gen_reg(node->lhs, base);
+            } else {
+                gen_reg_addr(node, base);
+            }
+            if(node->type->ty != ARRAY) {
+                gen_reg_load(node->type, base);
+            }
+            return;
+        case ND_ADDR:
+            gen_reg_addr(node->lhs, base);
+            return;
+        case ND_CAST:
+            gen_reg(node->lhs, base);
+            if(node->type->ty == BOOL) {
+                emit_rr("cmp", r, "0");
+                emit("setne al");
+                emit_rr("movzb", r, "al");
+            } else if(node->type->size == 1) {
+                emit_rr("movsx", r, regstack_1[base]);
+            } else if(node->type->size == 2) {
+                emit_rr("movsx", r, regstack_2[base]);
+            } else if(node->type->size == 4) {
+                emit_rr("movsxd", r, regstack_4[base]);
+            }
+            return;
+        case ND_NOT:
+            gen_reg(node->lhs, base);
+            emit_rr("cmp", r, "0");
+            emit("sete al");
+            emit_rr("movzb", r, "al");
+            return;
+        case ND_BITNOT:
+            gen_reg(node->lhs, base);
+            emit_s("not ", r);
+            return;
+    }
+    gen_reg_binary(node, base);
+}
+
+//
+// 条件分岐
+//
+// if文やループの条件は0/1の値にせず、比較の結果のフラグで直接分岐する。
+// cmpと条件ジャンプを隣接させると、CPUが1命令に融合して実行できる。
+// &&、||、!は、値を作らずに分岐先を付け替えて評価する。
+//
+
+// 比較nodeの左辺と右辺をcmp命令で比較する
+static void gen_compare(Node *node) {
+    if(opt_regstack && is_reg_node(node)) {
+        gen_reg(node->lhs, 0);
+        gen_reg(node->rhs, 1);
+        emit_rr("cmp", regstack_8[0], regstack_8[1]);
+        return;
+    }
+
+    gen(node->lhs);
+    if(opt_isel && is_leaf(node->rhs) && operand_insn(node)) {
+        emit("pop rax");
+        out_str("  cmp rax, ");
+        out_leaf_operand(node);
+        out_char('\n');
+        return;
+    }
+    gen(node->rhs);
+    emit("pop rdi");
+    emit("pop rax");
+    emit("cmp rax, rdi");
+}
+
+// 比較nodeが成り立つ場合(whenが偽なら成り立たない場合)の条件ジャンプ命令
+static char *jump_insn(Node *node, bool when) {
+    switch(node->kind) {
+        case ND_EQ:
+            return when ? "je" : "jne";
+        case ND_NE:
+            return when ? "jne" : "je";
+        case ND_LT:
+            return when ? "jl" : "jge";
+        case ND_LE:
+            return when ? "jle" : "jg";
+    }
+    return NULL;
+}
+
+// 条件nodeの真偽がwhenと等しければラベルprefix.seqへジャンプし、
+// そうでなければ次の命令に進むコードを出力する
+static void gen_branch(Node *node, bool when, char *prefix, int seq) {
+    switch(node->kind) {
+        case ND_NUM:
+            if((node->val != 0) == when) {
+                emit_jump("jmp", prefix, seq);
+            }
+            return;
+        case ND_NOT:
+            gen_branch(node->lhs, !when, prefix, seq);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            // &&が偽になる(||が真になる)のは、どちらかの辺がそうなる場合
+            bool is_and = node->kind == ND_LOGAND;
+            if(when != is_and) {
+                gen_branch(node->lhs, when, prefix, seq);
+                gen_branch(node->rhs, when, prefix, seq);
+                return;
+            }
+            // 左辺で結果が決まる場合は右辺を飛ばす
+            int skip = label_seq_num++;
+            gen_branch(node->lhs, !is_and, ".L.skip", skip);
+            gen_branch(node->rhs, when, prefix, seq);
+            emit_label(".L.skip", skip);
+            return;
+        }
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            gen_compare(node);
+            emit_jump(jump_insn(node, when), prefix, seq);
+            return;
+    }
+
+    gen(node);
+    emit("pop rax");
+    emit("cmp rax, 0");
+    emit_jump(when ? "jne" : "je", prefix, seq);
+}
+
+//
+// ループの回転
+//
+// while、forループは、最初に1回だけ条件を判定した後、本体の末尾で条件を判定して
+// 先頭に戻るdo-while形式にする。1周あたりの分岐が、条件判定と無条件ジャンプの
+// 2回から、後方への条件ジャンプ1回に減る。
+//
+//   if(!cond) goto break;
+// begin:
+//   本体
+// continue:
+//   post
+//   if(cond) goto begin;
+// break:
+//
+// 条件式を2箇所に出力するので、大きな条件式やラベルを含む条件式の場合は回転しない。
+//
+
+// 回転するループの条件式のノード数の上限
+static int rotate_max_nodes = 32;
+
+// 条件式nodeのノード数を数える。ラベルを含む場合は上限より大きな値を返す。
+static int count_cond(Node *node) {
+    if(!node) {
+        return 0;
+    }
+    if(node->kind == ND_LABEL || node->kind == ND_CASE) {
+        return rotate_max_nodes + 1;
+    }
+
+    int n = 1 + count_cond(node->lhs) + count_cond(node->rhs) +
+            count_cond(node->cond) + count_cond(node->then) +
+            count_cond(node->els) + count_cond(node->init) +
+            count_cond(node->post);
+    for(Node *cur = node->block; cur; cur = cur->next) {
+        n += count_cond(cur);
+    }
+    for(Node *cur = node->args; cur; cur = cur->next) {
+        n += count_cond(cur);
+    }
+    return n;
+}
+
+// while、forループnodeを回転するか
+bool can_rotate(Node *node) {
+    return !node->cond || count_cond(node->cond) <= rotate_max_nodes;
+}
+
+// 抽象構文木の根ノードを受け取りスタックマシンのコードを生成する
+static void gen(Node *node) {
+    // 数値以外の式はレジスタスタック上で評価し、結果だけをpushする
+    if(opt_regstack && is_reg_node(node) && node->kind != ND_NUM) {
+        gen_reg(node, 0);
+        emit_s("push ", regstack_8[0]);
+        return;
+    }
+
+    // 複合代入と増減はメモリを直接書き換える
+    if(opt_isel && gen_rmw(node)) {
+        return;
+    }
+
+    int label_num;
+    switch(node->kind) {
+        case ND_NULL:
+            // 何もしない
+            return;
+        case ND_NUM:
+            if(node->val == (int)node->val) {
+                emit_i("push ", node->val);
+            } else {
+                emit_i("movabs rax, ", node->val);
+                emit("push rax");
+            }
+            return;
+        case ND_EXPR_STMT:
+            gen(node->lhs);
+            emit("add rsp, 8");
+            return;
+        case ND_VAR:
+            if(opt_isel) {
+                gen_load(node);
+                return;
+            }
+            gen_lval(node);
+            if(node->type->ty != ARRAY) {
+                load(node->type);
+            }
+            return;
+        case ND_MEMBER:
+            if(opt_isel) {
+                gen_load(node);
+                return;
+            }
+            gen_lval(node);
+            if(node->type->ty != ARRAY) {
+                load(node->type);
+            }
+            return;
+        case ND_ASSIGN:
+            if(opt_isel) {
+                gen_store(node);
+                return;
+            }
+            gen_lval(node->lhs);  // 左辺: 変数のアドレスをpush
+            gen(node->rhs);       // 右辺: 数値をpush
+            store(node->type);
+            return;
+        case ND_TERNARY: {
+            int seq = label_seq_num++;
+            gen_branch(node->cond, false, ".Lelse", seq);
+            int d = depth;
+            gen(node->then);
+            emit_jump("jmp", ".Lend", seq);
+            emit_label(".Lelse", seq);
+            depth = d;  // elseはthenと同じ深さから始まる
+            gen(node->els);
+            emit_label(".Lend", seq);
+            return;
+        }
+        case ND_PRE_INC:
+            gen_lval(node->lhs);
+            emit("push [rsp]");
+            load(node->type);
+            inc(node->type);
+            store(node->type);
+            return;
+        case ND_PRE_DEC:
+            gen_lval(node->lhs);
+            emit("push [rsp]");
+            load(node->type);
+            dec(node->type);
+            store(node->type);
+            return;
+        case ND_POST_INC:
+            gen_lval(node->lhs);
+            emit("push [rsp]");
+            load(node->type);
+            inc(node->type);
+            store(node->type);
+            dec(node->type);
+            return;
+        case ND_POST_DEC:
+            gen_lval(node->lhs);
+            emit("push [rsp]");
+            load(node->type);
+            dec(node->type);
+            store(node->type);
+            inc(node->type);
+            return;
+        case ND_ADD_EQ:
+        case ND_PTR_ADD_EQ:
+        case ND_SUB_EQ:
+        case ND_PTR_SUB_EQ:
+        case ND_MUL_EQ:
+        case ND_DIV_EQ:
+        case ND_SHL_EQ:
         case ND_SHR_EQ:
         case ND_BITAND_EQ:
         case ND_BITOR_EQ:
         case ND_BITXOR_EQ:
             gen_lval(node->lhs);
-            printf("  push [rsp]\n");
+            emit("push [rsp]");
             load(node->lhs->type);
             gen(node->rhs);
             gen_binary(node);
@@ -312,9 +1673,23 @@ static void gen(Node *node) {
             gen(node->rhs);
             return;
         case ND_ADDR:
+            if(opt_isel) {
+                Addr a;
+                gen_addr(node->lhs, &a);
+                pop_addr(&a);
+                out_str("  lea rax, ");
+                out_addr(&a);
+                out_char('\n');
+                emit("push rax");
+                return;
+            }
             gen_lval(node->lhs);
             return;
         case ND_DEREF:
+            if(opt_isel) {
+                gen_load(node);
+                return;
+            }
             gen(node->lhs);
             if(node->type->ty != ARRAY) {
                 load(node->type);
@@ -322,77 +1697,62 @@ static void gen(Node *node) {
             return;
         case ND_NOT:
             gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            printf("  push rax\n");
+            emit("pop rax");
+            emit("cmp rax, 0");
+            emit("sete al");
+            emit("movzb rax, al");
+            emit("push rax");
             return;
         case ND_BITNOT:
             gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  not rax\n");
-            printf("  push rax\n");
+            emit("pop rax");
+            emit("not rax");
+            emit("push rax");
             return;
         case ND_LOGAND: {
             int seq = label_seq_num++;
-            gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .L.false.%d\n", seq);
-            gen(node->rhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .L.false.%d\n", seq);
-            printf("  push 1\n");
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.false.%d:\n", seq);
-            printf("  push 0\n");
-            printf(".L.end.%d:\n", seq);
+            gen_branch(node, false, ".L.cond_f", seq);
+            emit("push 1");
+            emit_jump("jmp", ".L.end", seq);
+            emit_label(".L.cond_f", seq);
+            depth--;  // 2つの分岐のどちらか一方だけが値を積む
+            emit("push 0");
+            emit_label(".L.end", seq);
             return;
         }
         case ND_LOGOR: {
             int seq = label_seq_num++;
-            gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  jne .L.true.%d\n", seq);
-            gen(node->rhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  jne .L.true.%d\n", seq);
-            printf("  push 0\n");
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.true.%d:\n", seq);
-            printf("  push 1\n");
-            printf(".L.end.%d:\n", seq);
+            gen_branch(node, true, ".L.cond_t", seq);
+            emit("push 0");
+            emit_jump("jmp", ".L.end", seq);
+            emit_label(".L.cond_t", seq);
+            depth--;  // 2つの分岐のどちらか一方だけが値を積む
+            emit("push 1");
+            emit_label(".L.end", seq);
             return;
         }
         case ND_RETURN:
             if(node->lhs) {
                 gen(node->lhs);
-                printf("  pop rax\n");
+                emit("pop rax");
             }
-            printf("  jmp .L.return.%s\n", func_name);
+            emit_s("jmp .L.return.", func_name);
             return;
         case ND_IF:
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
             label_num = label_seq_num++;
             if(node->els) {
                 // elseあり
-                printf("  je  .Lelse%d\n", label_num);
+                gen_branch(node->cond, false, ".Lelse", label_num);
                 gen(node->then);
-                printf("  jmp .Lend%d\n", label_num);
-                printf(".Lelse%d:\n", label_num);
+                emit_jump("jmp", ".Lend", label_num);
+                emit_label(".Lelse", label_num);
                 gen(node->els);
-                printf(".Lend%d:\n", label_num);
+                emit_label(".Lend", label_num);
             } else {
                 // elseなし
-                printf("  je  .Lend%d\n", label_num);
+                gen_branch(node->cond, false, ".Lend", label_num);
                 gen(node->then);
-                printf(".Lend%d:\n", label_num);
+                emit_label(".Lend", label_num);
             }
             return;
         case ND_WHILE: {
@@ -401,300 +1761,1156 @@ static void gen(Node *node) {
             int cont = contseq;
             brkseq = contseq = label_num;
 
-            printf(".Lcontinue%d:\n", label_num);
+            if(can_rotate(node)) {
+                gen_branch(node->cond, false, ".Lbreak", label_num);
+                emit_label(".Lbegin", label_num);
+                gen(node->then);
+                emit_label(".Lcontinue", label_num);
+                gen_branch(node->cond, true, ".Lbegin", label_num);
+                emit_label(".Lbreak", label_num);
+            } else {
+                emit_label(".Lcontinue", label_num);
+                gen_branch(node->cond, false, ".Lbreak", label_num);
+                gen(node->then);
+                emit_jump("jmp", ".Lcontinue", label_num);
+                emit_label(".Lbreak", label_num);
+            }
+
+            brkseq = brk;
+            contseq = cont;
+            return;
+        }
+        case ND_FOR: {
+            label_num = label_seq_num++;
+            int brk = brkseq;
+            int cont = contseq;
+            brkseq = contseq = label_num;
+
+            if(node->init) {
+                gen(node->init);
+            }
+
+            // cond==NULLの場合.LendXXXラベルへのジャンプ処理を出力しない(=無限ループ)
+            bool rotate = can_rotate(node);
+            if(node->cond && rotate) {
+                gen_branch(node->cond, false, ".Lbreak", label_num);
+            }
+            emit_label(".Lbegin", label_num);
+            if(node->cond && !rotate) {
+                gen_branch(node->cond, false, ".Lbreak", label_num);
+            }
+
+            gen(node->then);
+            emit_label(".Lcontinue", label_num);
+            if(node->post) {
+                gen(node->post);
+            }
+            if(node->cond && rotate) {
+                gen_branch(node->cond, true, ".Lbegin", label_num);
+            } else {
+                emit_jump("jmp", ".Lbegin", label_num);
+            }
+            emit_label(".Lbreak", label_num);
+
+            brkseq = brk;
+            contseq = cont;
+            return;
+        }
+        case ND_DO: {
+            int seq = label_seq_num++;
+            int brk = brkseq;
+            int cont = contseq;
+            brkseq = contseq = seq;
+
+            emit_label(".Lbegin", seq);
+            gen(node->then);
+            emit_label(".Lcontinue", seq);
+            gen_branch(node->cond, true, ".Lbegin", seq);
+            emit_label(".Lbreak", seq);
+
+            brkseq = brk;
+            contseq = cont;
+            return;
+        }
+        case ND_SWITCH: {
+            int seq = label_seq_num++;
+            int brk = brkseq;
+            brkseq = seq;
+            node->case_label = seq;
+
             gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .Lbreak%d\n", label_num);
+            emit("pop rax");
+
+            for(int i = 0; i < node->num_cases; i++) {
+                node->cases[i]->case_label = label_seq_num++;
+                node->cases[i]->case_end_label = seq;
+            }
+
+            // どのcaseにも一致しない場合の飛び先
+            if(node->default_case) {
+                int i = label_seq_num++;
+                node->default_case->case_end_label = seq;
+                node->default_case->case_label = i;
+                gen_switch_jump(node, ".Lcase", i);
+            } else {
+                gen_switch_jump(node, ".Lbreak", seq);
+            }
+
             gen(node->then);
-            printf("  jmp .Lcontinue%d\n", label_num);
-            printf(".Lbreak%d:\n", label_num);
+            emit_label(".Lbreak", seq);
+
+            brkseq = brk;
+            return;
+        }
+        case ND_CASE:
+            emit_label(".Lcase", node->case_label);
+            gen(node->lhs);
+            return;
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            for(Node *cur = node->block; cur; cur = cur->next) {
+                gen(cur);
+            }
+            return;
+        case ND_BREAK:
+            if(brkseq == 0) {
+                error("不正なbreakです");
+            }
+            emit_jump("jmp", ".Lbreak", brkseq);
+            return;
+        case ND_CONTINUE:
+            if(contseq == 0) {
+                error("不正なcontinueです");
+            }
+            emit_jump("jmp", ".Lcontinue", contseq);
+            return;
+        case ND_GOTO:
+            emit_jump_name("jmp", ".Llabel", node->label_name);
+            return;
+        case ND_LABEL:
+            emit_label_name(".Llabel", node->label_name);
+            gen(node->lhs);
+            return;
+        case ND_FUNCCALL:
+            if(!strcmp(node->func_name, "__builtin_va_start")) {
+                gen(node->args);
+                emit("pop rax");
+                emit("mov edi, dword ptr [rbp-8]");
+                emit("mov dword ptr [rax], 0");
+                emit("mov dword ptr [rax+4], 0");
+                emit("mov qword ptr [rax+8], rdi");
+                emit("mov qword ptr [rax+16], 0");
+                emit("push rax");
+                return;
+            }
+
+            int args_count = 0;
+            for(Node *cur = node->args; cur; cur = cur->next) {
+                gen(cur);
+                args_count++;
+            }
+            if(args_count > 6) {
+                error("%s: , 7個以上の引数を持つ関数です", node->func_name);
+            }
+            for(int i = args_count - 1; i >= 0; i--) {
+                emit_s("pop ", regs_for_args_8[i]);
+            }
+
+            // x86-64のABIに従ってcall命令実行前にrspを16バイトでアライメントする必要がある。
+            // スタックフレームは16バイト境界に揃えてあるので、積んでいる値が奇数個の
+            // 場合だけrspを調整する。
+            bool pad = depth & 1;
+            if(pad) {
+                emit("sub rsp, 8");
+            }
+            // 可変長引数の関数には、alでベクタレジスタで渡す引数の数(0)を渡す
+            if(node->is_variadic_call) {
+                emit("mov rax, 0");
+            }
+            emit_s("call ", node->func_name);
+            if(pad) {
+                emit("add rsp, 8");
+            }
+            if(node->type->ty == BOOL) {
+                emit("movzb rax, al");
+            }
+            emit("push rax");
+            return;
+        case ND_CAST:
+            gen(node->lhs);
+            truncate_to(node->type);
+            return;
+    }
+
+    if(opt_isel && is_leaf(node->rhs)) {
+        gen_binary_leaf(node);
+        return;
+    }
+
+    gen(node->lhs);
+    gen(node->rhs);
+    gen_binary(node);
+}
+
+// レジスタ上の引数をスタック領域にコピーする処理をアセンブリに出力する
+static void load_arg(Var *var, int idx) {
+    out_str("  mov [rbp-");
+    out_int(var->offset);
+    out_str("], ");
+    out_str(arg_reg(idx, var->type->size));
+    out_char('\n');
+}
+
+// ローカル変数のオフセット設定 & スタックサイズ算出
+// localsリスト上の各ローカル変数に8byteずつ割り当てる
+static void assign_lvar_offsets(Function *func) {
+    int offset = func->has_varargs ? 56 : 0;
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        Var *lvar = vl->var;
+        if(lvar->reg) {
+            // 中間表現で仮想レジスタに置いた変数はメモリを使わない
+            continue;
+        }
+        offset = align_to(offset, lvar->type->align);
+        offset += lvar->type->size;
+        lvar->offset = offset;
+    }
+    func->stack_size = align_to(offset, 8);
+}
+
+// レジスタ割り当てに使う物理レジスタ。regalloc.cの番号の順に、
+// 呼び出し元保存のレジスタ、呼び出し先保存のレジスタを並べる。
+// rax、rdi、rcx、rdxは命令の作業用に、rsi、r8、r9は引数の受け渡しに使うので含めない。
+static char *alloc_reg_names[] = {"r10", "r11", "rbx", "r12", "r13", "r14", "r15"};
+
+// 呼び出し先保存のレジスタkを退避するスタック領域のRBPからのオフセット。
+// ローカル変数の領域の直後に置く。
+static int save_offset(Function *func, int k) {
+    return func->stack_size + (k - num_caller_saved_regs + 1) * 8;
+}
+
+// 出力中の関数のスタックフレームをレッドゾーン(rspの下の128バイト)に置くか。
+// 関数を呼び出さない関数ではrspを動かす必要がない。
+static bool use_red_zone;
+
+// 出力中の関数でフレームポインタを省略するか。
+// 省略した場合は、スタックフレームをrbpの代わりにrsp相対で参照する。
+static bool omit_frame_pointer;
+
+// スタックフレームの基準にするレジスタ
+static char *frame_reg(void) { return omit_frame_pointer ? "rsp" : "rbp"; }
+
+// 関数ラベルとプロローグを出力し、frame_sizeバイトのスタック領域を確保する。
+// レジスタ割り当てで使った呼び出し先保存のレジスタはここで退避する。
+static void emit_prologue(Function *func, int frame_size) {
+    if(!func->is_static) {
+        emit_directive(".global ", func->name);
+    }
+    emit_symbol(func->name);
+    if(!omit_frame_pointer) {
+        emit("push rbp");
+        emit("mov rbp, rsp");
+    }
+    if(!use_red_zone) {
+        emit_i("sub rsp, ", frame_size);
+    }
+
+    // 可変長引数の関数の場合、引数用レジスタの値を保存する
+    if(func->has_varargs) {
+        int n = 0;
+        for(VarList *vl = func->args; vl; vl = vl->next) {
+            n++;
+        }
+
+        emit_i("mov dword ptr [rbp-8], ", n * 8);
+        emit("mov [rbp-16], r9");
+        emit("mov [rbp-24], r8");
+        emit("mov [rbp-32], rcx");
+        emit("mov [rbp-40], rdx");
+        emit("mov [rbp-48], rsi");
+        emit("mov [rbp-56], rdi");
+    }
+
+    for(int k = num_caller_saved_regs; k < num_alloc_regs; k++) {
+        if(func->used_regs & (1 << k)) {
+            out_str("  mov [");
+            out_str(frame_reg());
+            out_char('-');
+            out_int(save_offset(func, k));
+            out_str("], ");
+            out_str(alloc_reg_names[k]);
+            out_char('\n');
+        }
+    }
+}
+
+static void emit_epilogue(Function *func) {
+    emit_label_name(".L.return", NULL);
+    for(int k = num_caller_saved_regs; k < num_alloc_regs; k++) {
+        if(func->used_regs & (1 << k)) {
+            out_str("  mov ");
+            out_str(alloc_reg_names[k]);
+            out_str(", [");
+            out_str(frame_reg());
+            out_char('-');
+            out_int(save_offset(func, k));
+            out_str("]\n");
+        }
+    }
+    if(!use_red_zone) {
+        emit("mov rsp, rbp");
+    }
+    if(!omit_frame_pointer) {
+        emit("pop rbp");
+    }
+    emit("ret");
+}
+
+// 関数をアセンブリとして出力する
+static void funcgen(Function *func) {
+    func_name = func->name;
+    label_seq_num = 1;
+    use_red_zone = false;  // 式の評価でpushするのでレッドゾーンは使えない
+    omit_frame_pointer = false;
+    assign_lvar_offsets(func);
+    // 関数ラベル、プロローグ出力。関数呼び出しのアライメントを静的に決められるよう、
+    // スタックフレームの大きさは16バイトの倍数にする。
+    emit_prologue(func, align_to(func->stack_size, 16));
+    depth = 0;
+
+    // レジスタ上の引数をスタック領域にコピー
+    int i = 0;
+    for(VarList *arg = func->args; arg; arg = arg->next) {
+        load_arg(arg->var, i++);
+    }
+
+    // 先頭の式から順にコード生成
+    for(Node *node = func->node; node; node = node->next) {
+        gen(node);
+        assert(depth == 0);
+    }
+
+    // エピローグ
+    // 最後の式の結果がRAXに残っているのでそれが返り値になる
+    emit_epilogue(func);
+}
+
+//
+// 中間表現(IR)からのコード生成(-O1以上)
+//
+
+// 出力中の関数
+static Function *cur_func;
+
+// スタックに追い出した仮想レジスタの退避領域の先頭のRBPからのオフセット。
+// 呼び出し先保存のレジスタの退避領域の直後に置く。
+static int spill_base;
+
+static bool in_reg(int reg) { return cur_func->reg_map[reg] >= 0; }
+
+// 仮想レジスタregのオペランド(物理レジスタ名か"[rbp-N]")を出力する
+static void out_vreg(int reg) {
+    if(in_reg(reg)) {
+        out_str(alloc_reg_names[cur_func->reg_map[reg]]);
+        return;
+    }
+    out_char('[');
+    out_str(frame_reg());
+    out_char('-');
+    out_int(spill_base + (cur_func->spill_slot[reg] + 1) * 8);
+    out_char(']');
+}
+
+// 仮想レジスタの値を物理レジスタに読み込む。例: emit_load_vreg("rax", 3)
+static void emit_load_vreg(char *reg, int vreg) {
+    out_str("  mov ");
+    out_str(reg);
+    out_str(", ");
+    out_vreg(vreg);
+    out_char('\n');
+}
+
+// 物理レジスタの値を仮想レジスタに書き込む
+static void emit_store_vreg(int vreg, char *reg) {
+    out_str("  mov ");
+    out_vreg(vreg);
+    out_str(", ");
+    out_str(reg);
+    out_char('\n');
+}
+
+// raxと仮想レジスタvregの二項演算の命令を出力する。例: "add rax, r10"
+static void emit_op_vreg(char *insn, int vreg) {
+    out_str("  ");
+    out_str(insn);
+    out_str(" rax, ");
+    out_vreg(vreg);
+    out_char('\n');
+}
+
+static void emit_jump_bb(char *insn, BB *bb) {
+    emit_jump(insn, ".L.bb", bb->label);
+}
+
+// IR_BRの比較cmpが成り立つ場合(whenが偽なら成り立たない場合)の条件ジャンプ命令
+static char *br_insn(IROp cmp, bool when) {
+    switch(cmp) {
+        case IR_EQ:
+            return when ? "je" : "jne";
+        case IR_NE:
+            return when ? "jne" : "je";
+        case IR_LT:
+            return when ? "jl" : "jge";
+        case IR_LE:
+            return when ? "jle" : "jg";
+    }
+    error("比較ではありません");
+    return NULL;
+}
+
+// raxを添字としてIR_JTABのジャンプテーブルで間接ジャンプし、テーブルを出力する
+static void emit_jtab(IR *ir) {
+    int table = label_seq_num++;
+    out_str("  jmp qword ptr [");
+    out_label(".L.jtab", table);
+    out_str("+rax*8]\n");
+
+    out_str(".section .rodata\n");
+    out_str(".align 8\n");
+    emit_label(".L.jtab", table);
+    for(int i = 0; i < ir->num_targets; i++) {
+        out_str("  .quad ");
+        out_label(".L.bb", ir->targets[i]->label);
+        out_char('\n');
+    }
+    out_str(".text\n");
+}
+
+// ストア命令を出力する。アドレスはrax、値はrdiに入っているものとする。
+static void emit_store_rdi(int size) {
+    if(size == 1) {
+        emit("mov [rax], dil");
+    } else if(size == 2) {
+        emit("mov [rax], di");
+    } else if(size == 4) {
+        emit("mov [rax], edi");
+    } else {
+        emit("mov [rax], rdi");
+    }
+}
+
+// 要素のサイズsizeを表すベクトル命令の接尾辞
+static char *vec_suffix(int size) {
+    if(size == 1) {
+        return "b";
+    }
+    if(size == 2) {
+        return "w";
+    }
+    if(size == 4) {
+        return "d";
+    }
+    return "q";
+}
+
+// ベクトル演算「insn dst, src」を出力する。-mavx2ではVEX形式の
+// 「vinsn dst, dst, src」にする。例: emit_vec_op("padd", "d", "xmm0", "xmm2")
+static void emit_vec_op(char *insn, char *suffix, char *dst, char *src) {
+    out_str(opt_avx2 ? "  v" : "  ");
+    out_str(insn);
+    out_str(suffix);
+    out_char(' ');
+    out_str(dst);
+    if(opt_avx2) {
+        out_str(", ");
+        out_str(dst);
+    }
+    out_str(", ");
+    out_str(src);
+    out_char('\n');
+}
 
-            brkseq = brk;
-            contseq = cont;
+// IR_VECの要素ごとの演算opのベクトル命令を出力する
+static void emit_vec_elem_op(IROp op, int size, char *dst, char *src) {
+    switch(op) {
+        case IR_ADD:
+            emit_vec_op("padd", vec_suffix(size), dst, src);
             return;
-        }
-        case ND_FOR: {
-            label_num = label_seq_num++;
-            int brk = brkseq;
-            int cont = contseq;
-            brkseq = contseq = label_num;
+        case IR_SUB:
+            emit_vec_op("psub", vec_suffix(size), dst, src);
+            return;
+        case IR_AND:
+            emit_vec_op("pand", "", dst, src);
+            return;
+        case IR_OR:
+            emit_vec_op("por", "", dst, src);
+            return;
+        case IR_XOR:
+            emit_vec_op("pxor", "", dst, src);
+            return;
+    }
+    error("ベクトル化できない演算です");
+}
 
-            if(node->init) {
-                gen(node->init);
-            }
-            printf(".Lbegin%d:\n", label_num);
-            if(node->cond) {
-                // cond==NULLの場合.LendXXXラベルへのジャンプ処理を出力しない(=無限ループ)
-                gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je  .Lbreak%d\n", label_num);
-            }
+// raxの下位sizeバイトを、ベクトルレジスタ1の全ての要素に並べる
+static void emit_vec_broadcast(int size) {
+    if(opt_avx2) {
+        emit("vmovq xmm1, rax");
+        out_str("  vpbroadcast");
+        out_str(vec_suffix(size));
+        out_str(" ymm1, xmm1\n");
+        return;
+    }
 
-            gen(node->then);
-            printf(".Lcontinue%d:\n", label_num);
-            if(node->post) {
-                gen(node->post);
-            }
-            printf("  jmp .Lbegin%d\n", label_num);
-            printf(".Lbreak%d:\n", label_num);
+    emit("movq xmm1, rax");
+    if(size == 8) {
+        emit("punpcklqdq xmm1, xmm1");
+        return;
+    }
+    if(size == 1) {
+        emit("punpcklbw xmm1, xmm1");
+    }
+    if(size <= 2) {
+        emit("punpcklwd xmm1, xmm1");
+    }
+    emit("pshufd xmm1, xmm1, 0");
+}
 
-            brkseq = brk;
-            contseq = cont;
-            return;
+// IR_VECを、ベクトルレジスタ1つ分(SSE2は16バイト、AVX2は32バイト)ずつ
+// 処理するループとして出力する。要素数はベクトルに入る要素の数の倍数になっている。
+// rcxにバイト数、r8に処理済みのバイト数を置き、ベクトルレジスタ0、1、2を使う。
+static void emit_vec(IR *ir) {
+    int seq = label_seq_num++;
+    char *v0 = opt_avx2 ? "ymm0" : "xmm0";
+    char *v1 = opt_avx2 ? "ymm1" : "xmm1";
+    char *v2 = opt_avx2 ? "ymm2" : "xmm2";
+    char *mov = opt_avx2 ? "vmovdqu" : "movdqu";
+    bool is_sum = ir->vec_kind == VEC_SUM;
+
+    emit_load_vreg("rcx", ir->args[0]);
+    emit_load_vreg("rdi", ir->args[1]);
+    if(is_sum) {
+        emit_vec_op("pxor", "", v0, v0);
+    } else {
+        emit_load_vreg("rsi", ir->args[2]);
+        if(ir->vec_kind == VEC_ARRAYS) {
+            emit_load_vreg("rdx", ir->args[3]);
+        } else {
+            emit_load_vreg("rax", ir->args[3]);
+            emit_vec_broadcast(ir->size);
         }
-        case ND_DO: {
-            int seq = label_seq_num++;
-            int brk = brkseq;
-            int cont = contseq;
-            brkseq = contseq = seq;
+    }
+    if(ir->size > 1) {
+        emit_i("shl rcx, ", log2_exact(ir->size));
+    }
+    emit("xor r8d, r8d");
+    emit("test rcx, rcx");
+    emit_jump("jle", ".L.vec_end", seq);
 
-            printf(".Lbegin%d:\n", seq);
-            gen(node->then);
-            printf(".Lcontinue%d:\n", seq);
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  jne .Lbegin%d\n", seq);
-            printf(".Lbreak%d:\n", seq);
+    emit_label(".L.vec", seq);
+    if(is_sum) {
+        emit_rr(mov, v2, "[rdi+r8]");
+        emit_vec_op("padd", vec_suffix(ir->size), v0, v2);
+    } else {
+        emit_rr(mov, v0, "[rsi+r8]");
+        if(ir->vec_kind == VEC_ARRAYS) {
+            emit_rr(mov, v2, "[rdx+r8]");
+            emit_vec_elem_op(ir->vec_op, ir->size, v0, v2);
+        } else {
+            emit_vec_elem_op(ir->vec_op, ir->size, v0, v1);
+        }
+        emit_rr(mov, "[rdi+r8]", v0);
+    }
+    emit_i("add r8, ", opt_avx2 ? 32 : 16);
+    emit("cmp r8, rcx");
+    emit_jump("jl", ".L.vec", seq);
+    emit_label(".L.vec_end", seq);
 
-            brkseq = brk;
-            contseq = cont;
-            return;
+    if(!is_sum) {
+        emit_load_vreg("rax", ir->args[0]);
+        emit_store_vreg(ir->dst, "rax");
+        if(opt_avx2) {
+            emit("vzeroupper");
         }
-        case ND_SWITCH: {
-            int seq = label_seq_num++;
-            int brk = brkseq;
-            brkseq = seq;
-            node->case_label = seq;
+        return;
+    }
 
-            gen(node->cond);
-            printf("  pop rax\n");
+    // 各要素の和をxmm0の先頭の要素に集める
+    char *suffix = vec_suffix(ir->size);
+    if(opt_avx2) {
+        emit("vextracti128 xmm2, ymm0, 1");
+        emit_vec_op("padd", suffix, "xmm0", "xmm2");
+    }
+    emit(opt_avx2 ? "vpshufd xmm2, xmm0, 78" : "pshufd xmm2, xmm0, 78");
+    emit_vec_op("padd", suffix, "xmm0", "xmm2");
+    if(ir->size == 4) {
+        emit(opt_avx2 ? "vpshufd xmm2, xmm0, 177" : "pshufd xmm2, xmm0, 177");
+        emit_vec_op("padd", suffix, "xmm0", "xmm2");
+        emit(opt_avx2 ? "vmovd eax, xmm0" : "movd eax, xmm0");
+        emit("movsxd rax, eax");
+    } else {
+        emit(opt_avx2 ? "vmovq rax, xmm0" : "movq rax, xmm0");
+    }
+    if(opt_avx2) {
+        emit("vzeroupper");
+    }
+    emit_store_vreg(ir->dst, "rax");
+}
 
-            for(Node *n = node->case_next; n; n = n->case_next) {
-                n->case_label = label_seq_num++;
-                n->case_end_label = seq;
-                printf("  cmp rax, %ld\n", n->val);
-                printf("  je .Lcase%d\n", n->case_label);
+// 命令irを出力する。nextは配置順で次の基本ブロック。
+static void emit_ir(IR *ir, BB *next) {
+    switch(ir->op) {
+        case IR_IMM:
+            if(ir->imm == (int)ir->imm) {
+                out_str(in_reg(ir->dst) ? "  mov " : "  mov qword ptr ");
+                out_vreg(ir->dst);
+                out_str(", ");
+                out_int(ir->imm);
+                out_char('\n');
+            } else {
+                emit_i("movabs rax, ", ir->imm);
+                emit_store_vreg(ir->dst, "rax");
             }
-
-            if(node->default_case) {
-                int i = label_seq_num++;
-                node->default_case->case_end_label = seq;
-                node->default_case->case_label = i;
-                printf("  jmp .Lcase%d\n", i);
+            return;
+        case IR_MOV:
+            if(!in_reg(ir->dst) && !in_reg(ir->a)) {
+                emit_load_vreg("rax", ir->a);
+                emit_store_vreg(ir->dst, "rax");
+                return;
+            }
+            if(cur_func->reg_map[ir->dst] != cur_func->reg_map[ir->a]) {
+                out_str("  mov ");
+                out_vreg(ir->dst);
+                out_str(", ");
+                out_vreg(ir->a);
+                out_char('\n');
             }
-
-            printf("  jmp .Lbreak%d\n", seq);
-            gen(node->then);
-            printf(".Lbreak%d:\n", seq);
-
-            brkseq = brk;
             return;
-        }
-        case ND_CASE:
-            printf(".Lcase%d:\n", node->case_label);
-            gen(node->lhs);
+        case IR_NOT:
+            emit_load_vreg("rax", ir->a);
+            emit("not rax");
+            emit_store_vreg(ir->dst, "rax");
             return;
-        case ND_BLOCK:
-        case ND_STMT_EXPR:
-            for(Node *cur = node->block; cur; cur = cur->next) {
-                gen(cur);
+        case IR_SEXT:
+            emit_load_vreg("rax", ir->a);
+            if(ir->size == 1) {
+                emit("movsx rax, al");
+            } else if(ir->size == 2) {
+                emit("movsx rax, ax");
+            } else {
+                emit("movsxd rax, eax");
             }
+            emit_store_vreg(ir->dst, "rax");
             return;
-        case ND_BREAK:
-            if(brkseq == 0) {
-                error("不正なbreakです");
+        case IR_LVAR:
+            out_str("  lea rax, [");
+            out_str(frame_reg());
+            out_char('-');
+            out_int(ir->var->offset);
+            out_str("]\n");
+            emit_store_vreg(ir->dst, "rax");
+            return;
+        case IR_GVAR:
+            out_str("  lea rax, ");
+            out_str(ir->name);
+            out_str("[rip]\n");
+            emit_store_vreg(ir->dst, "rax");
+            return;
+        case IR_LOAD:
+            emit_load_vreg("rax", ir->a);
+            if(ir->size == 1) {
+                emit("movsx rax, byte ptr [rax]");
+            } else if(ir->size == 2) {
+                emit("movsx rax, word ptr [rax]");
+            } else if(ir->size == 4) {
+                emit("movsxd rax, dword ptr [rax]");
+            } else {
+                emit("mov rax, [rax]");
             }
-            printf("  jmp .Lbreak%d\n", brkseq);
+            emit_store_vreg(ir->dst, "rax");
             return;
-        case ND_CONTINUE:
-            if(contseq == 0) {
-                error("不正なcontinueです");
+        case IR_STORE:
+            emit_load_vreg("rax", ir->a);
+            emit_load_vreg("rdi", ir->b);
+            emit_store_rdi(ir->size);
+            return;
+        case IR_PARAM:
+            emit_store_vreg(ir->dst, regs_for_args_8[ir->imm]);
+            return;
+        case IR_CALL:
+            for(int i = 0; i < ir->nargs; i++) {
+                emit_load_vreg(regs_for_args_8[i], ir->args[i]);
             }
-            printf("  jmp .Lcontinue%d\n", contseq);
+            // スタックフレームは16バイト境界に揃えてあるので、rspの調整は不要
+            if(ir->is_variadic_call) {
+                emit("mov rax, 0");
+            }
+            emit_s("call ", ir->name);
+            emit_store_vreg(ir->dst, "rax");
             return;
-        case ND_GOTO:
-            printf("  jmp .Llabel.%s.%s\n", func_name, node->label_name);
+        case IR_VA_START:
+            emit_load_vreg("rax", ir->a);
+            emit("mov edi, dword ptr [rbp-8]");
+            emit("mov dword ptr [rax], 0");
+            emit("mov dword ptr [rax+4], 0");
+            emit("mov qword ptr [rax+8], rdi");
+            emit("mov qword ptr [rax+16], 0");
             return;
-        case ND_LABEL:
-            printf(".Llabel.%s.%s:\n", func_name, node->label_name);
-            gen(node->lhs);
+        case IR_VEC:
+            emit_vec(ir);
             return;
-        case ND_FUNCCALL:
-            if(!strcmp(node->func_name, "__builtin_va_start")) {
-                printf("  pop rax\n");
-                printf("  mov edi, dword ptr [rbp-8]\n");
-                printf("  mov dword ptr [rax], 0\n");
-                printf("  mov dword ptr [rax+4], 0\n");
-                printf("  mov qword ptr [rax+8], rdi\n");
-                printf("  mov qword ptr [rax+16], 0\n");
-                return;
+        case IR_JMP:
+            if(ir->then != next) {
+                emit_jump_bb("jmp", ir->then);
             }
-
-            int args_count = 0;
-            for(Node *cur = node->args; cur; cur = cur->next) {
-                gen(cur);
-                args_count++;
+            return;
+        case IR_BR:
+            // 比較と条件ジャンプを隣接させ、CPUが融合して実行できるようにする
+            emit_load_vreg("rax", ir->a);
+            if(ir->b) {
+                emit_op_vreg("cmp", ir->b);
+            } else {
+                emit("cmp rax, 0");
             }
-            if(args_count > 6) {
-                error("%s: , 7個以上の引数を持つ関数です", node->func_name);
+            if(ir->then == next) {
+                emit_jump_bb(br_insn(ir->cmp, false), ir->els);
+                return;
             }
-            for(int i = args_count - 1; i >= 0; i--) {
-                printf("  pop %s\n", regs_for_args_8[i]);
+            emit_jump_bb(br_insn(ir->cmp, true), ir->then);
+            if(ir->els != next) {
+                emit_jump_bb("jmp", ir->els);
             }
-
-            // x86-64のABIに従ってcall命令実行前にrspを16バイトでアライメントする必要がある
-            label_num = label_seq_num++;
-            printf("  mov rax, rsp\n");
-            printf("  and rax, 15\n");
-            printf("  jnz .L.call.%d\n", label_num);
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->func_name);
-            printf("  jmp .L.end.%d\n", label_num);
-            printf(".L.call.%d:\n", label_num);
-            printf("  sub rsp, 8\n");
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->func_name);
-            printf("  add rsp, 8\n");
-            printf(".L.end.%d:\n", label_num);
-            if(node->type->ty == BOOL) {
-                printf("  movzb rax, al\n");
+            return;
+        case IR_JTAB:
+            emit_load_vreg("rax", ir->a);
+            if(ir->imm != 0) {
+                emit_i("sub rax, ", ir->imm);
             }
-            printf("  push rax\n");
+            emit_i("cmp rax, ", ir->num_targets - 1);
+            emit_jump_bb("ja", ir->els);
+            emit_jtab(ir);
             return;
-        case ND_CAST:
-            gen(node->lhs);
-            truncate(node->type);
+        case IR_RET:
+            if(ir->a) {
+                emit_load_vreg("rax", ir->a);
+            }
+            emit_s("jmp .L.return.", func_name);
             return;
     }
 
-    gen(node->lhs);
-    gen(node->rhs);
-    gen_binary(node);
+    // 二項演算。右辺の仮想レジスタは、可能なら命令のオペランドとして直接使う
+    emit_load_vreg("rax", ir->a);
+    switch(ir->op) {
+        case IR_ADD:
+            emit_op_vreg("add", ir->b);
+            break;
+        case IR_SUB:
+            emit_op_vreg("sub", ir->b);
+            break;
+        case IR_MUL:
+            emit_op_vreg("imul", ir->b);
+            break;
+        case IR_DIV:
+            emit_load_vreg("rdi", ir->b);
+            emit("cqo");
+            emit("idiv rdi");
+            break;
+        case IR_AND:
+            emit_op_vreg("and", ir->b);
+            break;
+        case IR_OR:
+            emit_op_vreg("or", ir->b);
+            break;
+        case IR_XOR:
+            emit_op_vreg("xor", ir->b);
+            break;
+        case IR_SHL:
+            emit_load_vreg("rcx", ir->b);
+            emit("shl rax, cl");
+            break;
+        case IR_SHR:
+            emit_load_vreg("rcx", ir->b);
+            emit("sar rax, cl");
+            break;
+        case IR_EQ:
+            emit_op_vreg("cmp", ir->b);
+            emit("sete al");
+            emit("movzb rax, al");
+            break;
+        case IR_NE:
+            emit_op_vreg("cmp", ir->b);
+            emit("setne al");
+            emit("movzb rax, al");
+            break;
+        case IR_LT:
+            emit_op_vreg("cmp", ir->b);
+            emit("setl al");
+            emit("movzb rax, al");
+            break;
+        case IR_LE:
+            emit_op_vreg("cmp", ir->b);
+            emit("setle al");
+            emit("movzb rax, al");
+            break;
+    }
+    emit_store_vreg(ir->dst, "rax");
 }
 
-// レジスタ上の引数をスタック領域にコピーする処理をアセンブリに出力する
-static void load_arg(Var *var, int idx) {
-    int size = var->type->size;
-    if(size == 1) {
-        printf("  mov [rbp-%d], %s\n", var->offset, regs_for_args_1[idx]);
-    } else if(size == 2) {
-        printf("  mov [rbp-%d], %s\n", var->offset, regs_for_args_2[idx]);
-    } else if(size == 4) {
-        printf("  mov [rbp-%d], %s\n", var->offset, regs_for_args_4[idx]);
-    } else {
-        assert(size == 8);
-        printf("  mov [rbp-%d], %s\n", var->offset, regs_for_args_8[idx]);
+// 関数funcが他の関数を呼び出さないか
+static bool is_leaf_func(Function *func) {
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            if(ir->op == IR_CALL) {
+                return false;
+            }
+        }
     }
+    return true;
 }
 
-// 関数をアセンブリとして出力する
-static void funcgen(Function *func) {
+// 関数をIRに変換してからアセンブリとして出力する
+static void funcgen_ir(Function *func) {
     func_name = func->name;
-    // 関数ラベル、プロローグ出力
-    if(!func->is_static) {
-        printf(".global %s\n", func->name);
+    label_seq_num = 1;
+    cur_func = func;
+    vectorize_loops(func);
+    unroll_loops(func);
+    gen_ir(func);
+    licm(func);
+    if(opt_dump_ir) {
+        dump_ir(func, stderr);
     }
-    printf("%s:\n", func->name);
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", func->stack_size);
-
-    // 可変長引数の関数の場合、引数用レジスタの値を保存する
-    if(func->has_varargs) {
-        int n = 0;
-        for(VarList *vl = func->args; vl; vl = vl->next) {
-            n++;
-        }
+    assign_lvar_offsets(func);
+    alloc_regs(func);
 
-        printf("mov dword ptr [rbp-8], %d\n", n * 8);
-        printf("mov [rbp-16], r9\n");
-        printf("mov [rbp-24], r8\n");
-        printf("mov [rbp-32], rcx\n");
-        printf("mov [rbp-40], rdx\n");
-        printf("mov [rbp-48], rsi\n");
-        printf("mov [rbp-56], rdi\n");
-    }
+    spill_base = save_offset(func, num_alloc_regs - 1);
+    int frame_size = spill_base + func->num_spills * 8;
 
-    // レジスタ上の引数をスタック領域にコピー
-    int i = 0;
-    for(VarList *arg = func->args; arg; arg = arg->next) {
-        load_arg(arg->var, i++);
-    }
+    // 他の関数を呼び出さず、フレームが128バイトに収まる関数は、rspを動かさずに
+    // レッドゾーンを使う。その場合rbpはrspと等しいので、フレームポインタも省略できる。
+    use_red_zone =
+        frame_size <= 128 && !func->has_varargs && is_leaf_func(func);
+    omit_frame_pointer = use_red_zone && !opt_keep_frame_pointer;
+    emit_prologue(func, align_to(frame_size, 16));
 
-    // 先頭の式から順にコード生成
-    for(Node *node = func->node; node; node = node->next) {
-        gen(node);
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        emit_label(".L.bb", bb->label);
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            emit_ir(ir, bb->next);
+        }
     }
 
-    // エピローグ
-    // 最後の式の結果がRAXに残っているのでそれが返り値になる
-    printf(".L.return.%s:\n", func_name);
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
+    emit_epilogue(func);
+    free_ir(func);
 }
 
 // データセグメントをアセンブリに出力する
-static void gen_data_seg(Program *prog) {
-    for(VarList *vlist = prog->globals; vlist; vlist = vlist->next) {
-        if(!vlist->var->is_static) {
-            printf(".global %s\n", vlist->var->name);
-        }
-    }
-
-    printf(".bss\n");
+// グローバル変数のリストglobalsの領域を.bss、.dataセクションに出力する
+static void gen_data(VarList *globals) {
+    out_str(".bss\n");
 
-    for(VarList *vlist = prog->globals; vlist; vlist = vlist->next) {
+    for(VarList *vlist = globals; vlist; vlist = vlist->next) {
         Var *gvar = vlist->var;
         if(gvar->initializer) {
             continue;
         }
 
-        printf(".align %d\n", gvar->type->align);
-        printf("%s:\n", gvar->name);
-        printf("  .zero %d\n", gvar->type->size);
+        emit_directive_i(".align ", gvar->type->align);
+        emit_symbol(gvar->name);
+        emit_i(".zero ", gvar->type->size);
     }
 
-    printf(".data\n");
+    out_str(".data\n");
 
-    for(VarList *vlist = prog->globals; vlist; vlist = vlist->next) {
+    for(VarList *vlist = globals; vlist; vlist = vlist->next) {
         Var *gvar = vlist->var;
         if(!gvar->initializer) {
             continue;
         }
 
-        printf(".align %d\n", gvar->type->align);
-        printf("%s:\n", gvar->name);
+        emit_directive_i(".align ", gvar->type->align);
+        emit_symbol(gvar->name);
 
         for(Initializer *init = gvar->initializer; init; init = init->next) {
             if(init->label) {
-                printf("  .quad %s%+ld\n", init->label, init->addend);
+                out_str("  .quad ");
+                out_str(init->label);
+                if(init->addend >= 0) {
+                    out_char('+');
+                }
+                out_int(init->addend);
+                out_char('\n');
             } else if(init->sz == 1) {
-                printf("  .byte %ld\n", init->val);
+                emit_i(".byte ", init->val);
             } else {
-                printf("  .%dbyte %ld\n", init->sz, init->val);
+                out_str("  .");
+                out_int(init->sz);
+                out_str("byte ");
+                out_int(init->val);
+                out_char('\n');
             }
         }
     }
 }
 
+static void gen_data_seg(Program *prog) {
+    for(VarList *vlist = prog->globals; vlist; vlist = vlist->next) {
+        if(!vlist->var->is_static) {
+            emit_directive(".global ", vlist->var->name);
+        }
+    }
+
+    gen_data(prog->globals);
+}
+
+static void emit_func_body(Function *func) {
+    // 覗き穴最適化を行う場合は、関数1つ分の出力をメモリに溜めてから最適化する
+    if(opt_peephole) {
+        out_mem_begin();
+    }
+
+    if(opt_level > 0) {
+        funcgen_ir(func);
+    } else {
+        funcgen(func);
+    }
+
+    if(opt_peephole) {
+        int len;
+        char *buf = out_mem_end(&len);
+        peephole(buf, len);
+        free(buf);
+    }
+}
+
+// 関数を出力する。関数キャッシュが有効な場合は、関数内の文字列リテラルなどの
+// データも関数の直後に出力し、その出力全体をキャッシュに保存する。
+// キャッシュにヒットした関数は保存済みの出力をそのまま出力する。
+static void gen_function(Function *func) {
+    if(func->asm_text) {
+        out_strn(func->asm_text, func->asm_len);
+        return;
+    }
+
+    if(!func->cache_key) {
+        emit_func_body(func);
+        return;
+    }
+
+    out_capture_begin();
+    emit_func_body(func);
+    if(func->data) {
+        gen_data(func->data);
+        out_str(".text\n");
+    }
+
+    int len;
+    char *buf = out_capture_end(&len);
+    cache_store(func->cache_key, buf, len);
+    free(buf);
+}
+
+// 関数リストの先頭からn個の関数を出力するワーカープロセスを起動する。
+// ワーカーの出力はパイプ経由で読み出せるので、そのファイルディスクリプタを返す。
+// ワーカーのプロセスIDは*pidに格納する。
+static int start_funcgen_worker(Function *funcs, int n, int *pid) {
+    int fds[2];
+    if(pipe(fds) < 0) error("pipe failed: %s", strerror(errno));
+
+    out_flush();
+    *pid = fork();
+    if(*pid < 0) error("fork failed: %s", strerror(errno));
+
+    if(*pid == 0) {
+        close(fds[0]);
+        out_set_fd(fds[1]);
+
+        Function *func = funcs;
+        for(int i = 0; i < n; i++) {
+            gen_function(func);
+            func = func->next;
+        }
+        out_close();
+        exit(0);
+    }
+
+    close(fds[1]);
+    return fds[0];
+}
+
+// 関数リストを連続した区間に分割し、各区間を別々のワーカープロセスで並列に出力する。
+// ラベルの通し番号は関数ごとに振り直しているので、各区間の出力をソース順に
+// 連結すると逐次実行した場合と同一のアセンブリになる。
+static void gen_funcs_parallel(Function *funcs, int nfuncs, int njobs) {
+    int *fds = calloc(njobs, sizeof(int));
+    int *pids = calloc(njobs, sizeof(int));
+    Function *func = funcs;
+    for(int i = 0; i < njobs; i++) {
+        // nfuncs個の関数をnjobs個の区間にできるだけ均等に分ける
+        int n = nfuncs * (i + 1) / njobs - nfuncs * i / njobs;
+        fds[i] = start_funcgen_worker(func, n, &pids[i]);
+        for(int j = 0; j < n; j++) {
+            func = func->next;
+        }
+    }
+
+    // 区間の順番どおりにワーカーの出力を読み出して連結する。
+    // 後ろの区間のワーカーはパイプが一杯になるとブロックするが、
+    // 前の区間を読み終われば順に読み出されるのでデッドロックはしない。
+    char buf[65536];
+    for(int i = 0; i < njobs; i++) {
+        long n;
+        while((n = read(fds[i], buf, sizeof(buf))) > 0) {
+            out_strn(buf, n);
+        }
+        close(fds[i]);
+    }
+
+    // パイプで繋いだアセンブラも子プロセスなので、ワーカーだけを指定して待つ
+    bool ok = true;
+    for(int i = 0; i < njobs; i++) {
+        int status;
+        if(waitpid(pids[i], &status, 0) < 0) {
+            error("waitpid failed: %s", strerror(errno));
+        }
+        if(status != 0) ok = false;
+    }
+    free(fds);
+    free(pids);
+    if(!ok) exit(1);
+}
+
 // テキストセグメントをアセンブリに出力する
 static void gen_text_seg(Program *prog) {
-    printf(".text\n");
+    out_str(".text\n");
+
+    int nfuncs = 0;
+    for(Function *func = prog->funcs; func; func = func->next) {
+        nfuncs++;
+    }
+
+    int njobs = codegen_jobs < nfuncs ? codegen_jobs : nfuncs;
+    if(njobs > 1) {
+        gen_funcs_parallel(prog->funcs, nfuncs, njobs);
+        return;
+    }
 
     // 関数を出力
     for(Function *func = prog->funcs; func; func = func->next) {
-        funcgen(func);
+        gen_function(func);
     }
 }
 
-void codegen(Program *prog) {
-    label_seq_num = 0;
+// スタックを実行可能にする必要がないことをリンカに伝える。
+// この節がないと、リンカは実行可能なスタックを仮定して警告を出す。
+static void gen_stack_note(void) {
+    out_str(".section .note.GNU-stack,\"\",@progbits\n");
+}
 
-    printf(".intel_syntax noprefix\n");
+void codegen(Program *prog) {
+    out_str(".intel_syntax noprefix\n");
     gen_data_seg(prog);
     gen_text_seg(prog);
+    gen_stack_note();
+}
+
+// パイプライン実行時にパーサスレッドからコード生成スレッドへ関数を受け渡すキュー。
+// パーサが唯一の生産者、コード生成スレッドが唯一の消費者のリングバッファ。
+static Function *funcq[64];
+static int funcq_head;  // 次に取り出す位置
+static int funcq_len;   // キューに入っている関数の数
+static bool funcq_closed;
+static pthread_mutex_t funcq_mutex;
+static pthread_cond_t funcq_cond;
+static pthread_t codegen_th;
+
+// キューから関数を1つ取り出す。パースが終わりキューが空の場合はNULLを返す。
+static Function *funcq_pop(void) {
+    pthread_mutex_lock(&funcq_mutex);
+    while(funcq_len == 0 && !funcq_closed) {
+        pthread_cond_wait(&funcq_cond, &funcq_mutex);
+    }
+
+    Function *func = NULL;
+    if(funcq_len > 0) {
+        func = funcq[funcq_head];
+        funcq_head = (funcq_head + 1) & 63;
+        funcq_len--;
+        pthread_cond_signal(&funcq_cond);
+    }
+    pthread_mutex_unlock(&funcq_mutex);
+    return func;
+}
+
+// キューに関数を追加する。キューが一杯の場合は空くまで待つ。
+static void funcq_push(Function *func) {
+    pthread_mutex_lock(&funcq_mutex);
+    while(funcq_len == 64) {
+        pthread_cond_wait(&funcq_cond, &funcq_mutex);
+    }
+    funcq[(funcq_head + funcq_len) & 63] = func;
+    funcq_len++;
+    pthread_cond_signal(&funcq_cond);
+    pthread_mutex_unlock(&funcq_mutex);
+}
+
+static void funcq_close(void) {
+    pthread_mutex_lock(&funcq_mutex);
+    funcq_closed = true;
+    pthread_cond_signal(&funcq_cond);
+    pthread_mutex_unlock(&funcq_mutex);
+}
+
+// 関数を出力する。ストリーミング実行時は出力し終えた関数のメモリを解放する。
+static void emit_function(Function *func) {
+    gen_function(func);
+    if(opt_stream) {
+        free_function(func);
+    }
+}
+
+static void *codegen_thread(void *arg) {
+    for(;;) {
+        Function *func = funcq_pop();
+        if(!func) {
+            return NULL;
+        }
+        emit_function(func);
+    }
+}
+
+// 関数単位のコード生成を開始する。
+// 以降、codegen_function()で渡された関数はパースが終わった順に出力される。
+// パイプライン実行時はコード生成スレッドを起動し、関数の出力をそちらに任せる。
+void codegen_begin(void) {
+    out_str(".intel_syntax noprefix\n");
+    out_str(".text\n");
+
+    if(opt_pipeline) {
+        pthread_mutex_init(&funcq_mutex, NULL);
+        pthread_cond_init(&funcq_cond, NULL);
+        if(pthread_create(&codegen_th, NULL, &codegen_thread, NULL)) {
+            error("cannot create codegen thread");
+        }
+    }
+}
+
+// パースが完了した関数を出力する
+void codegen_function(Function *func) {
+    if(opt_pipeline) {
+        funcq_push(func);
+        return;
+    }
+    emit_function(func);
+}
+
+// 全ての関数の出力を待ち、最後にデータセグメントを出力する。
+// データセグメントはグローバル変数が出揃うファイル末尾まで出力できない。
+void codegen_end(Program *prog) {
+    if(opt_pipeline) {
+        funcq_close();
+        pthread_join(codegen_th, NULL);
+    }
+    gen_data_seg(prog);
+    gen_stack_note();
 }
@@ -0,0 +1,160 @@
+#include "zxcc.h"
+
+// 不要な文の削除。
+//
+// ブロックの中から次の文を取り除く。
+//
+// - return、goto、break、continueの後ろにあり、実行されることのない文。
+//   ただし、ラベルやcaseを含む文からはジャンプで到達できるので、それ以降は残す。
+// - 副作用がなく、値も使われない式文(「x;」「a[i] + 1;」など)
+//
+// statement expressionのブロックは最後の式が値になるので、中の文は取り除かない。
+
+// 式nodeの評価に副作用がないか
+static bool is_pure(Node *node) {
+    if(!node) {
+        return true;
+    }
+
+    switch(node->kind) {
+        case ND_NUM:
+        case ND_NULL:
+            return true;
+        case ND_VAR:
+            // 複合リテラルは初期化式の副作用を持つ
+            return !node->init;
+        case ND_ADD:
+        case ND_PTR_ADD:
+        case ND_SUB:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+        case ND_BITAND:
+        case ND_BITOR:
+        case ND_BITXOR:
+        case ND_SHL:
+        case ND_SHR:
+        case ND_LOGAND:
+        case ND_LOGOR:
+        case ND_COMMA:
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_MEMBER:
+        case ND_CAST:
+        case ND_NOT:
+        case ND_BITNOT:
+            return is_pure(node->lhs) && is_pure(node->rhs);
+        case ND_TERNARY:
+            return is_pure(node->cond) && is_pure(node->then) &&
+                   is_pure(node->els);
+    }
+    return false;
+}
+
+// node以下にラベルかcaseがあるか
+static bool has_label(Node *node) {
+    if(!node) {
+        return false;
+    }
+    if(node->kind == ND_LABEL || node->kind == ND_CASE) {
+        return true;
+    }
+
+    Node *kids[7] = {node->lhs,  node->rhs,  node->cond, node->then,
+                     node->els,  node->init, node->post};
+    for(int i = 0; i < 7; i++) {
+        if(has_label(kids[i])) {
+            return true;
+        }
+    }
+    for(Node *cur = node->block; cur; cur = cur->next) {
+        if(has_label(cur)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 文nodeの後ろに制御が移らないか
+static bool ends_flow(Node *node) {
+    switch(node->kind) {
+        case ND_RETURN:
+        case ND_GOTO:
+        case ND_BREAK:
+        case ND_CONTINUE:
+            return true;
+        case ND_IF:
+            return node->els && ends_flow(node->then) && ends_flow(node->els);
+        case ND_BLOCK:
+            for(Node *cur = node->block; cur; cur = cur->next) {
+                if(!cur->next) {
+                    return ends_flow(cur);
+                }
+            }
+    }
+    return false;
+}
+
+static void eliminate_node(Node *node);
+
+// 文のリストlistから不要な文を取り除き、残った文のリストを返す
+static Node *eliminate_list(Node *list) {
+    Node head = {};
+    Node *cur = &head;
+    bool dead = false;
+
+    for(Node *node = list; node; node = node->next) {
+        if(dead && !has_label(node)) {
+            continue;
+        }
+        if(node->kind == ND_EXPR_STMT && is_pure(node->lhs)) {
+            continue;
+        }
+        if(node->kind == ND_NULL) {
+            continue;
+        }
+
+        eliminate_node(node);
+        cur->next = node;
+        cur = node;
+        dead = ends_flow(node);
+    }
+    cur->next = NULL;
+    return head.next;
+}
+
+// node以下のブロックから不要な文を取り除く
+static void eliminate_node(Node *node) {
+    if(!node) {
+        return;
+    }
+
+    eliminate_node(node->lhs);
+    eliminate_node(node->rhs);
+    eliminate_node(node->cond);
+    eliminate_node(node->then);
+    eliminate_node(node->els);
+    eliminate_node(node->init);
+    eliminate_node(node->post);
+    for(Node *n = node->args; n; n = n->next) {
+        eliminate_node(n);
+    }
+
+    if(node->kind == ND_BLOCK) {
+        node->block = eliminate_list(node->block);
+        return;
+    }
+    for(Node *n = node->block; n; n = n->next) {
+        eliminate_node(n);
+    }
+}
+
+// 関数funcの不要な文を取り除く
+void eliminate_dead_code(Function *func) {
+    func->node = eliminate_list(func->node);
+}
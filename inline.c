@@ -0,0 +1,479 @@
+#include "zxcc.h"
+
+// 抽象構文木上のインライン展開。
+//
+// 小さな関数の本体を複製して雛形として登録しておき、その関数の呼び出しを
+// 雛形を複製したstatement expressionで置き換える。
+//
+//   f(a, b) → ({ x' = a; y' = b; 本体'; return.N: ; r'; })
+//
+// 本体'は呼び出し先のローカル変数を呼び出し元に追加した新しい変数x'、y'などに
+// 置き換えたもので、return eは「r' = e; goto return.N;」になる。最後の文が
+// returnでそれ以外にreturnがない場合は、戻り値の変数もgotoも使わずにeを
+// statement expressionの値にする。
+//
+// 展開した本体の中の関数呼び出しは展開し直さないので、再帰呼び出しがあっても
+// 展開は止まる。-O1以上では同じファイルで先に定義された関数を展開し、
+// -fltoではプログラム中の全ての関数を展開する。
+
+// 展開する関数の本体のノード数の上限
+static int inline_max_nodes = 40;
+
+// 展開できる関数の雛形
+typedef struct InlineFunc InlineFunc;
+struct InlineFunc {
+    InlineFunc *next;
+    char *name;
+    char *cache_key;  // 関数キャッシュのキー(キャッシュが無効な場合はNULL)
+
+    // 以下は展開できない関数ではNULL
+    Node *body;
+    Var **vars;    // ローカル変数(引数を含む)
+    int num_vars;
+    Var **params;  // 引数(varsの要素を指す)
+    int num_params;
+};
+
+static InlineFunc *inline_funcs[1024];
+
+static int hash_name(char *name) {
+    int h = 0;
+    for(char *p = name; *p; p++) {
+        h = (h * 31 + (*p & 255)) & 1023;
+    }
+    return h;
+}
+
+static InlineFunc *find_inline(char *name) {
+    for(InlineFunc *f = inline_funcs[hash_name(name)]; f; f = f->next) {
+        if(!strcmp(f->name, name)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+//
+// 本体の複製
+//
+
+// 複製元の変数from_vars[i]はto_vars[i]に置き換える
+static Var **from_vars;
+static Var **to_vars;
+static int num_map_vars;
+
+// 複製したラベル名に付ける番号(0なら名前を変えない)
+static int label_seq;
+
+// returnの置き換え先(ret_labelがNULLならreturnは置き換えない)
+static char *ret_label;
+static Type *ret_type;
+static Var *ret_var;
+static int num_ret_jumps;
+static Function *ret_caller;
+
+static Node *new_node(NodeKind kind) {
+    Node *node = calloc(1, sizeof(Node));
+    node->kind = kind;
+    return node;
+}
+
+static Node *new_var_ref(Var *var) {
+    Node *node = new_node(ND_VAR);
+    node->var = var;
+    node->type = var->type;
+    return node;
+}
+
+static Node *new_assign_stmt(Var *var, Node *rhs) {
+    Node *assign = new_node(ND_ASSIGN);
+    assign->lhs = new_var_ref(var);
+    assign->rhs = rhs;
+    assign->type = var->type;
+
+    Node *stmt = new_node(ND_EXPR_STMT);
+    stmt->lhs = assign;
+    return stmt;
+}
+
+static Var *map_var(Var *var) {
+    for(int i = 0; i < num_map_vars; i++) {
+        if(from_vars[i] == var) {
+            return to_vars[i];
+        }
+    }
+    return var;
+}
+
+// 変数varの複製を作り、関数funcのローカル変数に追加する
+static Var *copy_var(Var *var, Function *func) {
+    Var *copy = calloc(1, sizeof(Var));
+    memcpy(copy, var, sizeof(Var));
+    copy->name = strndup(var->name, strlen(var->name));
+    copy->offset = 0;
+    copy->reg = 0;
+    copy->addr_taken = false;
+
+    if(func) {
+        VarList *vl = calloc(1, sizeof(VarList));
+        vl->var = copy;
+        vl->next = func->locals;
+        func->locals = vl;
+    }
+    return copy;
+}
+
+static char *copy_label(char *name) {
+    if(!label_seq) {
+        return strndup(name, strlen(name));
+    }
+    char *buf = calloc(1, strlen(name) + 16);
+    sprintf(buf, "%s.%d", name, label_seq);
+    return buf;
+}
+
+// 戻り値を入れる変数を返す。最初に使う時に呼び出し元のローカル変数として作る。
+static Var *get_ret_var(void) {
+    if(!ret_var) {
+        Var var = {};
+        var.name = "ret";
+        var.type = ret_type;
+        var.is_local = true;
+        ret_var = copy_var(&var, ret_caller);
+    }
+    return ret_var;
+}
+
+static Node *clone_node(Node *node);
+
+static Node *clone_list(Node *node) {
+    Node head = {};
+    Node *cur = &head;
+    for(; node; node = node->next) {
+        cur->next = clone_node(node);
+        cur = cur->next;
+    }
+    return head.next;
+}
+
+// return eを「r' = e; goto return.N;」に置き換える
+static Node *clone_return(Node *node) {
+    Node *jump = new_node(ND_GOTO);
+    jump->label_name = strndup(ret_label, strlen(ret_label));
+    num_ret_jumps++;
+    if(!node->lhs) {
+        return jump;
+    }
+
+    Node *stmt;
+    if(ret_type->ty == VOID) {
+        stmt = new_node(ND_EXPR_STMT);
+        stmt->lhs = clone_node(node->lhs);
+    } else {
+        stmt = new_assign_stmt(get_ret_var(), clone_node(node->lhs));
+    }
+    stmt->next = jump;
+
+    Node *block = new_node(ND_BLOCK);
+    block->block = stmt;
+    return block;
+}
+
+// nodeを複製する。変数とラベルの名前を置き換え、returnを置き換える。
+static Node *clone_node(Node *node) {
+    if(!node) {
+        return NULL;
+    }
+    if(node->kind == ND_RETURN && ret_label) {
+        return clone_return(node);
+    }
+
+    Node *copy = calloc(1, sizeof(Node));
+    memcpy(copy, node, sizeof(Node));
+    copy->next = NULL;
+    copy->lhs = clone_node(node->lhs);
+    copy->rhs = clone_node(node->rhs);
+    copy->cond = clone_node(node->cond);
+    copy->then = clone_node(node->then);
+    copy->els = clone_node(node->els);
+    copy->init = clone_node(node->init);
+    copy->post = clone_node(node->post);
+    copy->block = clone_list(node->block);
+    copy->args = clone_list(node->args);
+    copy->var = map_var(node->var);
+    if(node->func_name) {
+        copy->func_name = strndup(node->func_name, strlen(node->func_name));
+    }
+    if(node->label_name) {
+        copy->label_name = copy_label(node->label_name);
+    }
+    return copy;
+}
+
+//
+// 雛形の登録
+//
+
+static int count_node(Node *node);
+
+static int count_list(Node *node) {
+    int n = 0;
+    for(; node; node = node->next) {
+        int m = count_node(node);
+        if(m < 0) {
+            return -1;
+        }
+        n += m;
+    }
+    return n;
+}
+
+// nodeのノード数を数える。展開できないノードを含む場合は-1を返す。
+static int count_node(Node *node) {
+    if(!node) {
+        return 0;
+    }
+
+    // switchのcaseの表は複製しない
+    if(node->kind == ND_SWITCH || node->kind == ND_CASE) {
+        return -1;
+    }
+    if(node->kind == ND_FUNCCALL &&
+       !strcmp(node->func_name, "__builtin_va_start")) {
+        return -1;
+    }
+
+    int n = 1;
+    Node *kids[7] = {node->lhs,  node->rhs,  node->cond, node->then,
+                     node->els,  node->init, node->post};
+    for(int i = 0; i < 7; i++) {
+        int m = count_node(kids[i]);
+        if(m < 0) {
+            return -1;
+        }
+        n += m;
+    }
+
+    int m = count_list(node->block);
+    int k = count_list(node->args);
+    if(m < 0 || k < 0) {
+        return -1;
+    }
+    return n + m + k;
+}
+
+// 関数funcを以降の呼び出しで展開できるよう登録する。
+// 関数本体を持たない場合(キャッシュにヒットした場合)や大きな関数は、
+// キャッシュのキーだけを登録する。
+void inline_add(Function *func) {
+    InlineFunc *f = calloc(1, sizeof(InlineFunc));
+    f->name = func->name;
+    if(func->cache_key) {
+        f->cache_key = strndup(func->cache_key, strlen(func->cache_key));
+    }
+
+    int h = hash_name(func->name);
+    f->next = inline_funcs[h];
+    inline_funcs[h] = f;
+
+    if(!func->node || func->has_varargs) {
+        return;
+    }
+    for(VarList *vl = func->args; vl; vl = vl->next) {
+        if(vl->var->type->ty == STRUCT) {
+            return;
+        }
+    }
+    int n = count_list(func->node);
+    if(n < 0 || n > inline_max_nodes) {
+        return;
+    }
+
+    // 関数本体は後でコード生成時に書き換えられたり解放されたりするので、
+    // 変数も含めて複製しておく
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        f->num_vars++;
+    }
+    for(VarList *vl = func->args; vl; vl = vl->next) {
+        f->num_params++;
+    }
+    from_vars = calloc(f->num_vars + 1, sizeof(Var *));
+    f->vars = calloc(f->num_vars + 1, sizeof(Var *));
+    f->params = calloc(f->num_params + 1, sizeof(Var *));
+
+    int i = 0;
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        from_vars[i] = vl->var;
+        f->vars[i] = copy_var(vl->var, NULL);
+        i++;
+    }
+    to_vars = f->vars;
+    num_map_vars = f->num_vars;
+
+    i = 0;
+    for(VarList *vl = func->args; vl; vl = vl->next) {
+        f->params[i++] = map_var(vl->var);
+    }
+
+    label_seq = 0;
+    ret_label = NULL;
+    f->body = clone_list(func->node);
+    free(from_vars);
+}
+
+// 関数nameのキャッシュのキーを返す。登録されていなければNULLを返す。
+char *inline_cache_key(char *name) {
+    InlineFunc *f = find_inline(name);
+    return f ? f->cache_key : NULL;
+}
+
+// 登録した関数を全て忘れる
+void inline_reset(void) {
+    memset(inline_funcs, 0, sizeof(inline_funcs));
+}
+
+//
+// 呼び出しの置き換え
+//
+
+// callerの中の関数呼び出しnodeを、関数fの本体で置き換える
+static void inline_call(Function *caller, Node *node, InlineFunc *f) {
+    // 雛形の変数を呼び出し元の新しいローカル変数に対応付ける
+    from_vars = f->vars;
+    to_vars = calloc(f->num_vars + 1, sizeof(Var *));
+    num_map_vars = f->num_vars;
+    for(int i = 0; i < f->num_vars; i++) {
+        to_vars[i] = copy_var(f->vars[i], caller);
+    }
+
+    label_seq++;
+    ret_label = calloc(1, 32);
+    sprintf(ret_label, "return.%d", label_seq);
+    ret_type = node->type;
+    ret_var = NULL;
+    num_ret_jumps = 0;
+    ret_caller = caller;
+
+    // 引数を仮引数の変数に代入する
+    Node head = {};
+    Node *cur = &head;
+    Node *arg = node->args;
+    for(int i = 0; i < f->num_params; i++) {
+        Node *next = arg->next;
+        arg->next = NULL;
+        cur->next = new_assign_stmt(map_var(f->params[i]), arg);
+        cur = cur->next;
+        arg = next;
+    }
+
+    // 本体を複製する。最後の文のreturnはgotoにしない。
+    Node *last = f->body;
+    while(last->next) {
+        last = last->next;
+    }
+    for(Node *n = f->body; n != last; n = n->next) {
+        cur->next = clone_node(n);
+        cur = cur->next;
+    }
+
+    Node *val = NULL;
+    if(last->kind == ND_RETURN && last->lhs && ret_type->ty != VOID) {
+        Node *expr = clone_node(last->lhs);
+        if(ret_var) {
+            cur->next = new_assign_stmt(ret_var, expr);
+            cur = cur->next;
+        } else {
+            val = new_node(ND_CAST);
+            val->type = ret_type;
+            val->lhs = expr;
+        }
+    } else if(last->kind == ND_RETURN) {
+        if(last->lhs) {
+            cur->next = new_node(ND_EXPR_STMT);
+            cur->next->lhs = clone_node(last->lhs);
+            cur = cur->next;
+        }
+    } else {
+        cur->next = clone_node(last);
+        cur = cur->next;
+    }
+
+    if(num_ret_jumps) {
+        cur->next = new_node(ND_LABEL);
+        cur = cur->next;
+        cur->label_name = ret_label;
+        cur->lhs = new_node(ND_NULL);
+    } else {
+        free(ret_label);
+    }
+
+    // 式の値。戻り値がない場合は0にしておく。
+    if(!val && ret_type->ty != VOID) {
+        val = new_var_ref(get_ret_var());
+    } else if(!val) {
+        val = new_node(ND_NUM);
+        val->type = long_type;
+    }
+    cur->next = val;
+
+    Node *expr = new_node(ND_STMT_EXPR);
+    expr->type = node->type;
+    expr->block = head.next;
+
+    // 呼び出し元のノードはリストの途中にあり得るので、nextを残して中身を入れ替える
+    Node *next = node->next;
+    free(node->func_name);
+    memcpy(node, expr, sizeof(Node));
+    node->next = next;
+    free(expr);
+    free(to_vars);
+}
+
+// callerの本体のノードnode以下に含まれる関数呼び出しをインライン展開する
+static void inline_calls(Function *caller, Node *node) {
+    if(!node) {
+        return;
+    }
+
+    inline_calls(caller, node->lhs);
+    inline_calls(caller, node->rhs);
+    inline_calls(caller, node->cond);
+    inline_calls(caller, node->then);
+    inline_calls(caller, node->els);
+    inline_calls(caller, node->init);
+    inline_calls(caller, node->post);
+    for(Node *n = node->block; n; n = n->next) {
+        inline_calls(caller, n);
+    }
+    for(Node *n = node->args; n; n = n->next) {
+        inline_calls(caller, n);
+    }
+
+    if(node->kind != ND_FUNCCALL || node->type->ty == STRUCT ||
+       !strcmp(node->func_name, caller->name)) {
+        return;
+    }
+
+    InlineFunc *f = find_inline(node->func_name);
+    if(!f || !f->body) {
+        return;
+    }
+
+    int nargs = 0;
+    for(Node *n = node->args; n; n = n->next) {
+        nargs++;
+    }
+    if(nargs != f->num_params) {
+        return;
+    }
+
+    inline_call(caller, node, f);
+}
+
+// 関数funcの中の、登録済みの関数の呼び出しをインライン展開する
+void inline_function(Function *func) {
+    label_seq = 0;
+    for(Node *node = func->node; node; node = node->next) {
+        inline_calls(func, node);
+    }
+}
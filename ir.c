@@ -0,0 +1,1103 @@
+#include "zxcc.h"
+
+// 抽象構文木を3番地コード形式の中間表現(IR)に変換する。
+//
+// IRは関数ごとに基本ブロックの列からなり、各命令は仮想レジスタを読み書きする。
+// 仮想レジスタの数に制限はなく、1から順に番号を振る(0は「なし」を表す)。
+// ローカル変数はメモリ上に置き、IR_LVARで得たアドレスに対して明示的に
+// IR_LOAD/IR_STOREする。スタックマシン方式のgen()と同じく、値は全て64ビットに
+// 符号拡張して扱う。
+
+// 変換中の関数
+static Function *cur_func;
+// 命令を追加している基本ブロック
+static BB *cur_bb;
+// 配置順で最後の基本ブロック
+static BB *last_bb;
+// 番号から基本ブロックを引くための表
+static BB **bb_table;
+static int bb_table_cap;
+
+// break、continueの飛び先
+static BB *brk_bb;
+static BB *cont_bb;
+
+// 最後に記録したループ
+static Loop *last_loop;
+
+// gotoのラベル名と基本ブロックの対応
+typedef struct LabelBB LabelBB;
+struct LabelBB {
+    LabelBB *next;
+    char *name;
+    BB *bb;
+};
+static LabelBB *label_bbs;
+
+static int new_reg(void) { return ++cur_func->num_regs; }
+
+// 新しい基本ブロックを作る。配置はstart_bb()を呼んだ時点で決まる。
+static BB *new_bb(void) {
+    BB *bb = calloc(1, sizeof(BB));
+    bb->label = ++cur_func->num_bbs;
+
+    if(bb->label >= bb_table_cap) {
+        bb_table_cap = bb_table_cap ? bb_table_cap * 2 : 64;
+        bb_table = realloc(bb_table, sizeof(BB *) * bb_table_cap);
+    }
+    bb_table[bb->label] = bb;
+    return bb;
+}
+
+// 基本ブロックbbを配置し、以降の命令の追加先にする
+static void start_bb(BB *bb) {
+    if(last_bb) {
+        last_bb->next = bb;
+    } else {
+        cur_func->bbs = bb;
+    }
+    last_bb = bb;
+    cur_bb = bb;
+}
+
+static IR *new_ir(IROp op) {
+    IR *ir = calloc(1, sizeof(IR));
+    ir->op = op;
+    if(cur_bb->last) {
+        cur_bb->last->next = ir;
+    } else {
+        cur_bb->ir = ir;
+    }
+    cur_bb->last = ir;
+    return ir;
+}
+
+// 仮想レジスタdstに定数valを代入する
+static void emit_set(int dst, long val) {
+    IR *ir = new_ir(IR_IMM);
+    ir->dst = dst;
+    ir->imm = val;
+}
+
+static int emit_imm(long val) {
+    int dst = new_reg();
+    emit_set(dst, val);
+    return dst;
+}
+
+static int emit_unary(IROp op, int a) {
+    IR *ir = new_ir(op);
+    ir->dst = new_reg();
+    ir->a = a;
+    return ir->dst;
+}
+
+static int emit_binary(IROp op, int a, int b) {
+    IR *ir = new_ir(op);
+    ir->dst = new_reg();
+    ir->a = a;
+    ir->b = b;
+    return ir->dst;
+}
+
+static void emit_mov(int dst, int a) {
+    IR *ir = new_ir(IR_MOV);
+    ir->dst = dst;
+    ir->a = a;
+}
+
+// 無条件ジャンプ。以降の命令は到達不能なので新しいブロックに入れる。
+static void emit_jmp(BB *bb) {
+    new_ir(IR_JMP)->then = bb;
+    start_bb(new_bb());
+}
+
+// aが0でなければthen、0ならelsへ分岐する。呼び出し側は続けて分岐先を配置する。
+// a cmp bが成り立てばthenへ、成り立たなければelsへジャンプする
+static void emit_cmp_br(IROp cmp, int a, int b, BB *then, BB *els) {
+    IR *ir = new_ir(IR_BR);
+    ir->cmp = cmp;
+    ir->a = a;
+    ir->b = b;
+    ir->then = then;
+    ir->els = els;
+}
+
+// ループを記録する。ループは内側から順に閉じるので、末尾に追加すれば
+// 内側のループが先に並ぶ。
+static void add_loop(BB *preheader, BB *header, BB *last, BB *cond) {
+    Loop *loop = calloc(1, sizeof(Loop));
+    loop->preheader = preheader;
+    loop->header = header;
+    loop->last = last;
+    loop->cond = cond;
+    if(last_loop) {
+        last_loop->next = loop;
+    } else {
+        cur_func->loops = loop;
+    }
+    last_loop = loop;
+}
+
+// aが0でなければthenへ、0ならelsへジャンプする
+static void emit_br(int a, BB *then, BB *els) {
+    emit_cmp_br(IR_NE, a, 0, then, els);
+}
+
+// 現在のブロックから次のブロックbbへ移る
+static void fall_into(BB *bb) {
+    new_ir(IR_JMP)->then = bb;
+    start_bb(bb);
+}
+
+// 型tyの値をアドレスaddrから読み出す。配列はアドレスそのものが値になる。
+static int load(Type *ty, int addr) {
+    if(ty->ty == ARRAY) {
+        return addr;
+    }
+    IR *ir = new_ir(IR_LOAD);
+    ir->dst = new_reg();
+    ir->a = addr;
+    ir->size = ty->size;
+    return ir->dst;
+}
+
+// 型tyの値valをアドレスaddrに書き込み、書き込んだ値を返す
+static int store(Type *ty, int addr, int val) {
+    if(ty->ty == BOOL) {
+        val = emit_binary(IR_NE, val, emit_imm(0));
+    }
+    IR *ir = new_ir(IR_STORE);
+    ir->a = addr;
+    ir->b = val;
+    ir->size = ty->size;
+    return val;
+}
+
+// 値aを型tyに変換する
+static int cast(Type *ty, int a) {
+    if(ty->ty == BOOL) {
+        return emit_binary(IR_NE, a, emit_imm(0));
+    }
+    if(ty->size == 1 || ty->size == 2 || ty->size == 4) {
+        IR *ir = new_ir(IR_SEXT);
+        ir->dst = new_reg();
+        ir->a = a;
+        ir->size = ty->size;
+        return ir->dst;
+    }
+    return a;
+}
+
+static BB *find_label(char *name) {
+    for(LabelBB *l = label_bbs; l; l = l->next) {
+        if(!strcmp(l->name, name)) {
+            return l->bb;
+        }
+    }
+
+    LabelBB *l = calloc(1, sizeof(LabelBB));
+    l->name = name;
+    l->bb = new_bb();
+    l->next = label_bbs;
+    label_bbs = l;
+    return l->bb;
+}
+
+static int lower(Node *node);
+static int lower_addr(Node *node);
+
+// nodeが仮想レジスタに置いたローカル変数ならその変数を返す
+static Var *reg_var(Node *node) {
+    if(node->kind == ND_VAR && node->var->is_local && node->var->reg) {
+        return node->var;
+    }
+    return NULL;
+}
+
+// 仮想レジスタに置いた変数varの値を読み出す。
+// 後から変数に代入しても読み出した値が変わらないよう、別の仮想レジスタにコピーする。
+static int load_reg_var(Var *var) {
+    int dst = new_reg();
+    emit_mov(dst, var->reg);
+    return dst;
+}
+
+// 仮想レジスタに置いた変数varに値valを代入し、代入した値を返す
+static int store_reg_var(Var *var, int val) {
+    val = cast(var->type, val);
+    emit_mov(var->reg, val);
+    return val;
+}
+
+// 代入先の左辺値nodeを評価する。メモリ上の左辺値ならそのアドレスを、
+// 仮想レジスタに置いた変数なら0を返す。
+static int lower_lval(Node *node) {
+    if(reg_var(node)) {
+        if(node->init) {
+            lower(node->init);
+        }
+        return 0;
+    }
+    return lower_addr(node);
+}
+
+// lower_lval()で評価した左辺値nodeから型tyの値を読み出す
+static int load_lval(Node *node, Type *ty, int addr) {
+    Var *var = reg_var(node);
+    return var ? load_reg_var(var) : load(ty, addr);
+}
+
+// lower_lval()で評価した左辺値nodeに型tyの値valを書き込み、書き込んだ値を返す
+static int store_lval(Node *node, Type *ty, int addr, int val) {
+    Var *var = reg_var(node);
+    return var ? store_reg_var(var, val) : store(ty, addr, val);
+}
+
+// nodeのアドレスを計算する
+static int lower_addr(Node *node) {
+    switch(node->kind) {
+        case ND_VAR: {
+            if(node->init) {
+                lower(node->init);
+            }
+
+            IR *ir;
+            if(node->var->is_local) {
+                ir = new_ir(IR_LVAR);
+                ir->var = node->var;
+            } else {
+                ir = new_ir(IR_GVAR);
+                ir->name = node->var->name;
+            }
+            ir->dst = new_reg();
+            return ir->dst;
+        }
+        case ND_DEREF:
+            return lower(node->lhs);
+        case ND_MEMBER: {
+            int base = lower_addr(node->lhs);
+            return emit_binary(IR_ADD, base, emit_imm(node->member->offset));
+        }
+    }
+    error("引数が左辺値として評価不可能なノードです");
+    return 0;
+}
+
+// 二項演算子のノードの種類に対応する命令を返す
+static IROp binary_op(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD:
+        case ND_ADD_EQ:
+        case ND_PTR_ADD:
+        case ND_PTR_ADD_EQ:
+            return IR_ADD;
+        case ND_SUB:
+        case ND_SUB_EQ:
+        case ND_PTR_SUB:
+        case ND_PTR_SUB_EQ:
+        case ND_PTR_DIFF:
+            return IR_SUB;
+        case ND_MUL:
+        case ND_MUL_EQ:
+            return IR_MUL;
+        case ND_DIV:
+        case ND_DIV_EQ:
+            return IR_DIV;
+        case ND_BITAND:
+        case ND_BITAND_EQ:
+            return IR_AND;
+        case ND_BITOR:
+        case ND_BITOR_EQ:
+            return IR_OR;
+        case ND_BITXOR:
+        case ND_BITXOR_EQ:
+            return IR_XOR;
+        case ND_SHL:
+        case ND_SHL_EQ:
+            return IR_SHL;
+        case ND_SHR:
+        case ND_SHR_EQ:
+            return IR_SHR;
+        case ND_EQ:
+            return IR_EQ;
+        case ND_NE:
+            return IR_NE;
+        case ND_LT:
+            return IR_LT;
+        case ND_LE:
+            return IR_LE;
+    }
+    error("二項演算子ではありません");
+    return 0;
+}
+
+// aをsize倍する。2のべき乗ならシフトにする。
+static int lower_scale(int a, long size) {
+    int k = log2_exact(size);
+    if(k == 0) {
+        return a;
+    }
+    if(k > 0) {
+        return emit_binary(IR_SHL, a, emit_imm(k));
+    }
+    return emit_binary(IR_MUL, a, emit_imm(size));
+}
+
+// 割り切れることが分かっているaをsizeで割る(ポインタの差)。
+// 2のべき乗の部分は算術シフトし、残りの奇数は2^64を法とする逆元を掛ける。
+static int lower_exact_div(int a, long size) {
+    int k = 0;
+    while(!((size >> k) & 1)) {
+        k++;
+    }
+    if(k > 0) {
+        a = emit_binary(IR_SHR, a, emit_imm(k));
+    }
+    if(size >> k == 1) {
+        return a;
+    }
+    return emit_binary(IR_MUL, a, emit_imm(mod_inverse(size >> k)));
+}
+
+// aを定数dで割る。除算命令を使わずに済む場合はその結果を、そうでなければ0を返す。
+// int32はaの値が32ビットに収まることを表す。
+static int lower_div_imm(int a, long d, bool int32) {
+    long ad = d < 0 ? -d : d;
+    int k = log2_exact(ad);
+    int q;
+    if(d == 1) {
+        return a;
+    }
+    if(k > 0) {
+        // 負の値は2^k-1を足してから算術シフトし、0方向に丸める
+        int sign = emit_binary(IR_SHR, a, emit_imm(63));
+        int bias = emit_binary(IR_AND, sign, emit_imm(ad - 1));
+        int sum = emit_binary(IR_ADD, a, bias);
+        q = emit_binary(IR_SHR, sum, emit_imm(k));
+    } else if(int32 && ad > 2 && ad == (int)ad) {
+        int shift;
+        long m = div_magic(ad, &shift);
+        int prod = emit_binary(IR_MUL, a, emit_imm(m));
+        int sign = emit_binary(IR_SHR, a, emit_imm(63));
+        int hi = emit_binary(IR_SHR, prod, emit_imm(shift));
+        q = emit_binary(IR_SUB, hi, sign);
+    } else {
+        return 0;
+    }
+    if(d < 0) {
+        q = emit_binary(IR_SUB, emit_imm(0), q);
+    }
+    return q;
+}
+
+// 二項演算a op bを計算する。ポインタの加減算では整数側を要素のサイズ倍する。
+static int lower_binary(Node *node, int a, int b) {
+    NodeKind kind = node->kind;
+    if(kind == ND_PTR_ADD || kind == ND_PTR_ADD_EQ || kind == ND_PTR_SUB ||
+       kind == ND_PTR_SUB_EQ) {
+        b = lower_scale(b, node->type->ptr_to->size);
+    }
+
+    if((kind == ND_DIV || kind == ND_DIV_EQ) && node->rhs->kind == ND_NUM) {
+        int q = lower_div_imm(a, node->rhs->val, is_int32_value(node->lhs));
+        if(q) {
+            return q;
+        }
+    }
+
+    int val = emit_binary(binary_op(kind), a, b);
+
+    if(kind == ND_PTR_DIFF) {
+        val = lower_exact_div(val, node->lhs->type->ptr_to->size);
+    }
+    return val;
+}
+
+static int lower_call(Node *node) {
+    if(!strcmp(node->func_name, "__builtin_va_start")) {
+        new_ir(IR_VA_START)->a = lower(node->args);
+        return 0;
+    }
+
+    int nargs = 0;
+    for(Node *arg = node->args; arg; arg = arg->next) {
+        nargs++;
+    }
+    if(nargs > 6) {
+        error("%s: , 7個以上の引数を持つ関数です", node->func_name);
+    }
+
+    int *args = calloc(nargs + 1, sizeof(int));
+    int i = 0;
+    for(Node *arg = node->args; arg; arg = arg->next) {
+        args[i++] = lower(arg);
+    }
+
+    IR *ir = new_ir(IR_CALL);
+    ir->dst = new_reg();
+    ir->name = node->func_name;
+    ir->args = args;
+    ir->nargs = nargs;
+    ir->is_variadic_call = node->is_variadic_call;
+
+    if(node->type->ty == BOOL) {
+        return emit_binary(IR_AND, ir->dst, emit_imm(255));
+    }
+    return ir->dst;
+}
+
+// ベクトル命令で処理する配列の演算
+static int lower_vector(Node *node) {
+    int nargs = 0;
+    for(Node *arg = node->args; arg; arg = arg->next) {
+        nargs++;
+    }
+
+    int *args = calloc(nargs, sizeof(int));
+    int i = 0;
+    for(Node *arg = node->args; arg; arg = arg->next) {
+        args[i++] = lower(arg);
+    }
+
+    IR *ir = new_ir(IR_VEC);
+    ir->dst = new_reg();
+    ir->args = args;
+    ir->nargs = nargs;
+    ir->size = node->vec_size;
+    ir->vec_kind = node->vec_kind;
+    ir->vec_op = binary_op(node->vec_op);
+    return ir->dst;
+}
+
+// switch文の値valがcases[lo]からcases[hi-1]のどれに一致するかを二分探索する
+// 比較の木を出力する。どれにも一致しなければdefへジャンプする。
+static void lower_case_tree(int val, Node **cases, int lo, int hi, BB *def) {
+    // 少ない場合は順に比較する
+    if(hi - lo <= 4) {
+        for(int i = lo; i < hi; i++) {
+            BB *next_bb = new_bb();
+            int imm = emit_imm(cases[i]->val);
+            emit_cmp_br(IR_EQ, val, imm, bb_table[cases[i]->case_label],
+                        next_bb);
+            start_bb(next_bb);
+        }
+        new_ir(IR_JMP)->then = def;
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    BB *ne_bb = new_bb();
+    BB *left_bb = new_bb();
+    BB *right_bb = new_bb();
+    int imm = emit_imm(cases[mid]->val);
+    emit_cmp_br(IR_EQ, val, imm, bb_table[cases[mid]->case_label], ne_bb);
+    start_bb(ne_bb);
+    emit_cmp_br(IR_LT, imm, val, right_bb, left_bb);
+
+    start_bb(left_bb);
+    lower_case_tree(val, cases, lo, mid, def);
+    start_bb(right_bb);
+    lower_case_tree(val, cases, mid + 1, hi, def);
+}
+
+// switch文nodeの分岐をジャンプテーブルで行う。valが範囲外ならdefへジャンプする。
+static void lower_jump_table(Node *node, int val, BB *def) {
+    Node **cases = node->cases;
+    long min = cases[0]->val;
+    long max = cases[node->num_cases - 1]->val;
+
+    IR *ir = new_ir(IR_JTAB);
+    ir->a = val;
+    ir->imm = min;
+    ir->els = def;
+    ir->num_targets = max - min + 1;
+
+    // 生存解析で後続ブロックとして扱えるよう、末尾にelsも入れておく
+    ir->targets = calloc(ir->num_targets + 1, sizeof(BB *));
+    int k = 0;
+    for(int i = 0; i < ir->num_targets; i++) {
+        if(cases[k]->val == min + i) {
+            ir->targets[i] = bb_table[cases[k++]->case_label];
+        } else {
+            ir->targets[i] = def;
+        }
+    }
+    ir->targets[ir->num_targets] = def;
+}
+
+// nodeをIRに変換する。式の場合は値を格納した仮想レジスタを、文の場合は0を返す。
+// 条件nodeが真ならthenへ、偽ならelsへジャンプする。
+// 比較は値を作らずに分岐命令で直接比較し、&&、||、!は分岐先を付け替えて評価する。
+static void lower_cond(Node *node, BB *then, BB *els) {
+    switch(node->kind) {
+        case ND_NOT:
+            lower_cond(node->lhs, els, then);
+            return;
+        case ND_LOGAND: {
+            BB *rhs_bb = new_bb();
+            lower_cond(node->lhs, rhs_bb, els);
+            start_bb(rhs_bb);
+            lower_cond(node->rhs, then, els);
+            return;
+        }
+        case ND_LOGOR: {
+            BB *rhs_bb = new_bb();
+            lower_cond(node->lhs, then, rhs_bb);
+            start_bb(rhs_bb);
+            lower_cond(node->rhs, then, els);
+            return;
+        }
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE: {
+            int a = lower(node->lhs);
+            int b = lower(node->rhs);
+            emit_cmp_br(binary_op(node->kind), a, b, then, els);
+            return;
+        }
+    }
+    emit_br(lower(node), then, els);
+}
+
+// while、forループnodeをdo-while形式に回転して変換する(codegen.cのcan_rotate()参照)。
+// ループに入る前の判定が成り立った場合だけ通るブロックをpreheaderにする。
+static void lower_rotated_loop(Node *node) {
+    BB *brk = brk_bb;
+    BB *cont = cont_bb;
+    BB *preheader = new_bb();
+    BB *body_bb = new_bb();
+    brk_bb = new_bb();
+    cont_bb = new_bb();
+
+    if(node->cond) {
+        lower_cond(node->cond, preheader, brk_bb);
+    }
+    start_bb(preheader);
+    fall_into(body_bb);
+    lower(node->then);
+    fall_into(cont_bb);
+    if(node->post) {
+        lower(node->post);
+    }
+
+    BB *cond_bb = NULL;
+    if(node->cond) {
+        cond_bb = new_bb();
+        fall_into(cond_bb);
+        lower_cond(node->cond, body_bb, brk_bb);
+    } else {
+        new_ir(IR_JMP)->then = body_bb;
+    }
+    add_loop(preheader, body_bb, cur_bb, cond_bb);
+    start_bb(brk_bb);
+
+    brk_bb = brk;
+    cont_bb = cont;
+}
+
+static int lower(Node *node) {
+    switch(node->kind) {
+        case ND_NULL:
+            return 0;
+        case ND_NUM:
+            return emit_imm(node->val);
+        case ND_EXPR_STMT:
+            lower(node->lhs);
+            return 0;
+        case ND_VAR:
+            if(reg_var(node)) {
+                lower_lval(node);
+                return load_reg_var(node->var);
+            }
+            return load(node->type, lower_addr(node));
+        case ND_MEMBER:
+        case ND_DEREF:
+            return load(node->type, lower_addr(node));
+        case ND_ADDR:
+            return lower_addr(node->lhs);
+        case ND_ASSIGN: {
+            int addr = lower_lval(node->lhs);
+            int val = lower(node->rhs);
+            return store_lval(node->lhs, node->type, addr, val);
+        }
+        case ND_PRE_INC:
+        case ND_PRE_DEC:
+        case ND_POST_INC:
+        case ND_POST_DEC: {
+            Type *ty = node->type;
+            int addr = lower_lval(node->lhs);
+            int val = load_lval(node->lhs, ty, addr);
+            int step = emit_imm(ty->ptr_to ? ty->ptr_to->size : 1);
+            bool inc = node->kind == ND_PRE_INC || node->kind == ND_POST_INC;
+            int res = emit_binary(inc ? IR_ADD : IR_SUB, val, step);
+            res = store_lval(node->lhs, ty, addr, res);
+            if(node->kind == ND_POST_INC || node->kind == ND_POST_DEC) {
+                return val;
+            }
+            return res;
+        }
+        case ND_ADD_EQ:
+        case ND_PTR_ADD_EQ:
+        case ND_SUB_EQ:
+        case ND_PTR_SUB_EQ:
+        case ND_MUL_EQ:
+        case ND_DIV_EQ:
+        case ND_SHL_EQ:
+        case ND_SHR_EQ:
+        case ND_BITAND_EQ:
+        case ND_BITOR_EQ:
+        case ND_BITXOR_EQ: {
+            int addr = lower_lval(node->lhs);
+            int val = load_lval(node->lhs, node->lhs->type, addr);
+            int rhs = lower(node->rhs);
+            int res = lower_binary(node, val, rhs);
+            return store_lval(node->lhs, node->type, addr, res);
+        }
+        case ND_COMMA:
+            lower(node->lhs);
+            return lower(node->rhs);
+        case ND_CAST:
+            return cast(node->type, lower(node->lhs));
+        case ND_NOT: {
+            int val = lower(node->lhs);
+            return emit_binary(IR_EQ, val, emit_imm(0));
+        }
+        case ND_BITNOT:
+            return emit_unary(IR_NOT, lower(node->lhs));
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            // &&は左辺が偽なら、||は左辺が真なら右辺を評価せずに結果が決まる
+            bool is_and = node->kind == ND_LOGAND;
+            int res = new_reg();
+            BB *rhs_bb = new_bb();
+            BB *set_bb = new_bb();
+            BB *short_bb = new_bb();
+            BB *end_bb = new_bb();
+
+            if(is_and) {
+                lower_cond(node->lhs, rhs_bb, short_bb);
+            } else {
+                lower_cond(node->lhs, short_bb, rhs_bb);
+            }
+
+            start_bb(rhs_bb);
+            if(is_and) {
+                lower_cond(node->rhs, set_bb, short_bb);
+            } else {
+                lower_cond(node->rhs, short_bb, set_bb);
+            }
+
+            start_bb(set_bb);
+            emit_set(res, is_and);
+            new_ir(IR_JMP)->then = end_bb;
+
+            start_bb(short_bb);
+            emit_set(res, !is_and);
+            fall_into(end_bb);
+            return res;
+        }
+        case ND_TERNARY: {
+            int res = new_reg();
+            BB *then_bb = new_bb();
+            BB *els_bb = new_bb();
+            BB *end_bb = new_bb();
+
+            lower_cond(node->cond, then_bb, els_bb);
+
+            start_bb(then_bb);
+            int val = lower(node->then);
+            if(val) emit_mov(res, val);
+            new_ir(IR_JMP)->then = end_bb;
+
+            start_bb(els_bb);
+            val = lower(node->els);
+            if(val) emit_mov(res, val);
+            fall_into(end_bb);
+            return res;
+        }
+        case ND_FUNCCALL:
+            return lower_call(node);
+        case ND_VECTOR:
+            return lower_vector(node);
+        case ND_RETURN: {
+            int val = node->lhs ? lower(node->lhs) : 0;
+            new_ir(IR_RET)->a = val;
+            start_bb(new_bb());
+            return 0;
+        }
+        case ND_IF: {
+            BB *then_bb = new_bb();
+            BB *els_bb = new_bb();
+            BB *end_bb = node->els ? new_bb() : els_bb;
+
+            lower_cond(node->cond, then_bb, els_bb);
+
+            start_bb(then_bb);
+            lower(node->then);
+            if(node->els) {
+                new_ir(IR_JMP)->then = end_bb;
+                start_bb(els_bb);
+                lower(node->els);
+            }
+            fall_into(end_bb);
+            return 0;
+        }
+        case ND_WHILE:
+        case ND_FOR: {
+            if(node->init) {
+                lower(node->init);
+            }
+            if(can_rotate(node)) {
+                lower_rotated_loop(node);
+                return 0;
+            }
+
+            BB *brk = brk_bb;
+            BB *cont = cont_bb;
+            BB *begin_bb = new_bb();
+            BB *body_bb = new_bb();
+            brk_bb = new_bb();
+            cont_bb = node->kind == ND_FOR ? new_bb() : begin_bb;
+
+            BB *preheader = cur_bb;
+            fall_into(begin_bb);
+            if(node->cond) {
+                lower_cond(node->cond, body_bb, brk_bb);
+            }
+            start_bb(body_bb);
+            lower(node->then);
+            if(node->kind == ND_FOR) {
+                fall_into(cont_bb);
+                if(node->post) {
+                    lower(node->post);
+                }
+            }
+            new_ir(IR_JMP)->then = begin_bb;
+            add_loop(preheader, begin_bb, cur_bb, NULL);
+            start_bb(brk_bb);
+
+            brk_bb = brk;
+            cont_bb = cont;
+            return 0;
+        }
+        case ND_DO: {
+            BB *brk = brk_bb;
+            BB *cont = cont_bb;
+            BB *begin_bb = new_bb();
+            brk_bb = new_bb();
+            cont_bb = new_bb();
+
+            BB *preheader = cur_bb;
+            fall_into(begin_bb);
+            lower(node->then);
+            fall_into(cont_bb);
+            lower_cond(node->cond, begin_bb, brk_bb);
+            add_loop(preheader, begin_bb, cur_bb, NULL);
+            start_bb(brk_bb);
+
+            brk_bb = brk;
+            cont_bb = cont;
+            return 0;
+        }
+        case ND_SWITCH: {
+            BB *brk = brk_bb;
+            brk_bb = new_bb();
+
+            int val = lower(node->cond);
+            for(int i = 0; i < node->num_cases; i++) {
+                node->cases[i]->case_label = new_bb()->label;
+            }
+
+            // どのcaseにも一致しない場合の飛び先
+            BB *default_bb = brk_bb;
+            if(node->default_case) {
+                default_bb = new_bb();
+                node->default_case->case_label = default_bb->label;
+            }
+
+            if(use_jump_table(node)) {
+                lower_jump_table(node, val, default_bb);
+            } else {
+                lower_case_tree(val, node->cases, 0, node->num_cases,
+                                default_bb);
+            }
+            start_bb(new_bb());
+
+            lower(node->then);
+            fall_into(brk_bb);
+            brk_bb = brk;
+            return 0;
+        }
+        case ND_CASE:
+            fall_into(bb_table[node->case_label]);
+            lower(node->lhs);
+            return 0;
+        case ND_BLOCK:
+            for(Node *n = node->block; n; n = n->next) {
+                lower(n);
+            }
+            return 0;
+        case ND_STMT_EXPR: {
+            // 最後の文の値が式の値になる
+            int val = 0;
+            for(Node *n = node->block; n; n = n->next) {
+                val = lower(n);
+            }
+            return val;
+        }
+        case ND_BREAK:
+            if(!brk_bb) {
+                error("不正なbreakです");
+            }
+            emit_jmp(brk_bb);
+            return 0;
+        case ND_CONTINUE:
+            if(!cont_bb) {
+                error("不正なcontinueです");
+            }
+            emit_jmp(cont_bb);
+            return 0;
+        case ND_GOTO:
+            emit_jmp(find_label(node->label_name));
+            return 0;
+        case ND_LABEL:
+            fall_into(find_label(node->label_name));
+            lower(node->lhs);
+            return 0;
+    }
+
+    int lhs = lower(node->lhs);
+    int rhs = lower(node->rhs);
+    return lower_binary(node, lhs, rhs);
+}
+
+// node以下でアドレスを取られているローカル変数に印を付ける
+static void mark_addr_taken(Node *node) {
+    if(!node) {
+        return;
+    }
+
+    if(node->kind == ND_ADDR) {
+        Node *n = node->lhs;
+        while(n->kind == ND_MEMBER) {
+            n = n->lhs;
+        }
+        if(n->kind == ND_VAR) {
+            n->var->addr_taken = true;
+        }
+    }
+
+    mark_addr_taken(node->lhs);
+    mark_addr_taken(node->rhs);
+    mark_addr_taken(node->cond);
+    mark_addr_taken(node->then);
+    mark_addr_taken(node->els);
+    mark_addr_taken(node->init);
+    mark_addr_taken(node->post);
+    for(Node *n = node->block; n; n = n->next) {
+        mark_addr_taken(n);
+    }
+    for(Node *n = node->args; n; n = n->next) {
+        mark_addr_taken(n);
+    }
+}
+
+// スカラー型のローカル変数を仮想レジスタに置く。
+// ポインタ演算で隣の変数に届くことを前提にしたコードもあるので、
+// いずれかのローカル変数のアドレスを取る関数では、全ての変数をメモリに置く。
+static void assign_reg_vars(Function *func) {
+    bool addr_taken = false;
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        vl->var->addr_taken = false;
+        vl->var->reg = 0;
+    }
+    for(Node *node = func->node; node; node = node->next) {
+        mark_addr_taken(node);
+    }
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        if(vl->var->addr_taken) addr_taken = true;
+    }
+    if(addr_taken) {
+        return;
+    }
+
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        Var *var = vl->var;
+        TypeKind ty = var->type->ty;
+        if(ty != ARRAY && ty != STRUCT) {
+            var->reg = new_reg();
+        }
+    }
+}
+
+// 関数funcのIRを生成する
+void gen_ir(Function *func) {
+    cur_func = func;
+    func->num_regs = 0;
+    func->num_bbs = 0;
+    func->bbs = NULL;
+    func->loops = NULL;
+    last_bb = NULL;
+    last_loop = NULL;
+    label_bbs = NULL;
+    brk_bb = NULL;
+    cont_bb = NULL;
+
+    start_bb(new_bb());
+    assign_reg_vars(func);
+
+    // レジスタで渡された引数をローカル変数に書き込む
+    int i = 0;
+    for(VarList *vl = func->args; vl; vl = vl->next) {
+        IR *ir = new_ir(IR_PARAM);
+        ir->dst = new_reg();
+        ir->imm = i++;
+
+        Var *var = vl->var;
+        if(var->reg) {
+            store_reg_var(var, ir->dst);
+            continue;
+        }
+
+        IR *addr = new_ir(IR_LVAR);
+        addr->dst = new_reg();
+        addr->var = var;
+        store(var->type, addr->dst, ir->dst);
+    }
+
+    for(Node *node = func->node; node; node = node->next) {
+        lower(node);
+    }
+}
+
+// 関数funcのIRを解放する
+void free_ir(Function *func) {
+    for(BB *bb = func->bbs; bb;) {
+        BB *next = bb->next;
+        for(IR *ir = bb->ir; ir;) {
+            IR *next_ir = ir->next;
+            free(ir->args);
+            free(ir->targets);
+            free(ir);
+            ir = next_ir;
+        }
+        free(bb);
+        bb = next;
+    }
+    func->bbs = NULL;
+
+    for(Loop *loop = func->loops; loop;) {
+        Loop *next = loop->next;
+        free(loop);
+        loop = next;
+    }
+    func->loops = NULL;
+
+    free(func->reg_map);
+    free(func->spill_slot);
+    func->reg_map = NULL;
+    func->spill_slot = NULL;
+}
+
+//
+// IRのダンプ
+//
+
+static char *ir_names[] = {
+    "imm",  "mov",   "add",  "sub",   "mul",    "div",   "and",  "or",
+    "xor",  "shl",   "shr",  "eq",    "ne",     "lt",    "le",   "not",
+    "sext", "lvar",  "gvar", "load",  "store",  "param", "call", "va_start",
+    "vec",  "jmp",   "br",   "jtab",  "ret",
+};
+
+static void dump_reg(FILE *fp, int reg) { fprintf(fp, "v%d", reg); }
+
+// 関数funcのIRを人間が読める形式でfpに出力する
+void dump_ir(Function *func, FILE *fp) {
+    fprintf(fp, "%s:\n", func->name);
+
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        fprintf(fp, "bb%d:\n", bb->label);
+
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            fprintf(fp, "  ");
+            if(ir->dst) {
+                dump_reg(fp, ir->dst);
+                fprintf(fp, " = ");
+            }
+
+            fprintf(fp, "%s", ir_names[(int)ir->op]);
+            if(ir->size) {
+                fprintf(fp, "%d", ir->size);
+            }
+
+            switch(ir->op) {
+                case IR_IMM:
+                    fprintf(fp, " %ld", ir->imm);
+                    break;
+                case IR_PARAM:
+                    fprintf(fp, " %ld", ir->imm);
+                    break;
+                case IR_LVAR:
+                    fprintf(fp, " %s", ir->var->name);
+                    break;
+                case IR_GVAR:
+                    fprintf(fp, " %s", ir->name);
+                    break;
+                case IR_CALL:
+                    fprintf(fp, " %s(", ir->name);
+                    for(int i = 0; i < ir->nargs; i++) {
+                        if(i > 0) fprintf(fp, ", ");
+                        dump_reg(fp, ir->args[i]);
+                    }
+                    fprintf(fp, ")");
+                    break;
+                case IR_VEC:
+                    fprintf(fp, " %s", ir_names[(int)ir->vec_op]);
+                    if(ir->vec_kind == VEC_SUM) {
+                        fprintf(fp, " sum");
+                    }
+                    for(int i = 0; i < ir->nargs; i++) {
+                        fprintf(fp, i > 0 ? ", " : " ");
+                        dump_reg(fp, ir->args[i]);
+                    }
+                    break;
+                case IR_JMP:
+                    fprintf(fp, " bb%d", ir->then->label);
+                    break;
+                case IR_BR:
+                    fprintf(fp, " %s ", ir_names[(int)ir->cmp]);
+                    dump_reg(fp, ir->a);
+                    if(ir->b) {
+                        fprintf(fp, ", ");
+                        dump_reg(fp, ir->b);
+                    }
+                    fprintf(fp, ", bb%d, bb%d", ir->then->label,
+                            ir->els->label);
+                    break;
+                case IR_JTAB:
+                    fprintf(fp, " ");
+                    dump_reg(fp, ir->a);
+                    fprintf(fp, ", %ld, [", ir->imm);
+                    for(int i = 0; i < ir->num_targets; i++) {
+                        if(i > 0) fprintf(fp, ", ");
+                        fprintf(fp, "bb%d", ir->targets[i]->label);
+                    }
+                    fprintf(fp, "], bb%d", ir->els->label);
+                    break;
+                default:
+                    if(ir->a) {
+                        fprintf(fp, " ");
+                        dump_reg(fp, ir->a);
+                    }
+                    if(ir->b) {
+                        fprintf(fp, ", ");
+                        dump_reg(fp, ir->b);
+                    }
+            }
+            fprintf(fp, "\n");
+        }
+    }
+}
@@ -0,0 +1,365 @@
+#include "zxcc.h"
+
+// ループ不変式の移動(LICM)。
+//
+// ループの中で毎回同じ値を計算する命令を、ループの直前のブロック(preheader)に
+// 移す。例えば「i < p->len」のp->lenのアドレス計算と読み出しや、グローバル変数・
+// 配列のアドレス、定数の掛け算などが対象になる。
+//
+// 命令をループの外に移してよいのは次の場合に限る。
+//
+// - 副作用がなく、例外も起こさない命令であること(除算は0除算があるので移さない)
+// - 書き込み先の仮想レジスタが関数内でその命令でしか書き込まれず、
+//   変数を置いた仮想レジスタでもないこと
+// - 読み出す仮想レジスタがループ内で書き込まれないこと
+// - メモリの読み出しは、ループに入ると必ず実行するheaderブロックか、ループに入る
+//   前にも同じ判定をする回転したループの条件判定のブロックにあり、ループ内に
+//   関数呼び出しやベクトル命令による配列の書き込み、同じ場所を指し得る書き込みが
+//   ないこと
+//
+// 定数の代入や変数のコピーは、移してもレジスタを占有するだけなので、
+// 移した命令が使う場合に限って移す。
+
+// 仮想レジスタを書き込む命令(書き込みが1つでない場合はNULL)
+static IR **def_ir;
+// 仮想レジスタを書き込む命令の数
+static int *num_defs;
+// ループ内で書き込まれる仮想レジスタ
+static bool *def_in_loop;
+// ループ内のブロック(ブロックの番号で引く)
+static bool *in_loop;
+// 変数を置いた仮想レジスタ
+static bool *is_var_reg;
+
+// 副作用がなく、例外も起こさない命令か
+static bool is_pure(IROp op) {
+    switch(op) {
+        case IR_IMM:
+        case IR_MOV:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+        case IR_NOT:
+        case IR_SEXT:
+        case IR_LVAR:
+        case IR_GVAR:
+            return true;
+    }
+    return false;
+}
+
+//
+// 別名解析
+//
+
+// アドレスが指すオブジェクト。varもnameもNULLなら不明。
+typedef struct {
+    Var *var;    // ローカル変数
+    char *name;  // グローバル変数
+} Base;
+
+// アドレスを格納した仮想レジスタregが指すオブジェクトを求める。
+// 添字やメンバのオフセットを足しても、元のオブジェクトの中を指すものとする。
+static void find_base(int reg, Base *base) {
+    base->var = NULL;
+    base->name = NULL;
+
+    for(int i = 0; i < 16 && reg; i++) {
+        IR *ir = def_ir[reg];
+        if(!ir) {
+            return;
+        }
+        if(ir->op == IR_LVAR) {
+            base->var = ir->var;
+            return;
+        }
+        if(ir->op == IR_GVAR) {
+            base->name = ir->name;
+            return;
+        }
+        if(ir->op == IR_MOV) {
+            reg = ir->a;
+            continue;
+        }
+        if(ir->op != IR_ADD && ir->op != IR_SUB) {
+            return;
+        }
+
+        // ポインタに整数を足す場合、ポインタ側はIR_LVARかIR_GVARから辿れる
+        Base lhs;
+        find_base(ir->a, &lhs);
+        if(lhs.var || lhs.name || ir->op == IR_SUB) {
+            memcpy(base, &lhs, sizeof(Base));
+            return;
+        }
+        reg = ir->b;
+    }
+}
+
+// 不明なポインタからは指されないローカル変数か。
+// 配列や構造体は&を使わずにアドレスを得られるので除く。
+static bool is_private(Var *var) {
+    TypeKind ty = var->type->ty;
+    return !var->addr_taken && ty != ARRAY && ty != STRUCT;
+}
+
+// アドレスaとbが同じ場所を指し得るか
+static bool may_alias(int a, int b) {
+    Base x;
+    Base y;
+    find_base(a, &x);
+    find_base(b, &y);
+
+    bool x_known = x.var || x.name;
+    bool y_known = y.var || y.name;
+    if(x_known && y_known) {
+        if(x.var || y.var) {
+            return x.var == y.var;
+        }
+        return !strcmp(x.name, y.name);
+    }
+    if(x.var && is_private(x.var)) {
+        return false;
+    }
+    if(y.var && is_private(y.var)) {
+        return false;
+    }
+    return true;
+}
+
+//
+// ループ不変式の移動
+//
+
+// bbの中の命令irを取り除く
+static void unlink_ir(BB *bb, IR *ir) {
+    IR *prev = NULL;
+    for(IR *cur = bb->ir; cur != ir; cur = cur->next) {
+        prev = cur;
+    }
+    if(prev) {
+        prev->next = ir->next;
+    } else {
+        bb->ir = ir->next;
+    }
+    if(bb->last == ir) {
+        bb->last = prev;
+    }
+    ir->next = NULL;
+}
+
+// 命令irを、preheaderの最後のジャンプの直前に移す
+static void move_ir(BB *from, IR *ir, BB *preheader) {
+    unlink_ir(from, ir);
+
+    IR *jmp = preheader->last;
+    IR *prev = NULL;
+    for(IR *cur = preheader->ir; cur != jmp; cur = cur->next) {
+        prev = cur;
+    }
+    ir->next = jmp;
+    if(prev) {
+        prev->next = ir;
+    } else {
+        preheader->ir = ir;
+    }
+}
+
+// ループに入る経路がpreheaderからheaderへの辺だけか
+static bool has_single_entry(Function *func, Loop *loop) {
+    BB *buf[2];
+    BB **succ;
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        if(in_loop[bb->label]) {
+            continue;
+        }
+        int n = bb_successors(bb, buf, &succ);
+        for(int i = 0; i < n; i++) {
+            if(!in_loop[succ[i]->label]) {
+                continue;
+            }
+            if(bb != loop->preheader || succ[i] != loop->header) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 仮想レジスタregのループ内での値が変わらないか。
+// ループ内の定数の代入や、ループ内で書き換えない仮想レジスタのコピーも不変とみなす。
+static bool is_invariant(int reg) {
+    if(!reg || !def_in_loop[reg]) {
+        return true;
+    }
+    IR *def = def_ir[reg];
+    if(!def || is_var_reg[reg]) {
+        return false;
+    }
+    return def->op == IR_IMM || (def->op == IR_MOV && !def_in_loop[def->a]);
+}
+
+// 命令irのメモリの読み出しをループの外に移してよいか
+static bool can_hoist_load(IR *ir, BB *bb, Loop *loop) {
+    if(bb != loop->header && bb != loop->cond) {
+        return false;
+    }
+    for(BB *b = loop->header;; b = b->next) {
+        for(IR *i = b->ir; i; i = i->next) {
+            if(i->op == IR_CALL || i->op == IR_VA_START || i->op == IR_VEC) {
+                return false;
+            }
+            if(i->op == IR_STORE && may_alias(i->a, ir->a)) {
+                return false;
+            }
+        }
+        if(b == loop->last) {
+            break;
+        }
+    }
+    return true;
+}
+
+// 命令irをループの外に移してよいか
+static bool can_hoist(IR *ir, BB *bb, Loop *loop) {
+    if(ir->op == IR_IMM || ir->op == IR_MOV) {
+        return false;
+    }
+    if(!is_pure(ir->op) && ir->op != IR_LOAD) {
+        return false;
+    }
+    if(num_defs[ir->dst] != 1 || is_var_reg[ir->dst]) {
+        return false;
+    }
+    if(!is_invariant(ir->a) || !is_invariant(ir->b)) {
+        return false;
+    }
+    if(ir->op == IR_LOAD) {
+        return can_hoist_load(ir, bb, loop);
+    }
+    return true;
+}
+
+// 移す命令が読み出す仮想レジスタregが、ループ内の定数の代入やコピーで
+// 書き込まれる場合、その命令も移す
+static void hoist_operand(int reg, Loop *loop) {
+    if(!reg || !def_in_loop[reg]) {
+        return;
+    }
+    for(BB *bb = loop->header;; bb = bb->next) {
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            if(ir == def_ir[reg]) {
+                move_ir(bb, ir, loop->preheader);
+                def_in_loop[reg] = false;
+                return;
+            }
+        }
+        if(bb == loop->last) {
+            return;
+        }
+    }
+}
+
+static void hoist_loop(Function *func, Loop *loop) {
+    IR *jmp = loop->preheader->last;
+    if(!jmp || jmp->op != IR_JMP || jmp->then != loop->header) {
+        return;
+    }
+
+    for(int i = 0; i <= func->num_bbs; i++) {
+        in_loop[i] = false;
+    }
+    for(BB *bb = loop->header;; bb = bb->next) {
+        in_loop[bb->label] = true;
+        if(bb == loop->last) {
+            break;
+        }
+    }
+    if(!has_single_entry(func, loop)) {
+        return;
+    }
+
+    for(int r = 0; r <= func->num_regs; r++) {
+        def_in_loop[r] = false;
+    }
+    for(BB *bb = loop->header;; bb = bb->next) {
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            if(ir->dst) def_in_loop[ir->dst] = true;
+        }
+        if(bb == loop->last) {
+            break;
+        }
+    }
+
+    // 移した命令に依存する命令も移せるようになるので、変化がなくなるまで繰り返す
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(BB *bb = loop->header;; bb = bb->next) {
+            for(IR *ir = bb->ir; ir;) {
+                IR *next = ir->next;
+                if(ir->dst && can_hoist(ir, bb, loop)) {
+                    hoist_operand(ir->a, loop);
+                    hoist_operand(ir->b, loop);
+                    move_ir(bb, ir, loop->preheader);
+                    def_in_loop[ir->dst] = false;
+                    changed = true;
+                }
+                ir = next;
+            }
+            if(bb == loop->last) {
+                break;
+            }
+        }
+    }
+}
+
+// 関数funcのループ不変な命令をループの外に移す
+void licm(Function *func) {
+    if(!func->loops) {
+        return;
+    }
+
+    int nregs = func->num_regs + 1;
+    def_ir = calloc(nregs, sizeof(IR *));
+    num_defs = calloc(nregs, sizeof(int));
+    def_in_loop = calloc(nregs, sizeof(bool));
+    is_var_reg = calloc(nregs, sizeof(bool));
+    in_loop = calloc(func->num_bbs + 1, sizeof(bool));
+
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            if(ir->dst) {
+                def_ir[ir->dst] = ir;
+                num_defs[ir->dst]++;
+            }
+        }
+    }
+    for(int r = 0; r < nregs; r++) {
+        if(num_defs[r] != 1) def_ir[r] = NULL;
+    }
+    for(VarList *vl = func->locals; vl; vl = vl->next) {
+        if(vl->var->reg) is_var_reg[vl->var->reg] = true;
+    }
+
+    // 内側のループから順に処理する。内側のループから移した命令は、
+    // 外側のループでも不変ならさらに外へ移る。
+    for(Loop *loop = func->loops; loop; loop = loop->next) {
+        hoist_loop(func, loop);
+    }
+
+    free(def_ir);
+    free(num_defs);
+    free(def_in_loop);
+    free(is_var_reg);
+    free(in_loop);
+}
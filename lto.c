@@ -0,0 +1,213 @@
+#include "zxcc.h"
+
+// 全体最適化(-flto)。複数のファイルをまとめた1つのプログラムに対して、
+// ファイルをまたいだ小さな関数のインライン展開(inline.c)と、参照されない関数・
+// グローバル変数の削除を行う。
+//
+// 参照されない関数・グローバル変数の削除は、全体最適化を行わない場合も、
+// ファイル内のstaticな関数・グローバル変数を対象に行う。
+
+// 関数・グローバル変数を名前で引くための表
+typedef struct Symbol Symbol;
+struct Symbol {
+    Symbol *next;
+    char *name;
+    Function *func;
+    Var *gvar;
+    bool reachable;
+    Symbol *work_next;  // 到達可能性解析の作業リスト用
+};
+
+static Symbol *symtab[16384];
+static Symbol *worklist;
+
+static int hash_symbol(char *name) {
+    int h = 0;
+    for(char *p = name; *p; p++) {
+        h = (h * 31 + (*p & 255)) & 16383;
+    }
+    return h;
+}
+
+static Symbol *find_symbol(char *name) {
+    for(Symbol *sym = symtab[hash_symbol(name)]; sym; sym = sym->next) {
+        if(!strcmp(sym->name, name)) {
+            return sym;
+        }
+    }
+    return NULL;
+}
+
+static Symbol *add_symbol(char *name) {
+    Symbol *sym = find_symbol(name);
+    if(sym) {
+        return sym;
+    }
+
+    int h = hash_symbol(name);
+    sym = calloc(1, sizeof(Symbol));
+    sym->name = name;
+    sym->next = symtab[h];
+    symtab[h] = sym;
+    return sym;
+}
+
+//
+// 到達可能性解析
+//
+
+static void mark(char *name) {
+    Symbol *sym = find_symbol(name);
+    if(!sym || sym->reachable) {
+        return;
+    }
+    sym->reachable = true;
+    sym->work_next = worklist;
+    worklist = sym;
+}
+
+// nodeから参照されている関数・グローバル変数に印を付ける
+static void mark_node(Node *node) {
+    if(!node) {
+        return;
+    }
+
+    if(node->kind == ND_FUNCCALL) {
+        mark(node->func_name);
+    }
+    if(node->var && !node->var->is_local) {
+        mark(node->var->name);
+    }
+
+    mark_node(node->lhs);
+    mark_node(node->rhs);
+    mark_node(node->cond);
+    mark_node(node->then);
+    mark_node(node->els);
+    mark_node(node->init);
+    mark_node(node->post);
+    for(Node *n = node->block; n; n = n->next) {
+        mark_node(n);
+    }
+    for(Node *n = node->args; n; n = n->next) {
+        mark_node(n);
+    }
+}
+
+// キャッシュから読み込んだアセンブリtextに現れるシンボルに印を付ける。
+// 本体を読み飛ばした関数の参照先は、出力済みのアセンブリから求める。
+static void mark_asm(char *text, int len) {
+    int i = 0;
+    while(i < len) {
+        if(!isalpha(text[i]) && text[i] != '_' && text[i] != '.') {
+            i++;
+            continue;
+        }
+        int start = i;
+        while(i < len && (isalnum(text[i]) || text[i] == '_' ||
+                          text[i] == '.')) {
+            i++;
+        }
+        char *name = strndup(text + start, i - start);
+        mark(name);
+        free(name);
+    }
+}
+
+// 参照されない関数・グローバル変数をプログラムから取り除く。
+// closedが真の場合は、プログラムがこれで全てでありmain以外の外部シンボルが
+// 他から参照されないものとして扱い、偽の場合はstaticでないものを全て残す。
+void remove_unreachable(Program *prog, bool closed) {
+    memset(symtab, 0, sizeof(symtab));
+    worklist = NULL;
+    for(Function *func = prog->funcs; func; func = func->next) {
+        add_symbol(func->name)->func = func;
+        for(VarList *vl = func->data; vl; vl = vl->next) {
+            add_symbol(vl->var->name)->gvar = vl->var;
+        }
+    }
+    for(VarList *vl = prog->globals; vl; vl = vl->next) {
+        add_symbol(vl->var->name)->gvar = vl->var;
+    }
+
+    // 外から参照され得るシンボルを起点に、到達可能な関数・グローバル変数に印を付ける
+    if(closed) {
+        mark("main");
+    } else {
+        for(Function *func = prog->funcs; func; func = func->next) {
+            if(!func->is_static) mark(func->name);
+        }
+        for(VarList *vl = prog->globals; vl; vl = vl->next) {
+            if(!vl->var->is_static) mark(vl->var->name);
+        }
+    }
+
+    while(worklist) {
+        Symbol *sym = worklist;
+        worklist = sym->work_next;
+
+        Function *func = sym->func;
+        if(func && !func->node && func->asm_text) {
+            mark_asm(func->asm_text, func->asm_len);
+        }
+        if(func) {
+            for(Node *node = func->node; node; node = node->next) {
+                mark_node(node);
+            }
+        }
+        if(sym->gvar) {
+            for(Initializer *init = sym->gvar->initializer; init;
+                init = init->next) {
+                if(init->label) mark(init->label);
+            }
+        }
+    }
+
+    // 到達不能な関数・グローバル変数を取り除く。取り除く関数の中の文字列リテラルや
+    // staticローカル変数(関数キャッシュ有効時のfunc->data)は、インライン展開先の
+    // 関数から参照されていることがあるので、グローバル変数に移して残す。
+    Function head = {};
+    Function *cur = &head;
+    for(Function *func = prog->funcs; func; func = func->next) {
+        if(find_symbol(func->name)->reachable) {
+            cur->next = func;
+            cur = func;
+            continue;
+        }
+        for(VarList *vl = func->data; vl;) {
+            VarList *next = vl->next;
+            vl->next = prog->globals;
+            prog->globals = vl;
+            vl = next;
+        }
+        func->data = NULL;
+    }
+    cur->next = NULL;
+    prog->funcs = head.next;
+
+    VarList vhead = {};
+    VarList *vcur = &vhead;
+    for(VarList *vl = prog->globals; vl; vl = vl->next) {
+        if(find_symbol(vl->var->name)->reachable) {
+            vcur->next = vl;
+            vcur = vl;
+        }
+    }
+    vcur->next = NULL;
+    prog->globals = vhead.next;
+}
+
+// プログラムを最適化する。closedの意味はremove_unreachableと同じ。
+void lto_optimize(Program *prog, bool closed) {
+    // 小さな関数をインライン展開する。ファイルの順序によらず展開できるよう、
+    // 全ての関数を登録してから展開する。
+    inline_reset();
+    for(Function *func = prog->funcs; func; func = func->next) {
+        inline_add(func);
+    }
+    for(Function *func = prog->funcs; func; func = func->next) {
+        inline_function(func);
+    }
+
+    remove_unreachable(prog, closed);
+}
@@ -1,5 +1,78 @@
 #include "zxcc.h"
 
+// 並列に実行するコンパイルジョブの最大数
+static int num_jobs = 1;
+
+// -oで指定された出力ファイル名
+static char *output_path;
+
+// -S: アセンブリを出力してアセンブル、リンクしない
+static bool opt_S;
+// -c: オブジェクトファイルを出力してリンクしない
+static bool opt_c;
+// -static: 静的リンクする
+static bool opt_static;
+
+// リンカに渡すファイルのリスト
+static char **ld_inputs;
+static int num_ld_inputs;
+
+// 終了時に削除する一時ファイルのリスト
+static char **tmp_files;
+static int num_tmp_files;
+
+// トークナイズ、パース、コード生成をそれぞれ別スレッドで並行して実行するか
+bool opt_pipeline;
+
+// 関数ごとにパースが終わり次第アセンブリを出力し、そのASTを解放するか
+bool opt_stream;
+
+// -fcache=dir: 関数単位のコンパイル結果を保存するキャッシュディレクトリ
+char *opt_cache_dir;
+
+// -flto: 全てのCファイルを1つのプログラムとしてまとめてコンパイルし、
+// ファイルをまたいだ最適化を行う
+bool opt_lto;
+
+// 最適化レベル(-O0, -O1...)。1以上の場合は中間表現を経由してコードを生成する。
+int opt_level;
+
+// 中間表現を標準エラー出力にダンプする(-fdump-ir)
+bool opt_dump_ir;
+
+// -fregstack: -O0のコード生成で、式を作業用レジスタ上で評価する
+bool opt_regstack;
+
+// -fisel: -O0のコード生成で、即値やメモリのオペランドを取る命令を選択する
+bool opt_isel;
+
+// -fpeephole: 出力したアセンブリに覗き穴最適化を行う。-O1以上では常に有効。
+bool opt_peephole;
+
+// -fno-omit-frame-pointer: -O1以上で、フレームポインタを省略しない(プロファイラ用)
+bool opt_keep_frame_pointer;
+
+// -funroll=N: -O1以上で、単純なforループの本体をN回分並べて展開する(1以下なら
+// 回数の少ないループの完全な展開だけを行う)
+int opt_unroll = 4;
+
+// -mavx2: -O1以上のループのベクトル化で、SSE2の代わりにAVX2の命令を使う
+bool opt_avx2;
+
+// 全体最適化でまとめてコンパイルするCファイルのリスト
+static char **lto_paths;
+static int num_lto_paths;
+// 全体最適化の結果をそのまま実行ファイルにし、他のオブジェクトファイルとリンクしないか
+static bool lto_closed;
+
+// 入力ファイル1つ分のコンパイルジョブ
+typedef struct {
+    char *path;  // 入力ファイル名
+    char *out;   // 出力ファイル名
+    int pid;     // ジョブを実行している子プロセスのID
+    FILE *diag;  // 子プロセスが出力した診断メッセージの保存先
+} Job;
+
 // 指定されたファイルの内容を返す
 static char *read_file(char *path) {
     // ファイルを開く
@@ -18,32 +91,514 @@ static char *read_file(char *path) {
     return buf;
 }
 
-int main(int argc, char **argv) {
-    if(argc != 2) {
-        error("引数の個数が正しくありません");
-        return 1;
+// 文字列sがsuffixで終わっているか
+static bool ends_with(char *s, char *suffix) {
+    int len1 = strlen(s);
+    int len2 = strlen(suffix);
+    return len1 >= len2 && !strcmp(s + len1 - len2, suffix);
+}
+
+// 入力ファイル名の拡張子をextnに置き換えた出力ファイル名を返す
+// 例: foo.c → foo.s
+static char *replace_extn(char *path, char *extn) {
+    int len = strlen(path);
+    char *dot = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    if(dot && (!slash || slash < dot)) {
+        len = dot - path;
+    }
+
+    char *buf = calloc(1, len + strlen(extn) + 1);
+    memcpy(buf, path, len);
+    strcpy(buf + len, extn);
+    return buf;
+}
+
+// リンクする前の一時オブジェクトファイルを作成し、そのファイル名を返す
+static char *create_tmp_obj(void) {
+    char *path = strndup("/tmp/zxcc-XXXXXX.o", 18);
+    int fd = mkstemps(path, 2);
+    if(fd < 0) error("cannot create temporary file: %s", strerror(errno));
+    close(fd);
+
+    tmp_files[num_tmp_files++] = path;
+    return path;
+}
+
+static void remove_tmp_files(void) {
+    for(int i = 0; i < num_tmp_files; i++) {
+        unlink(tmp_files[i]);
+    }
+}
+
+// 外部コマンドargvを起動し、そのプロセスIDを返す。
+// in_fdが0以上の場合はそれをコマンドの標準入力に繋ぎ、
+// close_fdが0以上の場合はコマンド側でそれを閉じる。
+static int spawn(char **argv, int in_fd, int close_fd) {
+    out_flush();
+    fflush(stderr);
+
+    int pid = fork();
+    if(pid < 0) error("fork failed: %s", strerror(errno));
+
+    if(pid == 0) {
+        if(close_fd >= 0) {
+            close(close_fd);
+        }
+        if(in_fd >= 0) {
+            dup2(in_fd, 0);
+            close(in_fd);
+        }
+        execvp(argv[0], argv);
+        error("cannot execute %s: %s", argv[0], strerror(errno));
     }
+    return pid;
+}
+
+// プロセスpidの終了を待ち、正常終了しなかった場合はエラーにする
+static void wait_command(int pid, char *name) {
+    int status;
+    if(waitpid(pid, &status, 0) < 0) {
+        error("waitpid failed: %s", strerror(errno));
+    }
+    if(status != 0) {
+        remove_tmp_files();
+        error("%s failed", name);
+    }
+}
+
+// 出力をパイプで渡しているアセンブラのプロセスIDと、その出力先
+static int as_pid;
+static char *as_out;
 
-    // トークナイズしてパースする
-    filename = argv[1];
+// アセンブラを起動したプロセスのID。関数単位の並列化で起動したワーカーは
+// このプロセスのatexitを引き継ぐが、アセンブラには触れない。
+static int as_owner;
+
+// コンパイルエラーでexitした場合に呼ばれる。途中までのアセンブリをアセンブラに
+// 渡すとアセンブラがエラーを報告するので、出力を捨ててアセンブラを終了させ、
+// 書きかけのオブジェクトファイルを削除する。
+static void kill_assembler(void) {
+    if(!as_pid || getpid() != as_owner) return;
+
+    int pid = as_pid;
+    as_pid = 0;
+    out_discard();
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(as_out);
+}
+
+// アセンブラを起動し、アセンブリの出力先をアセンブラの標準入力に繋がるパイプに
+// 切り替える。一時ファイルを介さず、コード生成と並行してアセンブルが進む。
+static void start_assembler(char *out) {
+    int fds[2];
+    if(pipe(fds) < 0) error("pipe failed: %s", strerror(errno));
+
+    char *argv[] = {"as", "-o", out, NULL};
+    as_pid = spawn(argv, fds[0], fds[1]);
+    as_out = out;
+    as_owner = getpid();
+    close(fds[0]);
+    out_set_fd(fds[1]);
+    atexit(&kill_assembler);
+}
+
+// 全体最適化時に、lto_pathsの全てのファイルを1つのプログラムとしてコンパイルし、
+// 1つのアセンブリを出力する
+static void compile_program(void) {
+    Program *prog = calloc(1, sizeof(Program));
+    Function *last_func = NULL;
+    VarList *last_var = NULL;
+
+    for(int i = 0; i < num_lto_paths; i++) {
+        filename = lto_paths[i];
+        user_input = read_file(filename);
+        token = tokenize();
+        Program *p = program();
+
+        // 各ファイルの関数リスト、グローバル変数リストを連結する
+        for(Function *func = p->funcs; func; func = func->next) {
+            if(last_func) {
+                last_func->next = func;
+            } else {
+                prog->funcs = func;
+            }
+            last_func = func;
+        }
+        for(VarList *vl = p->globals; vl; vl = vl->next) {
+            if(last_var) {
+                last_var->next = vl;
+            } else {
+                prog->globals = vl;
+            }
+            last_var = vl;
+        }
+    }
+
+    lto_optimize(prog, lto_closed);
+    codegen(prog);
+}
+
+// 1ファイルをコンパイルし、アセンブリを出力する
+static void compile_file(char *path) {
+    if(opt_lto) {
+        compile_program();
+        return;
+    }
+
+    filename = path;
     user_input = read_file(filename);
+
+    // ストリーミング実行、パイプライン実行では、パースが終わった関数から順に出力する。
+    // パイプライン実行ではさらに、トークナイズとコード生成をそれぞれ別スレッドで行う。
+    if(opt_stream || opt_pipeline) {
+        codegen_begin();
+        token = opt_pipeline ? tokenize_pipelined() : tokenize();
+        Program *prog = program();
+        codegen_end(prog);
+        return;
+    }
+
+    // トークナイズしてパースし、参照されないstaticな関数・グローバル変数を除く
     token = tokenize();
     Program *prog = program();
+    remove_unreachable(prog, false);
+    codegen(prog);
+}
+
+// Cファイルpathをコンパイルし、-Sの場合はアセンブリを、
+// それ以外の場合はオブジェクトファイルをoutに出力する
+static void compile_to(char *path, char *out) {
+    if(opt_S) {
+        out_open(out);
+        compile_file(path);
+        out_close();
+        return;
+    }
+
+    start_assembler(out);
+    compile_file(path);
+    out_close();
+
+    int pid = as_pid;
+    as_pid = 0;
+    wait_command(pid, "as");
+}
+
+// 子プロセスを起動してjobのコンパイルを開始する。
+// パーサはグローバルな状態を持つため、1ファイルごとに別プロセスでコンパイルする。
+// 子プロセスの標準エラー出力は一時ファイルに退避し、ジョブ終了後に親プロセスが
+// まとめて出力することで、複数ジョブの診断メッセージが混ざらないようにする。
+static void start_job(Job *job) {
+    job->diag = tmpfile();
+    if(!job->diag) error("cannot create temporary file: %s", strerror(errno));
+
+    out_flush();
+    fflush(stderr);
+
+    int pid = fork();
+    if(pid < 0) error("fork failed: %s", strerror(errno));
+
+    if(pid == 0) {
+        dup2(fileno(job->diag), 2);
+        compile_to(job->path, job->out);
+        exit(0);
+    }
 
-    // ローカル変数のオフセット設定 & スタックサイズ算出
-    // localsリスト上の各ローカル変数に8byteずつ割り当てる
-    for(Function *func = prog->funcs; func; func = func->next) {
-        int offset = func->has_varargs ? 56 : 0;
-        for(VarList *vl = func->locals; vl; vl = vl->next) {
-            Var *lvar = vl->var;
-            offset = align_to(offset, lvar->type->align);
-            offset += lvar->type->size;
-            lvar->offset = offset;
+    job->pid = pid;
+}
+
+// 子プロセスが1つ終了するのを待ち、そのジョブの診断メッセージを出力する。
+// コンパイルに失敗した場合は偽を返す。
+static bool wait_job(Job *jobs, int num) {
+    int status;
+    int pid = wait(&status);
+    if(pid < 0) error("wait failed: %s", strerror(errno));
+
+    for(int i = 0; i < num; i++) {
+        Job *job = &jobs[i];
+        if(job->pid != pid) {
+            continue;
         }
-        func->stack_size = align_to(offset, 8);
+
+        char buf[4096];
+        long n;
+        rewind(job->diag);
+        while((n = fread(buf, 1, sizeof(buf), job->diag)) > 0) {
+            fwrite(buf, 1, n, stderr);
+        }
+        fflush(stderr);
+        fclose(job->diag);
+        job->pid = 0;
+
+        // 失敗したジョブの不完全な出力ファイルは残さない
+        if(status != 0 && strcmp(job->out, "-")) {
+            unlink(job->out);
+        }
+        break;
     }
+    return status == 0;
+}
 
-    codegen(prog);
+// 複数のCファイルを最大num_jobs並列でコンパイルする。
+// 各ファイルpaths[i]の出力はouts[i]に書き出される。
+static bool compile_files(char **paths, char **outs, int num) {
+    Job *jobs = calloc(num, sizeof(Job));
+    int running = 0;
+    bool ok = true;
+
+    for(int i = 0; i < num; i++) {
+        if(running == num_jobs) {
+            if(!wait_job(jobs, num)) ok = false;
+            running--;
+        }
 
+        jobs[i].path = paths[i];
+        jobs[i].out = outs[i];
+        start_job(&jobs[i]);
+        running++;
+    }
+
+    while(running > 0) {
+        if(!wait_job(jobs, num)) ok = false;
+        running--;
+    }
+
+    return ok;
+}
+
+// アセンブリファイルpathをアセンブルしてoutに出力する
+static void assemble(char *path, char *out) {
+    char *argv[] = {"as", "-o", out, path, NULL};
+    wait_command(spawn(argv, -1, -1), "as");
+}
+
+// ld_inputsのファイルをリンクして実行ファイルoutを出力する。
+// スタートアップルーチンやlibcの場所はシステムのCコンパイラに任せる。
+// 生成するコードはグローバル変数のアドレスを32ビットの絶対アドレスで扱うので、
+// 位置独立実行形式(PIE)を既定とするシステムでも-no-pieでリンクする。
+static void run_linker(char *out) {
+    char **argv = calloc(num_ld_inputs + 5, sizeof(char *));
+    int argc = 0;
+    argv[argc++] = "cc";
+    if(opt_static) {
+        argv[argc++] = "-static";
+    } else {
+        argv[argc++] = "-no-pie";
+    }
+    argv[argc++] = "-o";
+    argv[argc++] = out;
+    for(int i = 0; i < num_ld_inputs; i++) {
+        argv[argc++] = ld_inputs[i];
+    }
+    wait_command(spawn(argv, -1, -1), "cc");
+}
+
+static void usage(void) {
+    error("使い方: zxcc [-S|-c] [-o path] [-j N] [-static] [-fpipeline] [-fstream] [-fcache=dir] [-flto] [-O level] [-fdump-ir] [-fregstack] [-fisel] [-fpeephole] [-fno-omit-frame-pointer] [-funroll=N] [-mavx2] file...");
+}
+
+int main(int argc, char **argv) {
+    char **paths = calloc(argc, sizeof(char *));
+    int num_paths = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-j")) {
+            if(i + 1 == argc) usage();
+            num_jobs = strtol(argv[++i], NULL, 10);
+            if(num_jobs < 1) usage();
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-o")) {
+            if(i + 1 == argc) usage();
+            output_path = argv[++i];
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-o", 2)) {
+            output_path = argv[i] + 2;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-S")) {
+            opt_S = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-c")) {
+            opt_c = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-static")) {
+            opt_static = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fpipeline")) {
+            opt_pipeline = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fstream")) {
+            opt_stream = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-flto")) {
+            opt_lto = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fdump-ir")) {
+            opt_dump_ir = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fregstack")) {
+            opt_regstack = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fisel")) {
+            opt_isel = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fpeephole")) {
+            opt_peephole = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+            opt_keep_frame_pointer = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-O")) {
+            opt_level = 1;
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-O", 2)) {
+            opt_level = strtol(argv[i] + 2, NULL, 10);
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-mavx2")) {
+            opt_avx2 = true;
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-funroll=", 9)) {
+            opt_unroll = strtol(argv[i] + 9, NULL, 10);
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-fcache=", 8)) {
+            opt_cache_dir = argv[i] + 8;
+            continue;
+        }
+
+        if(!strncmp(argv[i], "-j", 2)) {
+            num_jobs = strtol(argv[i] + 2, NULL, 10);
+            if(num_jobs < 1) usage();
+            continue;
+        }
+
+        if(argv[i][0] == '-' && argv[i][1] != '\0') {
+            error("不明なオプションです: %s", argv[i]);
+        }
+
+        paths[num_paths++] = argv[i];
+    }
+
+    if(num_paths == 0) {
+        error("引数の個数が正しくありません");
+        return 1;
+    }
+
+    if(opt_level > 0) {
+        opt_peephole = true;
+    }
+
+    if(opt_lto && opt_cache_dir) {
+        error("-fltoと-fcacheは同時に指定できません");
+    }
+
+    if(opt_cache_dir) {
+        cache_init();
+    }
+
+    bool link = !opt_S && !opt_c;
+    if(!link && num_paths > 1 && output_path && !opt_lto) {
+        error("入力ファイルが複数ある場合は-oを指定できません");
+    }
+    if(!link && num_paths > 1 && !output_path && opt_lto) {
+        error("-fltoで入力ファイルが複数ある場合は-oを指定してください");
+    }
+
+    // Cファイルはコンパイルし、アセンブリファイルはアセンブルする。
+    // それ以外のファイルはリンク時にそのままリンカに渡す。
+    char **c_paths = calloc(num_paths, sizeof(char *));
+    char **c_outs = calloc(num_paths, sizeof(char *));
+    int num_c = 0;
+    ld_inputs = calloc(num_paths, sizeof(char *));
+    tmp_files = calloc(num_paths, sizeof(char *));
+    lto_paths = calloc(num_paths, sizeof(char *));
+
+    for(int i = 0; i < num_paths; i++) {
+        char *path = paths[i];
+        bool is_asm = ends_with(path, ".s");
+        bool is_c = !is_asm && !ends_with(path, ".o") && !ends_with(path, ".a");
+
+        // 全体最適化時は、全てのCファイルを最初のCファイルのジョブでまとめて
+        // コンパイルし、出力先も最初のCファイルのものを使う
+        if(is_c && opt_lto) {
+            lto_paths[num_lto_paths++] = path;
+            if(num_lto_paths > 1) {
+                continue;
+            }
+        }
+
+        char *out = path;
+        if(link) {
+            if(is_c || is_asm) out = create_tmp_obj();
+            ld_inputs[num_ld_inputs++] = out;
+        } else if(output_path) {
+            out = output_path;
+        } else if(is_c || is_asm) {
+            out = replace_extn(path, opt_S ? ".s" : ".o");
+        }
+
+        if(is_c) {
+            c_paths[num_c] = path;
+            c_outs[num_c] = out;
+            num_c++;
+        } else if(is_asm && !opt_S) {
+            assemble(path, out);
+        }
+    }
+
+    // リンクするのが全体最適化したオブジェクトファイルだけなら、
+    // main以外の関数・グローバル変数は外から参照されない
+    lto_closed = link && num_ld_inputs == 1;
+
+    // Cファイルが1つの場合は、ファイル単位の並列化ができないので、
+    // 関数単位でコード生成を並列化する
+    if(num_c == 1) {
+        codegen_jobs = num_jobs;
+    }
+    if(num_c > 0 && !compile_files(c_paths, c_outs, num_c)) {
+        remove_tmp_files();
+        return 1;
+    }
+
+    if(link) {
+        run_linker(output_path ? output_path : "a.out");
+        remove_tmp_files();
+    }
     return 0;
-}
\ No newline at end of file
+}
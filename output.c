@@ -0,0 +1,216 @@
+#include "zxcc.h"
+
+// アセンブリの出力先のファイルディスクリプタ
+static int out_fd = 1;
+
+// 出力バッファ。printfを1行ごとに呼ぶ代わりにここへ追記していき、
+// 一杯になったときと出力を終えるときにまとめてwriteする。
+static char out_buf[1 << 20];
+static int out_len;
+
+// 出力内容の取り込み中か。取り込み中はout_bufのcap_start以降の内容を
+// 書き出す前にcap_bufへ写しておく。
+static bool capturing;
+static int cap_start;
+static char *cap_buf;
+static int cap_len;
+static int cap_cap;
+
+// メモリへの出力中か。出力中はout_bufのmem_start以降の内容を、
+// 書き出す代わりにmem_bufへ移す。
+static bool to_mem;
+static int mem_start;
+static char *mem_buf;
+static int mem_len;
+static int mem_cap;
+
+static void mem_append(char *s, int len) {
+    if(mem_len + len > mem_cap) {
+        while(mem_len + len > mem_cap) {
+            mem_cap = mem_cap ? mem_cap * 2 : 4096;
+        }
+        mem_buf = realloc(mem_buf, mem_cap);
+    }
+    memcpy(mem_buf + mem_len, s, len);
+    mem_len += len;
+}
+
+static void capture(char *s, int len) {
+    if(cap_len + len > cap_cap) {
+        while(cap_len + len > cap_cap) {
+            cap_cap = cap_cap ? cap_cap * 2 : 4096;
+        }
+        cap_buf = realloc(cap_buf, cap_cap);
+    }
+    memcpy(cap_buf + cap_len, s, len);
+    cap_len += len;
+}
+
+// 出力先をpathのファイルに切り替える。pathが"-"の場合は標準出力に出力する。
+void out_open(char *path) {
+    out_flush();
+    if(!strcmp(path, "-")) {
+        out_fd = 1;
+        return;
+    }
+
+    out_fd = creat(path, 0644);
+    if(out_fd < 0) error("cannot open %s: %s", path, strerror(errno));
+}
+
+// 出力先をファイルディスクリプタfdに切り替える
+void out_set_fd(int fd) {
+    out_flush();
+    out_fd = fd;
+}
+
+// バッファに溜まった内容を出力先に書き出す
+void out_flush(void) {
+    if(to_mem) {
+        mem_append(out_buf + mem_start, out_len - mem_start);
+        out_len = mem_start;
+        return;
+    }
+
+    if(capturing) {
+        capture(out_buf + cap_start, out_len - cap_start);
+        cap_start = 0;
+    }
+
+    char *p = out_buf;
+    while(out_len > 0) {
+        long n = write(out_fd, p, out_len);
+        if(n < 0) error("write failed: %s", strerror(errno));
+        p += n;
+        out_len -= n;
+    }
+}
+
+// バッファの内容を書き出し、出力先のファイルを閉じる
+void out_close(void) {
+    out_flush();
+    if(out_fd > 2) {
+        close(out_fd);
+    }
+    out_fd = 1;
+}
+
+// バッファの内容を書き出さずに捨て、出力先のファイルを閉じる
+void out_discard(void) {
+    out_len = 0;
+    capturing = false;
+    to_mem = false;
+    if(out_fd > 2) {
+        close(out_fd);
+    }
+    out_fd = 1;
+}
+
+// 長さlenの文字列sを出力する
+void out_strn(char *s, int len) {
+    if(out_len + len > sizeof(out_buf)) {
+        out_flush();
+        // メモリへの出力中は書き出してもout_bufの先頭mem_start分が残るので、
+        // 書き出した後の空きと比べる
+        if(out_len + len > sizeof(out_buf)) {
+            // バッファに収まらない大きさのデータは直接書き出す
+            if(to_mem) {
+                mem_append(s, len);
+                return;
+            }
+            if(capturing) {
+                capture(s, len);
+            }
+            while(len > 0) {
+                long n = write(out_fd, s, len);
+                if(n < 0) error("write failed: %s", strerror(errno));
+                s += n;
+                len -= n;
+            }
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, s, len);
+    out_len += len;
+}
+
+// 文字列sを出力する
+void out_str(char *s) {
+    // 出力する文字列はほとんどが短い命令なので、バッファに空きがあれば直接コピーする
+    char *p = out_buf + out_len;
+    char *end = out_buf + sizeof(out_buf);
+    while(*s && p < end) {
+        *p++ = *s++;
+    }
+    out_len = p - out_buf;
+
+    if(*s) {
+        out_strn(s, strlen(s));
+    }
+}
+
+// 1文字出力する
+void out_char(char c) {
+    if(out_len == sizeof(out_buf)) {
+        out_flush();
+    }
+    out_buf[out_len++] = c;
+}
+
+// 整数valを10進数で出力する
+void out_int(long val) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    bool neg = val < 0;
+
+    // LONG_MINでも溢れないよう、負数のまま下の桁から取り出す
+    do {
+        long q = val / 10;
+        long d = val - q * 10;
+        *--p = '0' + (d < 0 ? -d : d);
+        val = q;
+    } while(val);
+
+    if(neg) {
+        *--p = '-';
+    }
+    out_strn(p, buf + sizeof(buf) - p);
+}
+
+// これ以降の出力内容の取り込みを開始する。出力自体は通常どおり行われる。
+void out_capture_begin(void) {
+    capturing = true;
+    cap_start = out_len;
+    cap_buf = NULL;
+    cap_len = 0;
+    cap_cap = 0;
+}
+
+// 取り込みを終了し、out_capture_begin()以降に出力した内容を返す
+char *out_capture_end(int *len) {
+    capture(out_buf + cap_start, out_len - cap_start);
+    capturing = false;
+    *len = cap_len;
+    return cap_buf;
+}
+
+// これ以降の出力を出力先に書き出さずにメモリに溜める
+void out_mem_begin(void) {
+    // バッファの残りが少ない場合は、溜める領域を確保するために書き出しておく
+    if(out_len > sizeof(out_buf) / 2) {
+        out_flush();
+    }
+    to_mem = true;
+    mem_start = out_len;
+    mem_buf = NULL;
+    mem_len = 0;
+    mem_cap = 0;
+}
+
+// メモリへの出力を終了し、out_mem_begin()以降に出力した内容を返す
+char *out_mem_end(int *len) {
+    out_flush();
+    to_mem = false;
+    *len = mem_len;
+    return mem_buf;
+}
@@ -32,8 +32,11 @@ static VarList *locals;
 // パース処理中に現れたグローバル変数を追加するための連結リスト
 static VarList *globals;
 
-// 変数、typedefのスコープ
+// ブロックスコープの変数、typedefのスコープ
 static VarScope *var_scope;
+// グローバルスコープの変数、typedefを名前で引くハッシュテーブル。
+// 各バケットはVarScopeのnextで繋ぎ、新しく宣言したものほど前に置く。
+static VarScope *global_scope[16384];
 // 構造体タグ、enumタグのスコープ
 static TagScope *tag_scope;
 static int scope_depth;
@@ -41,6 +44,20 @@ static int scope_depth;
 // switch文のパース中にswitchノードへのポインタを保持する変数
 static Node *current_switch;
 
+// パース中のswitch文のcaseの集合。caseの値の重複を検出するための
+// 開番地法のハッシュ表で、大きさは2の冪。
+static Node **case_set;
+static int case_set_cap;
+
+// パース中の翻訳単位の通し番号。全体最適化で複数のファイルを1つのプログラムに
+// まとめる際に、ファイルごとのstatic変数・関数の名前を区別するのに使う。
+static int unit_seq;
+
+// パース中の関数名(関数の外ではNULL)
+static char *current_func;
+// 関数内で生成したラベルの通し番号(関数ごとに0から振り直す)
+static int func_label_cnt;
+
 // ブロックスコープの開始処理
 static Scope *enter_scope(void) {
     Scope *sc = calloc(1, sizeof(Scope));
@@ -51,13 +68,33 @@ static Scope *enter_scope(void) {
 }
 
 // ブロックスコープの終了処理
+// スコープ内で追加されたVarScope、TagScopeは以降参照されないので解放する
 static void leave_scope(Scope *sc) {
-    var_scope = sc->var_scope;
-    tag_scope = sc->tag_scope;
+    while(var_scope != sc->var_scope) {
+        VarScope *next = var_scope->next;
+        free(var_scope);
+        var_scope = next;
+    }
+    while(tag_scope != sc->tag_scope) {
+        TagScope *next = tag_scope->next;
+        free(tag_scope->name);
+        free(tag_scope);
+        tag_scope = next;
+    }
     scope_depth--;
+    free(sc);
+}
+
+// 名前のハッシュ値(global_scopeのインデックス)を返す
+static int hash_name(char *name, int len) {
+    int h = 0;
+    for(int i = 0; i < len; i++) {
+        h = (h * 31 + (name[i] & 255)) & 16383;
+    }
+    return h;
 }
 
-// 変数、typedefを名前で検索する。検索対象はローカル変数リスト→グローバル変数リストの順番。
+// 変数、typedefを名前で検索する。検索対象はローカル変数リスト→グローバル変数の順番。
 // 見つからなかった場合はNULLを返す。
 static VarScope *find_var(Token *tok) {
     for(VarScope *sc = var_scope; sc; sc = sc->next) {
@@ -66,6 +103,14 @@ static VarScope *find_var(Token *tok) {
             return sc;
         }
     }
+
+    for(VarScope *sc = global_scope[hash_name(tok->str, tok->len)]; sc;
+        sc = sc->next) {
+        if(strlen(sc->name) == tok->len &&
+           !strncmp(tok->str, sc->name, tok->len)) {
+            return sc;
+        }
+    }
     return NULL;
 }
 
@@ -83,8 +128,16 @@ static TagScope *find_tag(Token *tok) {
 static VarScope *push_scope(char *name) {
     VarScope *sc = calloc(1, sizeof(VarScope));
     sc->name = name;
-    sc->next = var_scope;
     sc->depth = scope_depth;
+
+    if(scope_depth == 0) {
+        int h = hash_name(name, strlen(name));
+        sc->next = global_scope[h];
+        global_scope[h] = sc;
+        return sc;
+    }
+
+    sc->next = var_scope;
     var_scope = sc;
     return sc;
 }
@@ -128,6 +181,19 @@ static Var *new_gvar(char *name, Type *type, bool is_static, bool emit) {
     return gvar;
 }
 
+// ファイルスコープの変数・関数nameのアセンブリ上の名前を返す。
+// 全体最適化時は、他のファイルの同名のstatic変数・関数と衝突しないよう、
+// staticなものの名前に翻訳単位の番号を付ける。
+static char *symbol_name(char *name, bool is_static) {
+    if(!opt_lto || !is_static) {
+        return name;
+    }
+
+    char *buf = calloc(1, strlen(name) + 32);
+    sprintf(buf, "%s.%d", name, unit_seq);
+    return buf;
+}
+
 static Type *find_typedef(Token *tok) {
     if(tok->kind == TK_IDENT) {
         VarScope *sc = find_var(tok);
@@ -169,12 +235,22 @@ static Node *new_var_node(Var *var) {
     return node;
 }
 
-// 文字列リテラル用のラベルを生成する
+// 文字列リテラル用のラベルを生成する。
+// 関数内のラベルは関数名を含め、関数ごとに番号を振り直す。こうすることで、
+// ある関数の出力が他の関数の内容に依存せず、関数キャッシュから再利用できる。
+// 関数名はアセンブリ上の名前を使い、全体最適化時に他のファイルの同名のstatic関数の
+// ラベルと衝突しないようにする。
 static char *new_label(void) {
     static int cnt = 0;
-    char buf[20];
-    sprintf(buf, ".L.data.%d", cnt++);
-    return strndup(buf, 20);
+    if(!current_func) {
+        char buf[20];
+        sprintf(buf, ".L.data.%d", cnt++);
+        return strndup(buf, 20);
+    }
+
+    char *buf = calloc(1, strlen(current_func) + 32);
+    sprintf(buf, ".L.data.%s.%d", current_func, func_label_cnt++);
+    return buf;
 }
 
 typedef enum {
@@ -244,12 +320,56 @@ Program *program() {
     Function *cur = &head;
     globals = NULL;
 
+    // 全体最適化時は複数のファイルを続けてパースするので、
+    // 前のファイルのファイルスコープの宣言を見えなくする
+    memset(global_scope, 0, sizeof(global_scope));
+    tag_scope = NULL;
+    unit_seq++;
+    inline_reset();
+
     while(!at_eof()) {
         if(is_function()) {
+            Token *start = token;
+            VarList *data_mark = globals;
             Function *func = function();
             if(!func) {
                 continue;
             }
+            eliminate_dead_code(func);
+
+            // 関数キャッシュが有効な場合、関数内で追加されたグローバル変数
+            // (文字列リテラル、staticローカル変数)は関数と一緒に出力する
+            if(opt_cache_dir && globals != data_mark) {
+                func->data = globals;
+                VarList *vl = globals;
+                while(vl->next != data_mark) {
+                    vl = vl->next;
+                }
+                vl->next = NULL;
+                globals = data_mark;
+            }
+
+            // -O1以上では、同じファイルで先に定義された小さな関数を展開し、
+            // この関数も以降の関数で展開できるよう登録する。
+            // 全体最適化時はプログラム全体を読んでからlto_optimizeで行う。
+            if(opt_level > 0 && !opt_lto) {
+                inline_function(func);
+                inline_add(func);
+            }
+
+            // ストリーミング実行時やパイプライン実行時は、
+            // パースが終わった関数から順にコード生成に回す
+            if(opt_stream || opt_pipeline) {
+                codegen_function(func);
+            }
+
+            // ストリーミング実行時は関数の出力後にそのASTが解放されるので、
+            // 関数リストには繋がない。関数本体のトークンもここで解放する。
+            if(opt_stream) {
+                free_tokens(start, token);
+                continue;
+            }
+
             cur->next = func;
             cur = cur->next;
             continue;
@@ -324,7 +444,7 @@ static Type *basetype(StorageClass *sclass) {
             } else {
                 ty = find_typedef(token);
                 assert(ty);
-                token = token->next;
+                token = next_token(token);
             }
 
             counter |= OTHER;
@@ -662,33 +782,173 @@ static void params(Function *fn) {
     }
 }
 
+// トークンtokが記号opか
+static bool is_reserved(Token *tok, char *op) {
+    return tok->kind == TK_RESERVED && strlen(op) == tok->len &&
+           !strncmp(tok->str, op, tok->len);
+}
+
+// startから始まる関数定義の本体の終わりの"}"を返す。
+// 本体のない関数宣言の場合はNULLを返す。
+static Token *find_func_end(Token *start) {
+    int paren = 0;
+    Token *prev = NULL;
+    for(Token *tok = start; tok->kind != TK_EOF; tok = next_token(tok)) {
+        if(is_reserved(tok, "(")) paren++;
+        if(is_reserved(tok, ")")) paren--;
+        if(paren == 0 && is_reserved(tok, ";")) return NULL;
+
+        // 引数リストの")"の直後の"{"が関数本体の始まり
+        if(paren == 0 && prev && is_reserved(prev, ")") &&
+           is_reserved(tok, "{")) {
+            int depth = 0;
+            for(; tok->kind != TK_EOF; tok = next_token(tok)) {
+                if(is_reserved(tok, "{")) depth++;
+                if(is_reserved(tok, "}") && --depth == 0) return tok;
+            }
+            return NULL;
+        }
+        prev = tok;
+    }
+    return NULL;
+}
+
+// 型tyの内容をハッシュ値に加える。
+// 構造体は自分自身へのポインタを含み得るので、一度辿った型は通し番号で表す。
+static Type **hashed_types;
+static int num_hashed_types;
+
+static void hash_type(Type *ty) {
+    if(!ty) {
+        cache_hash_long(-1);
+        return;
+    }
+
+    for(int i = 0; i < num_hashed_types; i++) {
+        if(hashed_types[i] == ty) {
+            cache_hash_long(-2 - i);
+            return;
+        }
+    }
+    hashed_types = realloc(hashed_types, sizeof(Type *) * (num_hashed_types + 1));
+    hashed_types[num_hashed_types++] = ty;
+
+    cache_hash_long(ty->ty);
+    cache_hash_long(ty->size);
+    cache_hash_long(ty->align);
+    cache_hash_long(ty->is_incomplete);
+    cache_hash_long(ty->is_variadic);
+    cache_hash_long(ty->array_len);
+    hash_type(ty->ptr_to);
+    hash_type(ty->return_ty);
+    for(Member *mem = ty->members; mem; mem = mem->next) {
+        cache_hash_str(mem->name);
+        cache_hash_long(mem->offset);
+        hash_type(mem->ty);
+    }
+    cache_hash_long(-1);
+}
+
+// startからendまでの関数定義のキャッシュのキーを計算する。
+// キーには関数のトークン列に加えて、関数内の識別子が参照し得るグローバルな宣言
+// (変数・関数の型、typedef、enum定数、構造体タグ)の内容を含める。
+// 関数本体のブロックスコープで同名の宣言に隠される場合も含めるので、キーは
+// 必要以上に変わることはあっても、出力が変わるのにキーが変わらないことはない。
+static char *func_cache_key(Token *start, Token *end) {
+    cache_hash_begin();
+    cache_hash_long(opt_level);
+    cache_hash_long(opt_regstack);
+    cache_hash_long(opt_isel);
+    cache_hash_long(opt_peephole);
+    cache_hash_long(opt_keep_frame_pointer);
+    cache_hash_long(opt_unroll);
+    cache_hash_long(opt_avx2);
+    num_hashed_types = 0;
+
+    for(Token *tok = start;; tok = next_token(tok)) {
+        cache_hash_long(tok->kind);
+        cache_hash_long(tok->len);
+        cache_hash_bytes(tok->str, tok->len);
+
+        if(tok->kind == TK_IDENT) {
+            VarScope *sc = find_var(tok);
+            if(sc && sc->var) {
+                cache_hash_str(sc->var->name);
+                hash_type(sc->var->type);
+
+                // 呼び出し先の関数をインライン展開し得るので、そのキーも含める
+                if(opt_level > 0 && sc->var->type->ty == FUNC) {
+                    char *key = inline_cache_key(sc->var->name);
+                    cache_hash_str(key ? key : "");
+                }
+            } else if(sc && sc->type_def) {
+                hash_type(sc->type_def);
+            } else if(sc && sc->enum_ty) {
+                cache_hash_long(sc->enum_val);
+            } else {
+                cache_hash_long(-1);
+            }
+
+            TagScope *tag = find_tag(tok);
+            hash_type(tag ? tag->ty : NULL);
+        }
+
+        if(tok == end) {
+            break;
+        }
+    }
+    return cache_hash_end();
+}
+
 // function = basetype declarator "(" params? ")" ("{" stmt* "}" | ";")
 static Function *function() {
     locals = NULL;
 
+    // 関数キャッシュが有効な場合は、グローバルスコープにいるうちにキーを計算しておく
+    Token *end = opt_cache_dir ? find_func_end(token) : NULL;
+    char *cache_key = end ? func_cache_key(token, end) : NULL;
+
     StorageClass sclass;
     Type *ty = basetype(&sclass);
     char *name = NULL;
     ty = declarator(ty, &name);
 
     // 関数の型をスコープに追加する
-    new_gvar(name, func_type(ty), false, false);
+    Var *fn = new_gvar(name, func_type(ty), false, false);
+    fn->name = symbol_name(name, sclass == STATIC);
 
     // 関数オブジェクトを生成
     Function *func = calloc(1, sizeof(Function));
-    func->name = name;
+    func->name = fn->name;
     func->is_static = (sclass == STATIC);
+    func->cache_key = cache_key;
 
     expect("(");
 
     Scope *sc = enter_scope();
+    bool unprototyped = is_reserved(token, ")");
     params(func);
+    fn->type->is_variadic = func->has_varargs || unprototyped;
 
     if(consume(";")) {
         leave_scope(sc);
         return NULL;
     }
 
+    // キャッシュにヒットした場合は、関数本体を読み飛ばす。
+    // -O1以上では以降の関数でインライン展開できるよう、本体も読んでおく。
+    if(cache_key) {
+        func->asm_text = cache_load(cache_key, &func->asm_len);
+        if(func->asm_text && opt_level == 0) {
+            token = next_token(end);
+            leave_scope(sc);
+            return func;
+        }
+    }
+
+    current_func = fn->name;
+    func_label_cnt = 0;
+
     // 関数本体の読み取り
     Node head = {};
     Node *cur = &head;
@@ -699,12 +959,76 @@ static Function *function() {
         cur = cur->next;
     }
     leave_scope(sc);
+    current_func = NULL;
 
     func->node = head.next;
     func->locals = locals;
     return func;
 }
 
+// nodeとその子ノードを解放する。
+// ノードが参照している変数、型、構造体メンバは他の関数と共有され得るので解放しない。
+// case_next、default_caseはthen以下のノードを指しているだけなので辿らない。
+static void free_node(Node *node) {
+    if(!node) {
+        return;
+    }
+
+    free_node(node->lhs);
+    free_node(node->rhs);
+    free_node(node->cond);
+    free_node(node->then);
+    free_node(node->els);
+    free_node(node->init);
+    free_node(node->post);
+
+    for(Node *n = node->block; n;) {
+        Node *next = n->next;
+        free_node(n);
+        n = next;
+    }
+    for(Node *n = node->args; n;) {
+        Node *next = n->next;
+        free_node(n);
+        n = next;
+    }
+
+    free(node->cases);
+    free(node->func_name);
+    free(node->label_name);
+    free(node);
+}
+
+// 関数のAST、引数リスト、ローカル変数を解放する。
+// 関数名はグローバルスコープに登録されているので解放しない。
+void free_function(Function *func) {
+    for(Node *n = func->node; n;) {
+        Node *next = n->next;
+        free_node(n);
+        n = next;
+    }
+    for(VarList *vl = func->args; vl;) {
+        VarList *next = vl->next;
+        free(vl);
+        vl = next;
+    }
+    for(VarList *vl = func->locals; vl;) {
+        VarList *next = vl->next;
+        free(vl->var->name);
+        free(vl->var);
+        free(vl);
+        vl = next;
+    }
+    for(VarList *vl = func->data; vl;) {
+        VarList *next = vl->next;
+        free(vl);
+        vl = next;
+    }
+    free(func->cache_key);
+    free(func->asm_text);
+    free(func);
+}
+
 static Initializer *new_init_val(Initializer *cur, int sz, int val) {
     Initializer *init = calloc(1, sizeof(Initializer));
     init->sz = sz;
@@ -771,7 +1095,7 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
     Token *tok = token;
 
     if(ty->ty == ARRAY && ty->ptr_to->ty == CHAR && token->kind == TK_STR) {
-        token = token->next;
+        token = next_token(token);
 
         if(ty->is_incomplete) {
             ty->size = tok->cont_len;
@@ -882,6 +1206,7 @@ static void global_var() {
 
     Var *var = new_gvar(strndup(var_name, strlen(var_name)), type,
                         sclass == STATIC, sclass != EXTERN);
+    var->name = symbol_name(var->name, sclass == STATIC);
 
     if(sclass == EXTERN) {
         expect(";");
@@ -955,7 +1280,7 @@ static Node *lvar_initializer2(Node *cur, Var *var, Type *ty,
     if(ty->ty == ARRAY && ty->ptr_to->ty == CHAR && token->kind == TK_STR) {
         // char配列を文字列リテラルで初期化する
         Token *tok = token;
-        token = token->next;
+        token = next_token(token);
 
         if(ty->is_incomplete) {
             ty->size = tok->cont_len;
@@ -1108,6 +1433,65 @@ static Node *declaration() {
 
 static Node *read_expr_stmt(void) { return new_unary(ND_EXPR_STMT, expr()); }
 
+// caseの値valのハッシュ値(case_setのインデックス)を返す
+static int case_hash(long val) {
+    return (val ^ (val >> 16)) & (case_set_cap - 1);
+}
+
+// caseの集合にcaseを追加する。同じ値のcaseがあればエラーにする。
+static void add_case(Node *node, char *loc) {
+    if((current_switch->num_cases + 1) * 2 > case_set_cap) {
+        // 表を2倍に広げて入れ直す
+        Node **old = case_set;
+        int old_cap = case_set_cap;
+        case_set_cap *= 2;
+        case_set = calloc(case_set_cap, sizeof(Node *));
+        for(int i = 0; i < old_cap; i++) {
+            if(!old[i]) {
+                continue;
+            }
+            int h = case_hash(old[i]->val);
+            while(case_set[h]) {
+                h = (h + 1) & (case_set_cap - 1);
+            }
+            case_set[h] = old[i];
+        }
+        free(old);
+    }
+
+    int h = case_hash(node->val);
+    while(case_set[h]) {
+        if(case_set[h]->val == node->val) {
+            error_at(loc, "caseの値が重複しています");
+        }
+        h = (h + 1) & (case_set_cap - 1);
+    }
+    case_set[h] = node;
+    current_switch->num_cases++;
+}
+
+// cases[0]からcases[n-1]までをcaseの値の昇順に並べる(マージソート)
+static void sort_cases(Node **cases, Node **tmp, int n) {
+    if(n < 2) {
+        return;
+    }
+    int mid = n / 2;
+    sort_cases(cases, tmp, mid);
+    sort_cases(cases + mid, tmp, n - mid);
+
+    int i = 0;
+    int j = mid;
+    int k = 0;
+    while(i < mid || j < n) {
+        if(j == n || (i < mid && cases[i]->val <= cases[j]->val)) {
+            tmp[k++] = cases[i++];
+        } else {
+            tmp[k++] = cases[j++];
+        }
+    }
+    memcpy(cases, tmp, n * sizeof(Node *));
+}
+
 // 次のトークンが型の場合trueを返す
 static bool is_typename(void) {
     return match("void") || match("_Bool") || match("char") || match("short") ||
@@ -1190,9 +1574,30 @@ static Node *stmt2() {
         expect(")");
 
         Node *sw = current_switch;
+        Node **set = case_set;
+        int set_cap = case_set_cap;
         current_switch = node;
+        case_set_cap = 16;
+        case_set = calloc(case_set_cap, sizeof(Node *));
+
         node->then = stmt();
+
+        // caseを値の順に並べておく。コード生成で二分探索やジャンプテーブルに使う。
+        node->cases = calloc(node->num_cases + 1, sizeof(Node *));
+        int n = 0;
+        for(int i = 0; i < case_set_cap; i++) {
+            if(case_set[i]) {
+                node->cases[n++] = case_set[i];
+            }
+        }
+        Node **tmp = calloc(n + 1, sizeof(Node *));
+        sort_cases(node->cases, tmp, n);
+        free(tmp);
+        free(case_set);
+
         current_switch = sw;
+        case_set = set;
+        case_set_cap = set_cap;
         return node;
     }
 
@@ -1200,11 +1605,15 @@ static Node *stmt2() {
         if(!current_switch) {
             error("不正なcase句です");
         }
+        char *loc = token->str;
         int val = const_expr();
         expect(":");
 
-        Node *node = new_unary(ND_CASE, stmt());
+        // caseに続く文より先に登録し、ソース上の順に重複を検出する
+        Node *node = alloc_node(ND_CASE);
         node->val = val;
+        add_case(node, loc);
+        node->lhs = stmt();
         node->case_next = current_switch->case_next;
         current_switch->case_next = node;
         return node;
@@ -1214,10 +1623,14 @@ static Node *stmt2() {
         if(!current_switch) {
             error("不正なdefault句です");
         }
+        if(current_switch->default_case) {
+            error_at(token->str, "defaultが重複しています");
+        }
         expect(":");
 
-        Node *node = new_unary(ND_CASE, stmt());
+        Node *node = alloc_node(ND_CASE);
         current_switch->default_case = node;
+        node->lhs = stmt();
         return node;
     }
 
@@ -1825,7 +2238,7 @@ static Node *primary() {
                 expect(")");
                 return new_node_num(ty->size);
             }
-            token = tok->next;
+            token = next_token(tok);
         }
 
         // 演算対象となる子ノードの型サイズを出力
@@ -1862,11 +2275,15 @@ static Node *primary() {
                     error("関数ではありません");
                 }
                 node->type = sc->var->type->return_ty;
+                node->is_variadic_call = sc->var->type->is_variadic;
+                free(node->func_name);
+                node->func_name = strndup(sc->var->name, strlen(sc->var->name));
             } else if(!strcmp(node->func_name, "__builtin_va_start")) {
                 node->type = void_type;
             } else {
                 warn(tok, "暗黙的な関数宣言です");
                 node->type = int_type;
+                node->is_variadic_call = true;
             }
             return node;
         }
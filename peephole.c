@@ -0,0 +1,350 @@
+#include "zxcc.h"
+
+// 出力したアセンブリに対する覗き穴最適化(-fpeephole)。
+//
+// 関数1つ分の出力を1行1命令のリストに変換し、連続する数行の窓をパターンの表と
+// 照合して、より短い命令列に置き換える。置き換えた後は少し手前から照合し直すので、
+// 置き換えの結果新たに現れたパターンも最適化される。
+
+typedef struct Insn Insn;
+struct Insn {
+    Insn *next;
+    Insn *prev;
+    char *text;  // 行の内容(改行を含まない)
+};
+
+// パターンの表。各パターンは以下を順に並べ、""で終える。
+//
+// - 照合する行の並び。"$x"は任意の文字列、"%x"は64ビットの汎用レジスタに
+//   一致し、同じ名前の変数は同じ文字列に一致する。"$x"だけの行は任意の行に一致する。
+// - 条件("if $x simple": $xがスタックや分岐に関わらない単純な命令である、
+//   "if $x !~ %y": $xがレジスタ%y(またはその一部)を参照しない)
+// - "->"
+// - 置き換え後の行の並び
+static char *rules[] = {
+    // push直後のpopはレジスタ間の転送にする
+    "  push $a", "  pop %b", "->", "  mov %b, $a", "",
+
+    // 値を捨てるだけのpush
+    "  push $a", "  add rsp, 8", "->", "",
+
+    // 間の命令がそのレジスタとスタックを使わなければ、退避と復元は不要
+    "  push %a", "$i", "  pop %a", "if $i simple", "if $i !~ %a",
+    "if $i !~ rsp", "->", "$i", "",
+
+    // 自分自身への転送
+    "  mov %a, %a", "->", "",
+
+    // 直後に上書きされる転送
+    "  mov %a, $x", "  mov %a, $y", "if $y !~ %a", "->", "  mov %a, $y", "",
+
+    // 転送した値を書き戻す転送
+    "  mov %a, %b", "  mov %b, %a", "->", "  mov %a, %b", "",
+
+    // ローカル変数のアドレス計算
+    "  mov %a, rbp", "  sub %a, $n", "->", "  lea %a, [rbp-$n]", "",
+
+    // アドレスを計算してすぐ読み出す場合はメモリオペランドにまとめる。
+    // addなど%aの元の値も読む命令では、leaを消すと結果が変わるので読み出しに限る。
+    "  lea %a, [$m]", "  mov %a, [%a]", "->", "  mov %a, [$m]", "",
+    "  lea %a, [$m]", "  mov %a, $s ptr [%a]", "->", "  mov %a, $s ptr [$m]", "",
+    "  lea %a, [$m]", "  movsx %a, $s ptr [%a]", "->",
+    "  movsx %a, $s ptr [$m]", "",
+    "  lea %a, [$m]", "  movsxd %a, $s ptr [%a]", "->",
+    "  movsxd %a, $s ptr [$m]", "",
+    "  lea %a, [$m]", "  movzx %a, $s ptr [%a]", "->",
+    "  movzx %a, $s ptr [$m]", "",
+
+    // 直後のラベルへのジャンプ
+    "  jmp $l", "$l:", "->", "$l:", "",
+
+    // 何もしないスタック操作
+    "  sub rsp, 0", "->", "",
+    "  add rsp, 0", "->", "",
+
+    NULL,
+};
+
+// 64ビットの汎用レジスタと、その下位の部分レジスタの名前
+static char *regs64[] = {"rax", "rbx", "rcx", "rdx", "rsi", "rdi",
+                         "rbp", "rsp", "r8",  "r9",  "r10", "r11",
+                         "r12", "r13", "r14", "r15"};
+static char *regs32[] = {"eax", "ebx", "ecx",  "edx",  "esi",  "edi",
+                         "ebp", "esp", "r8d",  "r9d",  "r10d", "r11d",
+                         "r12d", "r13d", "r14d", "r15d"};
+static char *regs16[] = {"ax",  "bx",  "cx",   "dx",   "si",   "di",
+                         "bp",  "sp",  "r8w",  "r9w",  "r10w", "r11w",
+                         "r12w", "r13w", "r14w", "r15w"};
+static char *regs8[] = {"al",  "bl",  "cl",   "dl",   "sil",  "dil",
+                        "bpl", "spl", "r8b",  "r9b",  "r10b", "r11b",
+                        "r12b", "r13b", "r14b", "r15b"};
+
+// パターンの変数に一致した文字列
+static char *vars[128];
+
+static bool is_word_char(char c) {
+    return isalnum(c) || c == '_' || c == '.';
+}
+
+// sの先頭がレジスタ名で始まっていれば、その64ビットレジスタの番号を返す
+static int reg_at(char *s) {
+    for(int i = 0; i < 16; i++) {
+        int len = strlen(regs64[i]);
+        if(!strncmp(s, regs64[i], len) && !is_word_char(s[len])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 命令textがレジスタregs64[reg]またはその一部を参照しているか
+static bool mentions(char *text, int reg) {
+    char *names[4] = {regs64[reg], regs32[reg], regs16[reg], regs8[reg]};
+    for(int i = 0; i < 4; i++) {
+        int len = strlen(names[i]);
+        for(char *p = strstr(text, names[i]); p; p = strstr(p + 1, names[i])) {
+            if((p == text || !is_word_char(p[-1])) && !is_word_char(p[len])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// 命令textが、スタックや分岐、暗黙のレジスタを使わない単純な命令か
+static bool is_simple(char *text) {
+    if(strncmp(text, "  ", 2)) {
+        return false;  // ラベルやアセンブラ指令
+    }
+
+    char *op = text + 2;
+    if(op[0] == 'j' || op[0] == '.') {
+        return false;
+    }
+
+    char *ops[] = {"call", "cqo", "idiv", "div", "push", "pop", "ret", "leave"};
+    for(int i = 0; i < 8; i++) {
+        int len = strlen(ops[i]);
+        if(!strncmp(op, ops[i], len) && !is_word_char(op[len])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 行textをパターンpatと照合し、一致すれば変数に一致した文字列を設定する
+static bool match_line(char *pat, char *text) {
+    while(*pat) {
+        if((*pat == '$' || *pat == '%') && isalpha(pat[1])) {
+            char name = pat[1];
+            bool is_reg = *pat == '%';
+            pat += 2;
+
+            // 既に値が決まっている変数はその文字列と比較する
+            if(vars[name]) {
+                int len = strlen(vars[name]);
+                if(strncmp(text, vars[name], len)) {
+                    return false;
+                }
+                text += len;
+                continue;
+            }
+
+            int len;
+            if(is_reg) {
+                int reg = reg_at(text);
+                if(reg < 0) {
+                    return false;
+                }
+                len = strlen(regs64[reg]);
+            } else if(*pat) {
+                // 次の文字が現れるところまでを変数に一致させる
+                char *end = strchr(text, *pat);
+                if(!end) {
+                    return false;
+                }
+                len = end - text;
+            } else {
+                len = strlen(text);
+            }
+
+            if(len == 0) {
+                return false;
+            }
+            vars[name] = strndup(text, len);
+            text += len;
+            continue;
+        }
+
+        if(*pat != *text) {
+            return false;
+        }
+        pat++;
+        text++;
+    }
+    return *text == '\0';
+}
+
+// 条件condを満たすか
+static bool check_cond(char *cond) {
+    // "if $x simple"
+    char *x = vars[cond[4]];
+    if(!strcmp(cond + 5, " simple")) {
+        return is_simple(x);
+    }
+
+    // "if $x !~ %y" または "if $x !~ レジスタ名"
+    char *y = cond + 9;
+    int reg = *y == '%' ? reg_at(vars[y[1]]) : reg_at(y);
+    return !mentions(x, reg);
+}
+
+// パターンの行patの変数を置き換えた文字列を返す
+static char *expand(char *pat) {
+    int len = 0;
+    for(char *p = pat; *p; p++) {
+        if((*p == '$' || *p == '%') && isalpha(p[1])) {
+            len += strlen(vars[p[1]]);
+            p++;
+        } else {
+            len++;
+        }
+    }
+
+    char *buf = calloc(1, len + 1);
+    char *q = buf;
+    for(char *p = pat; *p; p++) {
+        if((*p == '$' || *p == '%') && isalpha(p[1])) {
+            strcpy(q, vars[p[1]]);
+            q += strlen(vars[p[1]]);
+            p++;
+        } else {
+            *q++ = *p;
+        }
+    }
+    return buf;
+}
+
+static void clear_vars(void) {
+    for(int i = 0; i < 128; i++) {
+        free(vars[i]);
+        vars[i] = NULL;
+    }
+}
+
+// insnから始まる窓をrules[idx]から始まるパターンと照合する。
+// 一致した場合は置き換えて置き換え後の最初の行(なければ直前の行)を返し、
+// 一致しなかった場合はNULLを返す。
+static Insn *apply_rule(Insn **head, Insn *insn, int idx) {
+    clear_vars();
+
+    // 照合
+    Insn *cur = insn;
+    int i = idx;
+    for(; rules[i][0] && strncmp(rules[i], "if ", 3) && strcmp(rules[i], "->");
+        i++) {
+        if(!cur || !match_line(rules[i], cur->text)) {
+            return NULL;
+        }
+        cur = cur->next;
+    }
+    for(; !strncmp(rules[i], "if ", 3); i++) {
+        if(!check_cond(rules[i])) {
+            return NULL;
+        }
+    }
+    i++;  // "->"
+
+    // 一致した行を取り除き、置き換え後の行を挿入する
+    Insn *prev = insn->prev;
+    Insn *next = cur;
+    for(Insn *p = insn; p != next;) {
+        Insn *n = p->next;
+        free(p);
+        p = n;
+    }
+
+    Insn *last = prev;
+    for(; rules[i][0]; i++) {
+        Insn *n = calloc(1, sizeof(Insn));
+        n->text = expand(rules[i]);
+        n->prev = last;
+        if(last) {
+            last->next = n;
+        } else {
+            *head = n;
+        }
+        last = n;
+    }
+    if(last) {
+        last->next = next;
+    } else {
+        *head = next;
+    }
+    if(next) {
+        next->prev = last;
+    }
+
+    if(prev) {
+        return prev;
+    }
+    return *head;
+}
+
+// 次のパターンの先頭の添字を返す
+static int next_rule(int idx) {
+    while(rules[idx][0]) {
+        idx++;
+    }
+    return idx + 1;
+}
+
+// 長さlenのアセンブリbufを最適化して出力する。bufは書き換える。
+void peephole(char *buf, int len) {
+    // 行ごとに分割して命令リストを作る
+    Insn head = {};
+    Insn *tail = &head;
+    char *p = buf;
+    char *end = buf + len;
+    while(p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        if(!eol) {
+            eol = end;
+        }
+        Insn *insn = calloc(1, sizeof(Insn));
+        insn->text = strndup(p, eol - p);
+        insn->prev = tail == &head ? NULL : tail;
+        tail->next = insn;
+        tail = insn;
+        p = eol + 1;
+    }
+
+    Insn *first = head.next;
+    Insn *insn = first;
+    while(insn) {
+        Insn *next = NULL;
+        for(int i = 0; rules[i]; i = next_rule(i)) {
+            next = apply_rule(&first, insn, i);
+            if(next) {
+                break;
+            }
+        }
+
+        if(next) {
+            // 置き換えで前の行と新たなパターンを作り得るので、1行戻って照合し直す
+            insn = next->prev ? next->prev : next;
+            continue;
+        }
+        insn = insn->next;
+    }
+
+    for(Insn *i = first; i;) {
+        Insn *n = i->next;
+        out_str(i->text);
+        out_char('\n');
+        free(i->text);
+        free(i);
+        i = n;
+    }
+    clear_vars();
+}
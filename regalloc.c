@@ -0,0 +1,305 @@
+#include "zxcc.h"
+
+// 線形スキャンによるレジスタ割り当て。
+//
+// 中間表現の各仮想レジスタの生存区間を、命令の通し番号上の1つの区間[start, end]で
+// 近似する。区間を開始位置の順に走査し、空いている物理レジスタを割り当てていく。
+// 空きがない場合は、生存区間の終わりが最も遠いものをスタックに追い出す(spill)。
+//
+// 物理レジスタは番号で表す。0からnum_caller_saved_regs-1までは関数呼び出しで
+// 破壊されるレジスタで、関数呼び出しをまたいで生存する仮想レジスタには割り当てない。
+// それ以降は呼び出し先で保存するレジスタで、使った場合はプロローグで退避する。
+// 番号に対応する実際のレジスタはcodegen.cで決める。
+
+int num_alloc_regs = 7;
+int num_caller_saved_regs = 2;
+
+// ビット集合1つ分のlongの数。
+// 符号ビットへのシフトを避けるため、longごとに下位32ビットだけを使う。
+static int num_words;
+
+static long *new_set(void) { return calloc(num_words, sizeof(long)); }
+
+static bool set_has(long *set, int i) { return (set[i >> 5] >> (i & 31)) & 1; }
+
+static void set_add(long *set, int i) { set[i >> 5] |= (long)1 << (i & 31); }
+
+// 命令irが読み出す仮想レジスタをuses[]に格納し、その数を返す
+static int ir_uses(IR *ir, int *uses) {
+    if(ir->op == IR_CALL || ir->op == IR_VEC) {
+        for(int i = 0; i < ir->nargs; i++) {
+            uses[i] = ir->args[i];
+        }
+        return ir->nargs;
+    }
+
+    int n = 0;
+    if(ir->a) uses[n++] = ir->a;
+    if(ir->b) uses[n++] = ir->b;
+    return n;
+}
+
+// 基本ブロックbbの後続ブロックの配列を*outに設定し、その数を返す。
+// bufは配列を格納する2要素の作業領域。
+// 分岐命令で終わらないブロックは配置順で次のブロックに進む。
+int bb_successors(BB *bb, BB **buf, BB ***out) {
+    IR *last = bb->last;
+    BB **succ = buf;
+    *out = buf;
+    if(last && last->op == IR_JTAB) {
+        *out = last->targets;
+        return last->num_targets + 1;
+    }
+    if(last && last->op == IR_JMP) {
+        succ[0] = last->then;
+        return 1;
+    }
+    if(last && last->op == IR_BR) {
+        succ[0] = last->then;
+        succ[1] = last->els;
+        return 2;
+    }
+    if(last && last->op == IR_RET) {
+        return 0;
+    }
+    if(bb->next) {
+        succ[0] = bb->next;
+        return 1;
+    }
+    return 0;
+}
+
+// 基本ブロック単位の生存解析を行い、各ブロックの入口で生存している
+// 仮想レジスタの集合をlive_in[]、出口で生存している集合をlive_out[]に求める。
+// 配列は基本ブロックの番号で引く。
+static void compute_liveness(Function *func, BB **bbs, int nbbs, long **live_in,
+                             long **live_out) {
+    long **use = calloc(func->num_bbs + 1, sizeof(long *));
+    long **def = calloc(func->num_bbs + 1, sizeof(long *));
+    int *uses = calloc(8, sizeof(int));
+
+    for(int i = 0; i < nbbs; i++) {
+        BB *bb = bbs[i];
+        use[bb->label] = new_set();
+        def[bb->label] = new_set();
+        live_in[bb->label] = new_set();
+        live_out[bb->label] = new_set();
+
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            int n = ir_uses(ir, uses);
+            for(int j = 0; j < n; j++) {
+                if(!set_has(def[bb->label], uses[j])) {
+                    set_add(use[bb->label], uses[j]);
+                }
+            }
+            if(ir->dst) {
+                set_add(def[bb->label], ir->dst);
+            }
+        }
+    }
+
+    // 不動点に達するまで後ろのブロックから順に更新する
+    BB *buf[2];
+    BB **succ;
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int i = nbbs - 1; i >= 0; i--) {
+            BB *bb = bbs[i];
+            long *in = live_in[bb->label];
+            long *out = live_out[bb->label];
+
+            int n = bb_successors(bb, buf, &succ);
+            for(int j = 0; j < n; j++) {
+                long *succ_in = live_in[succ[j]->label];
+                for(int k = 0; k < num_words; k++) {
+                    out[k] |= succ_in[k];
+                }
+            }
+
+            long *u = use[bb->label];
+            long *d = def[bb->label];
+            for(int k = 0; k < num_words; k++) {
+                long w = u[k] | (out[k] & ~d[k]);
+                if(w != in[k]) {
+                    in[k] = w;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for(int i = 0; i < nbbs; i++) {
+        free(use[bbs[i]->label]);
+        free(def[bbs[i]->label]);
+    }
+    free(use);
+    free(def);
+    free(uses);
+}
+
+// 生存区間
+static int *start;
+static int *end;
+
+static void extend(int reg, int pos) {
+    if(start[reg] < 0 || pos < start[reg]) start[reg] = pos;
+    if(end[reg] < pos) end[reg] = pos;
+}
+
+// 仮想レジスタregを新しいスタック領域に追い出す
+static void spill(Function *func, int reg) {
+    func->reg_map[reg] = -1;
+    func->spill_slot[reg] = func->num_spills++;
+}
+
+// 関数funcの仮想レジスタに物理レジスタを割り当てる。
+// 結果はfunc->reg_map、func->spill_slotに格納する。
+void alloc_regs(Function *func) {
+    int nregs = func->num_regs + 1;
+    num_words = (nregs + 31) >> 5;
+
+    int nbbs = 0;
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        nbbs++;
+    }
+    BB **bbs = calloc(nbbs + 1, sizeof(BB *));
+    int i = 0;
+    for(BB *bb = func->bbs; bb; bb = bb->next) {
+        bbs[i++] = bb;
+    }
+
+    long **live_in = calloc(func->num_bbs + 1, sizeof(long *));
+    long **live_out = calloc(func->num_bbs + 1, sizeof(long *));
+    compute_liveness(func, bbs, nbbs, live_in, live_out);
+
+    // 命令に通し番号を振り、生存区間を求める。
+    // ブロックの先頭にも番号を振り、入口で生存している仮想レジスタの区間に含める。
+    int npos = nbbs;
+    for(i = 0; i < nbbs; i++) {
+        for(IR *ir = bbs[i]->ir; ir; ir = ir->next) {
+            npos++;
+        }
+    }
+
+    start = calloc(nregs, sizeof(int));
+    end = calloc(nregs, sizeof(int));
+    for(int r = 0; r < nregs; r++) {
+        start[r] = -1;
+        end[r] = -1;
+    }
+
+    // calls[p]: 位置p以前にある関数呼び出しの数
+    int *calls = calloc(npos + 1, sizeof(int));
+    int *uses = calloc(8, sizeof(int));
+    int pos = 0;
+    for(i = 0; i < nbbs; i++) {
+        BB *bb = bbs[i];
+        int from = pos;
+        calls[pos] = pos > 0 ? calls[pos - 1] : 0;
+        pos++;
+
+        for(IR *ir = bb->ir; ir; ir = ir->next) {
+            calls[pos] = calls[pos - 1] + (ir->op == IR_CALL);
+            int n = ir_uses(ir, uses);
+            for(int j = 0; j < n; j++) {
+                extend(uses[j], pos);
+            }
+            if(ir->dst) {
+                extend(ir->dst, pos);
+            }
+            pos++;
+        }
+
+        int to = pos - 1;
+        for(int r = 1; r < nregs; r++) {
+            if(set_has(live_in[bb->label], r)) extend(r, from);
+            if(set_has(live_out[bb->label], r)) extend(r, to);
+        }
+        free(live_in[bb->label]);
+        free(live_out[bb->label]);
+    }
+
+    // 仮想レジスタを生存区間の開始位置の順に並べる(計数ソート)
+    int *count = calloc(npos + 1, sizeof(int));
+    for(int r = 1; r < nregs; r++) {
+        if(start[r] >= 0) count[start[r] + 1]++;
+    }
+    for(int p = 0; p < npos; p++) {
+        count[p + 1] += count[p];
+    }
+    int *order = calloc(nregs, sizeof(int));
+    int norder = 0;
+    for(int r = 1; r < nregs; r++) {
+        if(start[r] >= 0) {
+            order[count[start[r]]++] = r;
+            norder++;
+        }
+    }
+
+    func->reg_map = calloc(nregs, sizeof(int));
+    func->spill_slot = calloc(nregs, sizeof(int));
+    func->num_spills = 0;
+    func->used_regs = 0;
+    for(int r = 0; r < nregs; r++) {
+        func->reg_map[r] = -1;
+    }
+
+    // active[i]: 物理レジスタiを使用中の仮想レジスタ(0なら空き)
+    int *active = calloc(num_alloc_regs, sizeof(int));
+
+    for(i = 0; i < norder; i++) {
+        int r = order[i];
+
+        // 生存区間が終わった仮想レジスタの物理レジスタを解放する
+        for(int k = 0; k < num_alloc_regs; k++) {
+            if(active[k] && end[active[k]] <= start[r]) {
+                active[k] = 0;
+            }
+        }
+
+        // 関数呼び出しをまたぐ場合は、呼び出し先保存のレジスタしか使えない
+        bool crosses_call =
+            end[r] > start[r] && calls[end[r] - 1] > calls[start[r]];
+        int lo = crosses_call ? num_caller_saved_regs : 0;
+
+        int phys = -1;
+        for(int k = lo; k < num_alloc_regs; k++) {
+            if(!active[k]) {
+                phys = k;
+                break;
+            }
+        }
+
+        if(phys < 0) {
+            // 空きがなければ、生存区間の終わりが最も遠いものを追い出す
+            int victim = lo;
+            for(int k = lo; k < num_alloc_regs; k++) {
+                if(end[active[k]] > end[active[victim]]) {
+                    victim = k;
+                }
+            }
+            if(end[active[victim]] <= end[r]) {
+                spill(func, r);
+                continue;
+            }
+            spill(func, active[victim]);
+            phys = victim;
+        }
+
+        active[phys] = r;
+        func->reg_map[r] = phys;
+        func->used_regs |= 1 << phys;
+    }
+
+    free(bbs);
+    free(live_in);
+    free(live_out);
+    free(start);
+    free(end);
+    free(calls);
+    free(uses);
+    free(count);
+    free(order);
+    free(active);
+}
@@ -28,6 +28,53 @@ char *strndup(char *p, long n);
 int isspace(int c);
 char *strstr(char *haystack, char *needle);
 long strtol(char *nptr, char **endptr, int base);
+char *strrchr(char *s, int c);
+char *strcpy(char *dst, char *src);
+FILE *tmpfile();
+int fileno(FILE *stream);
+void rewind(FILE *stream);
+long fwrite(void *ptr, long size, long nmemb, FILE *stream);
+int fflush(FILE *stream);
+int fclose(FILE *stream);
+int fork();
+int wait(int *wstatus);
+int dup2(int oldfd, int newfd);
+int unlink(char *pathname);
+int pipe(int *pipefd);
+int close(int fd);
+long read(int fd, void *buf, long count);
+long write(int fd, void *buf, long count);
+int creat(char *pathname, int mode);
+int execvp(char *file, char **argv);
+int waitpid(int pid, int *wstatus, int options);
+int kill(int pid, int sig);
+int mkstemps(char *template, int suffixlen);
+int atexit(void *function);
+void *realloc(void *ptr, long size);
+char *strcat(char *dst, char *src);
+int mkdir(char *pathname, int mode);
+int rename(char *oldpath, char *newpath);
+int getpid();
+void *memset(void *s, int c, long n);
+
+typedef long pthread_t;
+typedef struct { long __data[5]; } pthread_mutex_t;
+typedef struct { long __data[6]; } pthread_cond_t;
+int pthread_create(pthread_t *thread, void *attr, void *start_routine, void *arg);
+int pthread_join(pthread_t thread, void **retval);
+int pthread_detach(pthread_t thread);
+int pthread_mutex_init(pthread_mutex_t *mutex, void *attr);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+int pthread_cond_init(pthread_cond_t *cond, void *attr);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal(pthread_cond_t *cond);
+void exit(int status);
+void free(void *ptr);
+int isalnum(int c);
+int isalpha(int c);
+char *strchr(char *s, int c);
+void *memchr(void *s, int c, long n);
 
 typedef struct {
   int gp_offset;
@@ -52,9 +99,8 @@ EOF
     sed -i 's/\btrue\b/1/g; s/\bfalse\b/0/g;' $TMP/$1
     sed -i 's/\bNULL\b/0/g' $TMP/$1
     sed -i 's/INT_MAX/2147483647/g' $TMP/$1
+    sed -i 's/\bSIGKILL\b/9/g' $TMP/$1
 
-    ./zxcc $TMP/$1 > $TMP/${1%.c}.s
-    gcc -c -o $TMP/${1%.c}.o $TMP/${1%.c}.s
 }
 
 cp *.c $TMP
@@ -67,5 +113,21 @@ expand type.c
 expand parse.c
 expand codegen.c
 expand tokenize.c
+expand output.c
+expand cache.c
+expand inline.c
+expand lto.c
+expand dce.c
+expand ir.c
+expand unroll.c
+expand vectorize.c
+expand licm.c
+expand regalloc.c
+expand peephole.c
+
+./zxcc -c -j $(nproc) $TMP/main.c $TMP/type.c $TMP/parse.c $TMP/codegen.c \
+  $TMP/tokenize.c $TMP/output.c $TMP/cache.c \
+  $TMP/inline.c $TMP/lto.c $TMP/dce.c $TMP/ir.c $TMP/unroll.c \
+  $TMP/vectorize.c $TMP/licm.c $TMP/regalloc.c $TMP/peephole.c
 
-gcc -static -o zxcc-gen2 $TMP/*.o
+gcc -static -pthread -o zxcc-gen2 $TMP/*.o
@@ -7,6 +7,25 @@ char *user_input;
 // 入力ファイル名
 char *filename;
 
+// パイプライン実行時にトークナイザスレッドとパーサスレッドで共有する状態。
+// トークナイザは一定個数のトークンを生成するごとに、生成済みトークン列の末尾を
+// token_publishedとして公開する。公開済みの末尾トークン自身は参照してよいが、
+// そのnextはまだ書き込み途中の可能性があるので、続きが公開されるまで待つ。
+static pthread_mutex_t token_mutex;
+static pthread_cond_t token_cond;
+static bool token_pipelined;    // トークナイザを別スレッドで実行しているか
+static Token *token_first;      // 先頭のトークン
+static Token *token_published;  // 公開済みトークン列の末尾
+static bool token_done;         // トークナイズが完了したか
+static int num_tokens;          // 生成したトークンの数
+
+// パーサ側でキャッシュしている公開済みトークン列の末尾。
+// パイプライン実行時以外はNULLのままなので、next_token()は常にnextを返す。
+static Token *token_avail;
+
+// この数のトークンを生成するごとにパーサへ公開する
+static int token_batch_size = 256;
+
 // エラーを報告するための関数
 // printfと同じ引数を取る
 void error(char *fmt, ...) {
@@ -69,7 +88,7 @@ Token *consume(char *op) {
        memcmp(token->str, op, token->len))
         return NULL;
     Token *tok = token;
-    token = token->next;
+    token = next_token(token);
     return tok;
 }
 
@@ -87,7 +106,7 @@ bool match(char *op) {
 Token *consume_ident() {
     if(token->kind == TK_IDENT) {
         Token *retval = token;
-        token = token->next;
+        token = next_token(token);
         return retval;
     }
     return NULL;
@@ -98,7 +117,7 @@ Token *consume_ident() {
 Token *consume_str() {
     if(token->kind == TK_STR) {
         Token *retval = token;
-        token = token->next;
+        token = next_token(token);
         return retval;
     }
     return NULL;
@@ -109,7 +128,7 @@ Token *consume_str() {
 Token *consume_return() {
     if(token->kind == TK_RETURN) {
         Token *retval = token;
-        token = token->next;
+        token = next_token(token);
         return retval;
     }
     return NULL;
@@ -121,7 +140,7 @@ void expect(char *op) {
     if(token->kind != TK_RESERVED || strlen(op) != token->len ||
        memcmp(token->str, op, token->len))
         error_at(token->str, "'%s'ではありません", op);
-    token = token->next;
+    token = next_token(token);
 }
 
 // 次のトークンが数値の場合、トークンを1つ読み進めてその数値を返す。
@@ -129,7 +148,7 @@ void expect(char *op) {
 int expect_number() {
     if(token->kind != TK_NUM) error_at(token->str, "数ではありません");
     int val = token->val;
-    token = token->next;
+    token = next_token(token);
     return val;
 }
 // 次のトークンが識別子(TK_IDENT)の場合、トークンを1つ読み進めてその文字列を返す。
@@ -138,12 +157,48 @@ char *expect_ident() {
     if(token->kind != TK_IDENT) error_at(token->str, "識別子ではありません");
 
     char *c = strndup(token->str, token->len);
-    token = token->next;
+    token = next_token(token);
     return c;
 }
 
 bool at_eof() { return token->kind == TK_EOF; }
 
+// tokの次のトークンを返す。
+// パイプライン実行時、tokが公開済みトークン列の末尾だった場合は続きが公開されるまで待つ。
+Token *next_token(Token *tok) {
+    if(tok != token_avail) {
+        return tok->next;
+    }
+
+    pthread_mutex_lock(&token_mutex);
+    while(token_published == tok && !token_done) {
+        pthread_cond_wait(&token_cond, &token_mutex);
+    }
+    token_avail = token_published;
+    pthread_mutex_unlock(&token_mutex);
+    return tok->next;
+}
+
+// tokからendの直前までのトークンを解放する
+void free_tokens(Token *tok, Token *end) {
+    while(tok != end) {
+        Token *next = tok->next;
+        free(tok->contents);
+        free(tok);
+        tok = next;
+    }
+}
+
+// tailまでのトークンをパーサスレッドに公開する
+static void publish_tokens(Token *first, Token *tail, bool done) {
+    pthread_mutex_lock(&token_mutex);
+    token_first = first;
+    token_published = tail;
+    token_done = done;
+    pthread_cond_signal(&token_cond);
+    pthread_mutex_unlock(&token_mutex);
+}
+
 // 新しいトークンを作成してcurに繋げる
 static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
     Token *tok = calloc(1, sizeof(Token));
@@ -151,6 +206,7 @@ static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
     tok->str = str;
     tok->len = len;
     cur->next = tok;
+    num_tokens++;
     return tok;
 }
 
@@ -290,8 +346,17 @@ Token *tokenize() {
     Token head;
     head.next = NULL;
     Token *cur = &head;
+    int num_published = 0;
 
     while(*p) {
+        // パイプライン実行時は生成済みのトークンを一定個数ごとに公開する。
+        // curは次のトークンの生成時にnextが書き換わるので、その1つ前までが確定している。
+        if(token_pipelined &&
+           num_tokens - num_published >= token_batch_size) {
+            publish_tokens(head.next, cur, false);
+            num_published = num_tokens;
+        }
+
         // 空白文字をスキップ
         if(isspace(*p)) {
             p++;
@@ -392,6 +457,42 @@ Token *tokenize() {
         error_at(p, "トークナイズできません");
     }
 
-    new_token(TK_EOF, cur, p, 0);
+    cur = new_token(TK_EOF, cur, p, 0);
+    if(token_pipelined) {
+        publish_tokens(head.next, cur, true);
+    }
     return head.next;
+}
+
+static void *tokenize_thread(void *arg) {
+    tokenize();
+    return NULL;
+}
+
+// トークナイザを別スレッドで起動し、先頭のトークンを返す。
+// パーサはnext_token()を通じて、トークナイザが公開したトークンから順に読み進める。
+Token *tokenize_pipelined() {
+    pthread_mutex_init(&token_mutex, NULL);
+    pthread_cond_init(&token_cond, NULL);
+
+    // まだ何も公開されていないことを表すダミーの値
+    Token dummy;
+    token_pipelined = true;
+    token_avail = &dummy;
+    token_published = &dummy;
+
+    pthread_t th;
+    if(pthread_create(&th, NULL, &tokenize_thread, NULL)) {
+        error("cannot create tokenizer thread");
+    }
+    pthread_detach(th);
+
+    pthread_mutex_lock(&token_mutex);
+    while(token_published == &dummy) {
+        pthread_cond_wait(&token_cond, &token_mutex);
+    }
+    token_avail = token_published;
+    Token *first = token_first;
+    pthread_mutex_unlock(&token_mutex);
+    return first;
 }
\ No newline at end of file
@@ -0,0 +1,457 @@
+#include "zxcc.h"
+
+// forループの展開(-O1以上)。
+//
+// 単純な帰納変数で回るforループ
+//
+//   for(i = 初期値; i < 上限; i += 増分) 本体    (<=、i++、++iも可)
+//
+// を対象にする。iはint型かlong型のローカル変数で、本体で書き換えたりアドレスを
+// 取ったりしないものに限る。増分は正の定数。
+//
+// 初期値と上限が定数で回数が少ない場合は、ループを完全に展開し、各回の本体の
+// iをその回の値の定数に置き換える。
+//
+//   { i = 0; 本体[i→0]; 本体[i→1]; 本体[i→2]; i = 3; }
+//
+// 上限が定数か本体で書き換えない変数の場合は、本体opt_unroll回分を1周で実行する
+// ループと、残りを1回ずつ実行するループに分ける。
+//
+//   for(i = 初期値; i + (opt_unroll-1)*増分 < 上限;) { 本体; i += 増分; ... }
+//   for(; i < 上限; i += 増分) 本体
+//
+// 本体にbreak、continue、ラベル、switchを含むループは展開しない。
+
+// 完全に展開するループの回数と、展開後のノード数の上限
+static int full_max_trips = 16;
+static int full_max_nodes = 128;
+// 部分的に展開するループの本体のノード数の上限
+static int partial_max_nodes = 40;
+
+// 展開中のループの帰納変数
+static Var *iv;
+
+static Node *new_node(NodeKind kind, Type *ty) {
+    Node *node = calloc(1, sizeof(Node));
+    node->kind = kind;
+    node->type = ty;
+    return node;
+}
+
+static Node *new_num(long val, Type *ty) {
+    Node *node = new_node(ND_NUM, ty);
+    node->val = val;
+    return node;
+}
+
+static Node *new_var_ref(Var *var) {
+    Node *node = new_node(ND_VAR, var->type);
+    node->var = var;
+    return node;
+}
+
+//
+// ループの解析
+//
+
+// 本体nodeのノード数を数える。展開できないノードを含む場合は-1を返す。
+// depthは本体の中でさらに内側にあるループの深さ。
+static int count_body(Node *node, int depth) {
+    if(!node) {
+        return 0;
+    }
+
+    switch(node->kind) {
+        case ND_LABEL:
+        case ND_SWITCH:
+        case ND_CASE:
+            return -1;
+        case ND_BREAK:
+        case ND_CONTINUE:
+            if(depth == 0) {
+                return -1;
+            }
+    }
+
+    bool is_loop = node->kind == ND_FOR || node->kind == ND_WHILE ||
+                   node->kind == ND_DO;
+    int d = is_loop ? depth + 1 : depth;
+
+    int n = 1;
+    Node *kids[7] = {node->lhs,  node->rhs,  node->cond, node->then,
+                     node->els,  node->init, node->post};
+    for(int i = 0; i < 7; i++) {
+        int m = count_body(kids[i], d);
+        if(m < 0) {
+            return -1;
+        }
+        n += m;
+    }
+    for(Node *cur = node->block; cur; cur = cur->next) {
+        int m = count_body(cur, d);
+        if(m < 0) {
+            return -1;
+        }
+        n += m;
+    }
+    for(Node *cur = node->args; cur; cur = cur->next) {
+        int m = count_body(cur, d);
+        if(m < 0) {
+            return -1;
+        }
+        n += m;
+    }
+    return n;
+}
+
+static bool is_var(Node *node, Var *var) {
+    return node && node->kind == ND_VAR && node->var == var;
+}
+
+// node以下で変数varに代入するか、varのアドレスを取るか
+bool writes_var(Node *node, Var *var) {
+    if(!node) {
+        return false;
+    }
+
+    switch(node->kind) {
+        case ND_ASSIGN:
+        case ND_PRE_INC:
+        case ND_PRE_DEC:
+        case ND_POST_INC:
+        case ND_POST_DEC:
+        case ND_ADD_EQ:
+        case ND_PTR_ADD_EQ:
+        case ND_SUB_EQ:
+        case ND_PTR_SUB_EQ:
+        case ND_MUL_EQ:
+        case ND_DIV_EQ:
+        case ND_SHL_EQ:
+        case ND_SHR_EQ:
+        case ND_BITAND_EQ:
+        case ND_BITOR_EQ:
+        case ND_BITXOR_EQ:
+            if(is_var(node->lhs, var)) {
+                return true;
+            }
+            break;
+        case ND_ADDR:
+            if(is_var(node->lhs, var)) {
+                return true;
+            }
+    }
+
+    Node *kids[7] = {node->lhs,  node->rhs,  node->cond, node->then,
+                     node->els,  node->init, node->post};
+    for(int i = 0; i < 7; i++) {
+        if(writes_var(kids[i], var)) {
+            return true;
+        }
+    }
+    for(Node *cur = node->block; cur; cur = cur->next) {
+        if(writes_var(cur, var)) {
+            return true;
+        }
+    }
+    for(Node *cur = node->args; cur; cur = cur->next) {
+        if(writes_var(cur, var)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// node以下でvarのアドレスを取るか
+static bool addr_taken(Node *node, Var *var) {
+    if(!node) {
+        return false;
+    }
+    if(node->kind == ND_ADDR && is_var(node->lhs, var)) {
+        return true;
+    }
+
+    Node *kids[7] = {node->lhs,  node->rhs,  node->cond, node->then,
+                     node->els,  node->init, node->post};
+    for(int i = 0; i < 7; i++) {
+        if(addr_taken(kids[i], var)) {
+            return true;
+        }
+    }
+    for(Node *cur = node->block; cur; cur = cur->next) {
+        if(addr_taken(cur, var)) {
+            return true;
+        }
+    }
+    for(Node *cur = node->args; cur; cur = cur->next) {
+        if(addr_taken(cur, var)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 関数funcの中でローカル変数varのアドレスを取るか
+bool local_addr_taken(Function *func, Var *var) {
+    for(Node *n = func->node; n; n = n->next) {
+        if(addr_taken(n, var)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 帰納変数に使えるローカル変数か
+static bool is_counter(Function *func, Node *node) {
+    if(!node || node->kind != ND_VAR || !node->var->is_local) {
+        return false;
+    }
+    TypeKind ty = node->var->type->ty;
+    return (ty == INT || ty == LONG) && !local_addr_taken(func, node->var);
+}
+
+// forループのpostが「i++」「++i」「i += 定数」なら増分を、そうでなければ0を返す
+static long loop_step(Node *post) {
+    if(!post || post->kind != ND_EXPR_STMT || !is_var(post->lhs->lhs, iv)) {
+        return 0;
+    }
+
+    Node *node = post->lhs;
+    if(node->kind == ND_POST_INC || node->kind == ND_PRE_INC) {
+        return 1;
+    }
+    if(node->kind == ND_ADD_EQ && node->rhs->kind == ND_NUM &&
+       node->rhs->val > 0) {
+        return node->rhs->val;
+    }
+    return 0;
+}
+
+// forループのinitが「i = 定数」(宣言を含む)なら、その定数を*valに設定する
+static bool initial_value(Node *init, long *val) {
+    if(init && init->kind == ND_BLOCK && init->block && !init->block->next) {
+        init = init->block;
+    }
+    if(!init || init->kind != ND_EXPR_STMT || init->lhs->kind != ND_ASSIGN) {
+        return false;
+    }
+
+    Node *assign = init->lhs;
+    if(!is_var(assign->lhs, iv) || assign->rhs->kind != ND_NUM) {
+        return false;
+    }
+    *val = assign->rhs->val;
+    return true;
+}
+
+// 上限の式nodeが、ループの本体bodyで値が変わらない単純な式か
+static bool is_loop_invariant(Function *func, Node *node, Node *body) {
+    if(node->kind == ND_NUM) {
+        return true;
+    }
+    return is_counter(func, node) && node->var != iv &&
+           !writes_var(body, node->var);
+}
+
+//
+// ループの書き換え
+//
+
+// nodeを複製する。帰納変数の参照は定数valに置き換える(substが偽なら置き換えない)。
+static Node *clone_node(Node *node, bool subst, long val) {
+    if(!node) {
+        return NULL;
+    }
+    if(subst && is_var(node, iv)) {
+        return new_num(val, iv->type);
+    }
+
+    Node *copy = calloc(1, sizeof(Node));
+    memcpy(copy, node, sizeof(Node));
+    copy->next = NULL;
+    copy->lhs = clone_node(node->lhs, subst, val);
+    copy->rhs = clone_node(node->rhs, subst, val);
+    copy->cond = clone_node(node->cond, subst, val);
+    copy->then = clone_node(node->then, subst, val);
+    copy->els = clone_node(node->els, subst, val);
+    copy->init = clone_node(node->init, subst, val);
+    copy->post = clone_node(node->post, subst, val);
+
+    Node head = {};
+    Node *cur = &head;
+    for(Node *n = node->block; n; n = n->next) {
+        cur->next = clone_node(n, subst, val);
+        cur = cur->next;
+    }
+    copy->block = head.next;
+
+    head.next = NULL;
+    cur = &head;
+    for(Node *n = node->args; n; n = n->next) {
+        cur->next = clone_node(n, subst, val);
+        cur = cur->next;
+    }
+    copy->args = head.next;
+
+    if(node->func_name) {
+        copy->func_name = strndup(node->func_name, strlen(node->func_name));
+    }
+    if(node->label_name) {
+        copy->label_name = strndup(node->label_name, strlen(node->label_name));
+    }
+    return copy;
+}
+
+// nodeの後ろにリストlistを繋ぎ、リストの末尾を返す
+static Node *append(Node *node, Node *list) {
+    node->next = list;
+    while(node->next) {
+        node = node->next;
+    }
+    return node;
+}
+
+// 型tyの変数に入る値か
+static bool fits_type(Type *ty, long val) {
+    return ty->size == 8 || val == (int)val;
+}
+
+// ループnodeを完全に展開する。展開できない場合は偽を返す。
+static bool unroll_full(Node *node, long step, int body_nodes) {
+    long start;
+    Node *limit = node->cond->rhs;
+    if(!initial_value(node->init, &start) || limit->kind != ND_NUM) {
+        return false;
+    }
+
+    long end = limit->val + (node->cond->kind == ND_LE);
+    long trips = start < end ? (end - start + step - 1) / step : 0;
+    long last = start + trips * step;
+    if(trips > full_max_trips || trips * body_nodes > full_max_nodes ||
+       !fits_type(iv->type, last)) {
+        return false;
+    }
+
+    Node head = {};
+    Node *cur = append(&head, node->init);
+    for(long k = 0; k < trips; k++) {
+        cur = append(cur, clone_node(node->then, true, start + k * step));
+    }
+
+    // ループの後でも帰納変数を使えるよう、最後の値を代入しておく
+    Node *assign = new_node(ND_ASSIGN, iv->type);
+    assign->lhs = new_var_ref(iv);
+    assign->rhs = new_num(last, iv->type);
+    Node *stmt = new_node(ND_EXPR_STMT, NULL);
+    stmt->lhs = assign;
+    cur->next = stmt;
+
+    node->kind = ND_BLOCK;
+    node->block = head.next;
+    node->init = NULL;
+    node->cond = NULL;
+    node->then = NULL;
+    node->post = NULL;
+    return true;
+}
+
+// ループnodeをopt_unroll倍に展開したループと、残りを回すループに分ける
+static void unroll_partial(Node *node, long step) {
+    int factor = opt_unroll;
+
+    // 本体と増分をfactor回並べたもの
+    Node head = {};
+    Node *cur = &head;
+    for(int k = 0; k < factor; k++) {
+        cur = append(cur, clone_node(node->then, false, 0));
+        cur = append(cur, clone_node(node->post, false, 0));
+    }
+    Node *body = new_node(ND_BLOCK, NULL);
+    body->block = head.next;
+
+    // i + (factor-1)*増分 < 上限
+    Node *sum = new_node(ND_ADD, long_type);
+    sum->lhs = new_var_ref(iv);
+    sum->rhs = new_num((factor - 1) * step, long_type);
+    Node *cond = new_node(node->cond->kind, int_type);
+    cond->lhs = sum;
+    cond->rhs = clone_node(node->cond->rhs, false, 0);
+
+    Node *main_loop = new_node(ND_FOR, NULL);
+    main_loop->cond = cond;
+    main_loop->then = body;
+
+    // 残りのループは元のループから初期化を除いたもの
+    Node *rest = calloc(1, sizeof(Node));
+    memcpy(rest, node, sizeof(Node));
+    rest->init = NULL;
+
+    cur = append(&head, node->init);
+    cur = append(cur, main_loop);
+    cur->next = rest;
+
+    Node *next = node->next;
+    memset(node, 0, sizeof(Node));
+    node->kind = ND_BLOCK;
+    node->block = head.next;
+    node->next = next;
+    rest->next = NULL;
+}
+
+// forループnodeを展開できれば展開する
+static void unroll_loop(Function *func, Node *node) {
+    Node *cond = node->cond;
+    if(!cond || (cond->kind != ND_LT && cond->kind != ND_LE) ||
+       !is_counter(func, cond->lhs)) {
+        return;
+    }
+    iv = cond->lhs->var;
+
+    long step = loop_step(node->post);
+    if(!step || writes_var(node->then, iv) ||
+       !is_loop_invariant(func, cond->rhs, node->then)) {
+        return;
+    }
+
+    int n = count_body(node->then, 0);
+    if(n < 0) {
+        return;
+    }
+    if(unroll_full(node, step, n)) {
+        return;
+    }
+    if(opt_unroll > 1 && n <= partial_max_nodes) {
+        unroll_partial(node, step);
+    }
+}
+
+// node以下のforループを内側から順に展開する
+static void unroll_node(Function *func, Node *node) {
+    if(!node) {
+        return;
+    }
+
+    unroll_node(func, node->lhs);
+    unroll_node(func, node->rhs);
+    unroll_node(func, node->cond);
+    unroll_node(func, node->then);
+    unroll_node(func, node->els);
+    unroll_node(func, node->init);
+    unroll_node(func, node->post);
+    for(Node *n = node->block; n; n = n->next) {
+        unroll_node(func, n);
+    }
+    for(Node *n = node->args; n; n = n->next) {
+        unroll_node(func, n);
+    }
+
+    if(node->kind == ND_FOR) {
+        unroll_loop(func, node);
+    }
+}
+
+// 関数funcのforループを展開する
+void unroll_loops(Function *func) {
+    for(Node *node = func->node; node; node = node->next) {
+        unroll_node(func, node);
+    }
+}
@@ -0,0 +1,409 @@
+#include "zxcc.h"
+
+// ループのベクトル化(-O1以上)。
+//
+// 添字が1ずつ増える単純なforループ
+//
+//   for(i = 初期値; i < 上限; i++) 本体    (++i、i += 1も可)
+//
+// のうち、本体が次のどちらかの式文だけのものを対象にする。
+//
+//   a[i] = b[i] op c[i];    (opは+、-、&、|、^)
+//   a[i] = b[i] op x;       (xは本体で変わらない変数か定数)
+//   s += b[i];              (s = s + b[i]も可)
+//
+// ループを、SSE2(-mavx2ならAVX2)のベクトル命令で要素をW個ずつ処理するND_VECTORと、
+// 残りの要素を1つずつ処理するループに分ける。Wはベクトルレジスタに入る要素の数。
+//
+//   i = 初期値;
+//   if(i + W <= 上限 && aとb、cが重ならない)
+//       i += VEC((上限 - i) & -W, &a[i], &b[i], &c[i]);
+//   while(i < 上限) { a[i] = b[i] op c[i]; i++; }
+//
+// 配列の要素はchar、short、int、long型で、全て同じサイズのものに限る。加減算と
+// ビット演算の結果の下位ビットは上位ビットに影響されないので、要素のサイズで計算しても
+// 書き込むときに切り詰めた値と一致する。和を求める場合はsも要素と同じサイズにする。
+//
+// aがbやcより少し後ろを指す場合は、前の回で書き込んだ要素を後の回で読み出すので、
+// まとめて読み出すと結果が変わる。そのような重なりは実行時にアドレスの差で調べ、
+// 重なる場合は全て1つずつ処理する。ベクトル命令はアラインメントを問わない
+// メモリアクセスを使うので、先頭を揃えるために1つずつ処理するループは設けない。
+
+// 変換中のループの帰納変数
+static Var *iv;
+
+static Node *new_node(NodeKind kind, Type *ty) {
+    Node *node = calloc(1, sizeof(Node));
+    node->kind = kind;
+    node->type = ty;
+    return node;
+}
+
+static Node *new_binary(NodeKind kind, Type *ty, Node *lhs, Node *rhs) {
+    Node *node = new_node(kind, ty);
+    node->lhs = lhs;
+    node->rhs = rhs;
+    return node;
+}
+
+static Node *new_num(long val, Type *ty) {
+    Node *node = new_node(ND_NUM, ty);
+    node->val = val;
+    return node;
+}
+
+static Node *new_var_ref(Var *var) {
+    Node *node = new_node(ND_VAR, var->type);
+    node->var = var;
+    return node;
+}
+
+static Node *new_expr_stmt(Node *expr) {
+    Node *node = new_node(ND_EXPR_STMT, NULL);
+    node->lhs = expr;
+    return node;
+}
+
+// 変数の参照か定数のnodeを複製する
+static Node *clone_leaf(Node *node) {
+    if(node->kind == ND_NUM) {
+        return new_num(node->val, node->type);
+    }
+    return new_var_ref(node->var);
+}
+
+//
+// ループの解析
+//
+
+static bool is_var(Node *node, Var *var) {
+    return node && node->kind == ND_VAR && node->var == var;
+}
+
+// アドレスを取らないint型かlong型のローカル変数か
+static bool is_int_local(Function *func, Node *node) {
+    if(node->kind != ND_VAR || !node->var->is_local) {
+        return false;
+    }
+    TypeKind ty = node->var->type->ty;
+    return (ty == INT || ty == LONG) && !local_addr_taken(func, node->var);
+}
+
+// nodeが本体bodyで値が変わらない定数か変数か
+static bool is_invariant(Function *func, Node *node, Node *body) {
+    if(node->kind == ND_NUM) {
+        return true;
+    }
+    return is_int_local(func, node) && node->var != iv &&
+           !writes_var(body, node->var);
+}
+
+// forループのpostが「i++」「++i」「i += 1」か
+static bool is_unit_step(Node *post) {
+    if(!post || post->kind != ND_EXPR_STMT || !is_var(post->lhs->lhs, iv)) {
+        return false;
+    }
+
+    Node *node = post->lhs;
+    if(node->kind == ND_POST_INC || node->kind == ND_PRE_INC) {
+        return true;
+    }
+    return node->kind == ND_ADD_EQ && node->rhs->kind == ND_NUM &&
+           node->rhs->val == 1;
+}
+
+// ベクトル化できる要素の型か
+static bool is_vector_elem(Type *ty) {
+    return ty->ty == CHAR || ty->ty == SHORT || ty->ty == INT || ty->ty == LONG;
+}
+
+// nodeが「base[i]」なら配列の先頭を表すbaseを返す。baseは配列の変数か、
+// 本体bodyで書き換えず、アドレスも取らないローカル変数のポインタに限る。
+static Node *array_base(Function *func, Node *node, Node *body) {
+    if(node->kind != ND_DEREF || !is_vector_elem(node->type)) {
+        return NULL;
+    }
+    Node *add = node->lhs;
+    if(add->kind != ND_PTR_ADD || !is_var(add->rhs, iv)) {
+        return NULL;
+    }
+
+    Node *base = add->lhs;
+    if(base->kind != ND_VAR) {
+        return NULL;
+    }
+    Var *var = base->var;
+    if(var->type->ty == ARRAY) {
+        return base;
+    }
+    if(var->type->ty != PTR || !var->is_local ||
+       writes_var(body, var) || local_addr_taken(func, var)) {
+        return NULL;
+    }
+    return base;
+}
+
+// 要素ごとの演算にできる二項演算か
+static bool is_vector_op(NodeKind kind) {
+    return kind == ND_ADD || kind == ND_SUB || kind == ND_BITAND ||
+           kind == ND_BITOR || kind == ND_BITXOR;
+}
+
+// ループの本体が単一の式文ならその式を返す
+static Node *body_expr(Node *body) {
+    if(body && body->kind == ND_BLOCK && body->block && !body->block->next) {
+        body = body->block;
+    }
+    if(!body || body->kind != ND_EXPR_STMT) {
+        return NULL;
+    }
+    return body->lhs;
+}
+
+//
+// ループの書き換え
+//
+
+// 配列baseのi番目の要素のアドレス「base + i」
+static Node *elem_addr(Node *base, Type *elem) {
+    return new_binary(ND_PTR_ADD, pointer_to(elem), clone_leaf(base),
+                      new_var_ref(iv));
+}
+
+// ベクトル命令で処理する要素数「(上限 - i) & -W」
+static Node *vector_count(Node *limit, int width) {
+    Node *rest = new_binary(ND_SUB, long_type, clone_leaf(limit),
+                            new_var_ref(iv));
+    return new_binary(ND_BITAND, long_type, rest, new_num(-width, long_type));
+}
+
+// 配列の先頭アドレスの差「(long)dst - (long)src」
+static Node *base_diff(Node *dst, Node *src) {
+    Node *lhs = new_node(ND_CAST, long_type);
+    lhs->lhs = clone_leaf(dst);
+    Node *rhs = new_node(ND_CAST, long_type);
+    rhs->lhs = clone_leaf(src);
+    return new_binary(ND_SUB, long_type, lhs, rhs);
+}
+
+// 配列dstに書き込んだ要素を、後の回で配列srcから読み出さないことの判定。
+// 差dst - srcが0以下か、ベクトル1つ分のbytes以上であればよい。
+// 同じ配列か、別々の配列の変数で判定が不要ならNULLを返す。
+static Node *no_overlap(Node *dst, Node *src, int bytes) {
+    if(dst->var == src->var) {
+        return NULL;
+    }
+    if(dst->var->type->ty == ARRAY && src->var->type->ty == ARRAY) {
+        return NULL;
+    }
+
+    Node *before = new_binary(ND_LE, int_type, base_diff(dst, src),
+                              new_num(0, long_type));
+    Node *apart = new_binary(ND_LE, int_type, new_num(bytes, long_type),
+                             base_diff(dst, src));
+    return new_binary(ND_LOGOR, int_type, before, apart);
+}
+
+// 条件condとexprの論理積(condがNULLならexpr)
+static Node *and_cond(Node *cond, Node *expr) {
+    if(!expr) {
+        return cond;
+    }
+    if(!cond) {
+        return expr;
+    }
+    return new_binary(ND_LOGAND, int_type, cond, expr);
+}
+
+// ループnodeを、vecで要素をまとめて処理する部分と、残りを1つずつ処理するループに
+// 置き換える。vecの値は、和を求める場合はsに足し、それ以外は処理した要素数になる。
+// guardはベクトル命令を使える場合の条件(NULLなら無条件)。
+static void split_loop(Node *node, Node *vec, Var *sum, Node *guard) {
+    Node *limit = node->cond->rhs;
+    int width = (opt_avx2 ? 32 : 16) / vec->vec_size;
+
+    // i + W <= 上限
+    Node *enough = new_binary(ND_LE, int_type,
+                              new_binary(ND_ADD, long_type, new_var_ref(iv),
+                                         new_num(width, long_type)),
+                              clone_leaf(limit));
+
+    Node *then;
+    if(sum) {
+        // s += VEC(...); i += (上限 - i) & -W;
+        Node *add = new_binary(ND_ADD_EQ, sum->type, new_var_ref(sum), vec);
+        then = new_node(ND_BLOCK, NULL);
+        then->block = new_expr_stmt(add);
+        then->block->next = new_expr_stmt(new_binary(
+            ND_ADD_EQ, iv->type, new_var_ref(iv), vector_count(limit, width)));
+    } else {
+        then = new_expr_stmt(
+            new_binary(ND_ADD_EQ, iv->type, new_var_ref(iv), vec));
+    }
+
+    Node *vec_if = new_node(ND_IF, NULL);
+    vec_if->cond = and_cond(enough, guard);
+    vec_if->then = then;
+
+    // 残りのループ。展開の対象にならないようwhileループにする。
+    Node *body = new_node(ND_BLOCK, NULL);
+    body->block = node->then;
+    node->then->next = node->post;
+    Node *rest = new_node(ND_WHILE, NULL);
+    rest->cond = node->cond;
+    rest->then = body;
+
+    Node *init = node->init;
+    Node *next = node->next;
+    memset(node, 0, sizeof(Node));
+    node->kind = ND_BLOCK;
+    node->next = next;
+    if(init) {
+        node->block = init;
+        init->next = vec_if;
+    } else {
+        node->block = vec_if;
+    }
+    vec_if->next = rest;
+}
+
+// ND_VECTORを作る。argsは要素数に続くアドレスなど。
+static Node *new_vector(VecKind kind, NodeKind op, Type *elem, Node *args) {
+    Node *node = new_node(ND_VECTOR, kind == VEC_SUM ? elem : long_type);
+    node->vec_kind = kind;
+    node->vec_op = op;
+    node->vec_size = elem->size;
+    node->args = args;
+    return node;
+}
+
+// 本体が「s += b[i]」のループを変換する
+static bool vectorize_sum(Function *func, Node *node, Node *expr) {
+    Node *lhs = expr->lhs;
+    Node *rhs = expr->rhs;
+    if(expr->kind == ND_ASSIGN) {
+        // s = s + b[i]
+        if(rhs->kind != ND_ADD || !is_var(rhs->lhs, lhs->var)) {
+            return false;
+        }
+        rhs = rhs->rhs;
+    } else if(expr->kind != ND_ADD_EQ) {
+        return false;
+    }
+
+    if(!is_int_local(func, lhs) || lhs->var == iv) {
+        return false;
+    }
+    Node *src = array_base(func, rhs, node->then);
+    Type *elem = rhs->type;
+    if(!src || elem->size != lhs->type->size || elem->size < 4) {
+        return false;
+    }
+
+    int width = (opt_avx2 ? 32 : 16) / elem->size;
+    Node *count = vector_count(node->cond->rhs, width);
+    count->next = elem_addr(src, elem);
+    Node *vec = new_vector(VEC_SUM, ND_ADD, elem, count);
+    split_loop(node, vec, lhs->var, NULL);
+    return true;
+}
+
+// 本体が「a[i] = b[i] op c[i]」のループを変換する
+static bool vectorize_elementwise(Function *func, Node *node, Node *expr) {
+    Node *body = node->then;
+    Node *dst = array_base(func, expr->lhs, body);
+    Node *op = expr->rhs;
+    if(!dst || !is_vector_op(op->kind)) {
+        return false;
+    }
+
+    Type *elem = expr->lhs->type;
+    Node *src1 = array_base(func, op->lhs, body);
+    if(!src1 || op->lhs->type->size != elem->size) {
+        return false;
+    }
+
+    int bytes = opt_avx2 ? 32 : 16;
+    Node *guard = no_overlap(dst, src1, bytes);
+    Node *count = vector_count(node->cond->rhs, bytes / elem->size);
+    Node *cur = count;
+    cur->next = elem_addr(dst, elem);
+    cur = cur->next;
+    cur->next = elem_addr(src1, elem);
+    cur = cur->next;
+
+    VecKind kind = VEC_ARRAYS;
+    Node *src2 = array_base(func, op->rhs, body);
+    if(src2) {
+        if(op->rhs->type->size != elem->size) {
+            return false;
+        }
+        guard = and_cond(guard, no_overlap(dst, src2, bytes));
+        cur->next = elem_addr(src2, elem);
+    } else if(is_invariant(func, op->rhs, body)) {
+        kind = VEC_SCALAR;
+        cur->next = clone_leaf(op->rhs);
+    } else {
+        return false;
+    }
+
+    split_loop(node, new_vector(kind, op->kind, elem, count), NULL, guard);
+    return true;
+}
+
+// forループnodeをベクトル化できればベクトル化する
+static void vectorize_loop(Function *func, Node *node) {
+    Node *cond = node->cond;
+    if(!cond || cond->kind != ND_LT || !is_int_local(func, cond->lhs)) {
+        return;
+    }
+    iv = cond->lhs->var;
+    if(!is_unit_step(node->post) || writes_var(node->then, iv) ||
+       !is_invariant(func, cond->rhs, node->then)) {
+        return;
+    }
+
+    Node *expr = body_expr(node->then);
+    if(!expr || (expr->kind != ND_ASSIGN && expr->kind != ND_ADD_EQ)) {
+        return;
+    }
+    if(expr->lhs->kind == ND_DEREF) {
+        if(expr->kind == ND_ASSIGN) {
+            vectorize_elementwise(func, node, expr);
+        }
+        return;
+    }
+    vectorize_sum(func, node, expr);
+}
+
+// node以下のforループをベクトル化する
+static void vectorize_node(Function *func, Node *node) {
+    if(!node) {
+        return;
+    }
+
+    vectorize_node(func, node->lhs);
+    vectorize_node(func, node->rhs);
+    vectorize_node(func, node->cond);
+    vectorize_node(func, node->then);
+    vectorize_node(func, node->els);
+    vectorize_node(func, node->init);
+    vectorize_node(func, node->post);
+    for(Node *n = node->block; n; n = n->next) {
+        vectorize_node(func, n);
+    }
+    for(Node *n = node->args; n; n = n->next) {
+        vectorize_node(func, n);
+    }
+
+    if(node->kind == ND_FOR) {
+        vectorize_loop(func, node);
+    }
+}
+
+// 関数funcの単純な配列のループをベクトル化する
+void vectorize_loops(Function *func) {
+    for(Node *node = func->node; node; node = node->next) {
+        vectorize_node(func, node);
+    }
+}
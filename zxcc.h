@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -9,6 +10,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 typedef struct Type Type;
 typedef struct Member Member;
@@ -50,6 +56,9 @@ void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void warn(Token *tok, char *fmt, ...);
 Token *tokenize();
+Token *tokenize_pipelined();
+Token *next_token(Token *tok);
+void free_tokens(Token *tok, Token *end);
 Token *consume(char *op);
 bool match(char *op);
 Token *consume_ident();
@@ -126,8 +135,17 @@ typedef enum {
     ND_BITNOT,      // ~
     ND_LOGAND,      // &&
     ND_LOGOR,       // ||
+    ND_VECTOR,      // ベクトル命令で処理する配列の演算(vectorize.c)
 } NodeKind;
 
+// ND_VECTORとIR_VECの処理の種類。argsには要素数nに続けて配列のアドレスを並べる。
+// nはベクトルレジスタに入る要素の数の倍数。
+typedef enum {
+    VEC_ARRAYS,  // dst[k] = src1[k] op src2[k] (0 <= k < n)。値はn
+    VEC_SCALAR,  // dst[k] = src1[k] op x。argsの最後はx。値はn
+    VEC_SUM,     // src1[0]からsrc1[n-1]までの和
+} VecKind;
+
 // 変数の型
 typedef struct Var Var;
 struct Var {
@@ -136,7 +154,9 @@ struct Var {
     bool is_local;  // ローカル変数か
 
     // ローカル変数
-    int offset;  // RBPからのオフセット
+    int offset;       // RBPからのオフセット
+    int reg;          // 中間表現で変数を置く仮想レジスタ(0ならメモリに置く)
+    bool addr_taken;  // アドレスを取られているか
 
     // グローバル変数
     bool is_static;
@@ -176,6 +196,7 @@ struct Node {
     // 関数呼び出し
     char *func_name;
     Node *args;
+    bool is_variadic_call;  // 可変長引数の関数か、引数の宣言がない関数の呼び出しか
 
     // Goto or ラベル付きstatement
     char *label_name;
@@ -185,9 +206,16 @@ struct Node {
     Node *default_case;
     int case_label;
     int case_end_label;
+    Node **cases;   // caseを値の昇順に並べた配列
+    int num_cases;
 
     // ND_VAR用
     Var *var;
+
+    // ND_VECTOR用
+    VecKind vec_kind;
+    NodeKind vec_op;  // 要素ごとの演算(ND_ADDなど)
+    int vec_size;     // 要素のサイズ
 };
 
 // グローバル変数の初期化子。グローバル変数は以下の要素によって初期化可能
@@ -205,6 +233,9 @@ struct Initializer {
     long addend;
 };
 
+typedef struct BB BB;
+typedef struct Loop Loop;
+
 typedef struct Function Function;
 struct Function {
     Function *next;
@@ -216,6 +247,24 @@ struct Function {
     Node *node;
     VarList *locals;
     int stack_size;
+
+    // 関数キャッシュ用
+    char *cache_key;  // キャッシュのキー(キャッシュが無効な場合はNULL)
+    char *asm_text;   // キャッシュから読み込んだ出力(ヒットしなかった場合はNULL)
+    int asm_len;
+    VarList *data;    // 関数内の文字列リテラル、staticローカル変数
+
+    // 中間表現(-O1以上)
+    BB *bbs;       // 基本ブロックのリスト(配置順)
+    int num_bbs;   // 基本ブロックの数
+    int num_regs;  // 仮想レジスタの数
+    Loop *loops;   // ループのリスト(内側のループが先)
+
+    // レジスタ割り当ての結果
+    int *reg_map;     // 仮想レジスタに割り当てた物理レジスタ(-1ならスタック)
+    int *spill_slot;  // スタックに置く仮想レジスタの退避領域の番号
+    int num_spills;   // 退避領域の数
+    int used_regs;    // 使用した物理レジスタのビット集合
 };
 
 typedef struct Program Program;
@@ -225,6 +274,7 @@ struct Program {
 };
 
 Program *program();
+void free_function(Function *func);
 
 //
 // type.c
@@ -250,6 +300,7 @@ struct Type {
     int size;            // sizeofの返り値
     int align;           // アライメント
     bool is_incomplete;  // 不完全な型か
+    bool is_variadic;    // 可変長引数の関数か、引数の宣言がない関数か
 
     struct Type *ptr_to;
     int array_len;    // 配列の要素数
@@ -286,4 +337,206 @@ int align_to(int n, int align);
 // codegen.c
 //
 
-void codegen(Program *prog);
\ No newline at end of file
+extern int codegen_jobs;
+
+void codegen(Program *prog);
+void codegen_begin(void);
+void codegen_function(Function *func);
+void codegen_end(Program *prog);
+bool use_jump_table(Node *node);
+bool can_rotate(Node *node);
+int log2_exact(long val);
+long mod_inverse(long d);
+long div_magic(long d, int *shift);
+bool is_int32_value(Node *node);
+
+//
+// ir.c
+//
+
+// 中間表現の命令の種類。特に断りがない限りdst = a op bを表す。
+typedef enum {
+    IR_IMM,       // dst = imm
+    IR_MOV,       // dst = a
+    IR_ADD,       // +
+    IR_SUB,       // -
+    IR_MUL,       // *
+    IR_DIV,       // /
+    IR_AND,       // &
+    IR_OR,        // |
+    IR_XOR,       // ^
+    IR_SHL,       // <<
+    IR_SHR,       // >> (算術シフト)
+    IR_EQ,        // ==
+    IR_NE,        // !=
+    IR_LT,        // <
+    IR_LE,        // <=
+    IR_NOT,       // dst = ~a
+    IR_SEXT,      // dst = aの下位sizeバイトを符号拡張した値
+    IR_LVAR,      // dst = ローカル変数varのアドレス
+    IR_GVAR,      // dst = グローバル変数nameのアドレス
+    IR_LOAD,      // dst = アドレスaからsizeバイト読み出した値
+    IR_STORE,     // アドレスaにbの下位sizeバイトを書き込む
+    IR_PARAM,     // dst = imm番目の引数
+    IR_CALL,      // dst = name(args[0], ..., args[nargs-1])
+    IR_VA_START,  // aが指すva_listを初期化する
+    IR_VEC,       // dst = args[0]個の要素をベクトル命令で処理した値(VecKindを参照)
+    IR_JMP,       // thenへジャンプする
+    IR_BR,        // a cmp bが成り立てばthen、成り立たなければelsへジャンプする
+    IR_JTAB,      // aがimm+iならtargets[i]へ、範囲外ならelsへジャンプする
+    IR_RET,       // aを返す(aが0の場合は値なし)
+} IROp;
+
+// 中間表現の命令。dst、a、bは仮想レジスタの番号(0は未使用)。
+typedef struct IR IR;
+struct IR {
+    IR *next;
+    IROp op;
+    int dst;
+    int a;
+    int b;
+    long imm;
+    int size;
+
+    char *name;  // IR_GVAR, IR_CALL
+    Var *var;    // IR_LVAR
+    BB *then;    // IR_JMP, IR_BR
+    BB *els;     // IR_BR, IR_JTAB
+    IROp cmp;    // IR_BR: IR_EQ、IR_NE、IR_LT、IR_LEのいずれか。bが0なら0と比較する
+    int *args;   // IR_CALL, IR_VEC
+    int nargs;
+    bool is_variadic_call;  // IR_CALL
+    VecKind vec_kind;       // IR_VEC
+    IROp vec_op;            // IR_VEC: 要素ごとの演算。sizeは要素のサイズ
+    BB **targets;  // IR_JTAB
+    int num_targets;
+};
+
+// 基本ブロック。最後の命令以外に分岐を含まない命令の列。
+struct BB {
+    BB *next;  // 配置順で次の基本ブロック
+    int label;
+    IR *ir;    // 先頭の命令
+    IR *last;  // 最後の命令
+};
+
+// ループ。ループに入る経路はpreheaderからheaderへの辺だけとは限らないので、
+// 使う側で確かめる。
+struct Loop {
+    Loop *next;
+    BB *preheader;  // ループの直前のブロック(headerへのジャンプで終わる)
+    BB *header;     // ループに入ると最初に実行するブロック
+    BB *last;       // 配置順でループの最後のブロック
+    BB *cond;       // 回転したループの末尾の条件判定の先頭ブロック。ループに入る
+                    // 前に同じ判定を済ませているので、ここも毎回実行するとみなせる
+};
+
+void gen_ir(Function *func);
+void free_ir(Function *func);
+void dump_ir(Function *func, FILE *fp);
+
+//
+// regalloc.c
+//
+
+extern int num_alloc_regs;
+extern int num_caller_saved_regs;
+
+int bb_successors(BB *bb, BB **buf, BB ***out);
+void alloc_regs(Function *func);
+
+//
+// unroll.c
+//
+
+bool writes_var(Node *node, Var *var);
+bool local_addr_taken(Function *func, Var *var);
+void unroll_loops(Function *func);
+
+//
+// vectorize.c
+//
+
+void vectorize_loops(Function *func);
+
+//
+// licm.c
+//
+
+void licm(Function *func);
+
+//
+// peephole.c
+//
+
+void peephole(char *buf, int len);
+
+//
+// inline.c
+//
+
+void inline_reset(void);
+void inline_add(Function *func);
+void inline_function(Function *func);
+char *inline_cache_key(char *name);
+
+//
+// lto.c
+//
+
+void remove_unreachable(Program *prog, bool closed);
+void lto_optimize(Program *prog, bool closed);
+
+//
+// dce.c
+//
+
+void eliminate_dead_code(Function *func);
+
+//
+// output.c
+//
+
+void out_open(char *path);
+void out_set_fd(int fd);
+void out_flush(void);
+void out_close(void);
+void out_discard(void);
+void out_strn(char *s, int len);
+void out_str(char *s);
+void out_char(char c);
+void out_int(long val);
+void out_capture_begin(void);
+char *out_capture_end(int *len);
+void out_mem_begin(void);
+char *out_mem_end(int *len);
+
+//
+// cache.c
+//
+
+void cache_init(void);
+void cache_hash_begin(void);
+void cache_hash_bytes(char *p, int len);
+void cache_hash_str(char *s);
+void cache_hash_long(long val);
+char *cache_hash_end(void);
+char *cache_load(char *key, int *len);
+void cache_store(char *key, char *buf, int len);
+
+//
+// main.c
+//
+
+extern bool opt_pipeline;
+extern bool opt_stream;
+extern char *opt_cache_dir;
+extern bool opt_lto;
+extern int opt_level;
+extern bool opt_dump_ir;
+extern bool opt_regstack;
+extern bool opt_isel;
+extern bool opt_peephole;
+extern bool opt_keep_frame_pointer;
+extern int opt_unroll;
+extern bool opt_avx2;
\ No newline at end of file